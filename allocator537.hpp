@@ -0,0 +1,255 @@
+/*
+ * allocator537.hpp
+ * Standard library allocators on top of a mem537::tracker (malloc537.hpp),
+ * so containers' blocks get tracked without writing allocators by hand.
+ *
+ *  - mem537::allocator<T, Tracker> - a std::allocator replacement.
+ *    Every block is its own tracked block, and deallocate uses the
+ *    sized free, so a container handing back the wrong size is caught.
+ *  - mem537::resource<Tracker> - the same as a std::pmr::memory_resource.
+ *  - mem537::region_resource<Tracker> - a std::pmr::memory_resource that
+ *    puts a container's blocks together in a few big tracked chunks.
+ *    Deallocating is free (nothing to look up, the memory comes back when
+ *    the region goes away), and the tracker only sees the chunks - so
+ *    memcheck on the container's memory checks the chunk it's in.
+ *
+ * Each takes the tracker to use, or uses one shared Tracker per type
+ * (mem537::shared_tracker<Tracker>()).
+ *
+ * The pmr ones need C++17.
+ */
+#ifndef ALLOCATOR537_HPP
+#define ALLOCATOR537_HPP
+
+#include <cstddef>
+#include <new>
+#include "malloc537.hpp"
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+namespace mem537
+{
+
+template<class Tracker>
+Tracker & shared_tracker()
+{
+	static Tracker instance;
+	return instance;
+}
+
+template<class T, class Tracker = default_tracker>
+class allocator
+{
+public:
+	typedef T value_type;
+
+	allocator() : tracker(&shared_tracker<Tracker>()) {}
+	explicit allocator(Tracker & tracker) : tracker(&tracker) {}
+
+	template<class U>
+	allocator(const allocator<U, Tracker> & other) : tracker(other.tracker) {}
+
+	/*
+	 * Everything comes from malloc, so that's as aligned as we get.
+	 */
+	T * allocate(std::size_t count)
+	{
+		void * block;
+
+		static_assert(alignof(T) <= alignof(std::max_align_t), "mem537::allocator can't over-align");
+		if(count > static_cast<std::size_t>(-1) / sizeof(T))
+		{
+			throw std::bad_alloc();
+		}
+		block = tracker->malloc(count * sizeof(T));
+		if(block == NULL)
+		{
+			throw std::bad_alloc();
+		}
+		return static_cast<T *>(block);
+	}
+
+	void deallocate(T * block, std::size_t count)
+	{
+		tracker->free(block, count * sizeof(T));
+	}
+
+	template<class U>
+	struct rebind
+	{
+		typedef allocator<U, Tracker> other;
+	};
+
+	template<class U>
+	bool operator==(const allocator<U, Tracker> & other) const
+	{
+		return tracker == other.tracker;
+	}
+
+	template<class U>
+	bool operator!=(const allocator<U, Tracker> & other) const
+	{
+		return tracker != other.tracker;
+	}
+
+private:
+	template<class U, class OtherTracker>
+	friend class allocator;
+
+	Tracker * tracker;
+};
+
+#if __cplusplus >= 201703L
+
+template<class Tracker = default_tracker>
+class resource : public std::pmr::memory_resource
+{
+public:
+	resource() : tracker(&shared_tracker<Tracker>()) {}
+	explicit resource(Tracker & tracker) : tracker(&tracker) {}
+
+protected:
+	void * do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void * block;
+
+		if(alignment > alignof(std::max_align_t))
+		{
+			throw std::bad_alloc();
+		}
+		block = tracker->malloc(bytes);
+		if(block == NULL)
+		{
+			throw std::bad_alloc();
+		}
+		return block;
+	}
+
+	void do_deallocate(void * block, std::size_t bytes, std::size_t alignment) override
+	{
+		(void)alignment;
+		tracker->free(block, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+	{
+		const resource * same = dynamic_cast<const resource *>(&other);
+		return same != NULL && same->tracker == tracker;
+	}
+
+private:
+	Tracker * tracker;
+};
+
+template<class Tracker = default_tracker>
+class region_resource : public std::pmr::memory_resource
+{
+public:
+	/*
+	 * Chunks start at chunk_bytes and double as the region grows.
+	 */
+	explicit region_resource(std::size_t chunk_bytes = 64 * 1024)
+		: tracker(&shared_tracker<Tracker>()), next_chunk(chunk_bytes), chunks(NULL), cursor(NULL), end(NULL) {}
+
+	region_resource(Tracker & tracker, std::size_t chunk_bytes = 64 * 1024)
+		: tracker(&tracker), next_chunk(chunk_bytes), chunks(NULL), cursor(NULL), end(NULL) {}
+
+	~region_resource()
+	{
+		release();
+	}
+
+	region_resource(const region_resource &) = delete;
+	region_resource & operator=(const region_resource &) = delete;
+
+	/*
+	 * Frees every chunk. Everything allocated from the region is gone.
+	 */
+	void release()
+	{
+		chunk * doomed;
+
+		while(chunks != NULL)
+		{
+			doomed = chunks;
+			chunks = chunks->previous;
+			tracker->free(doomed, doomed->bytes);
+		}
+		cursor = NULL;
+		end = NULL;
+	}
+
+protected:
+	void * do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		char * aligned = align(cursor, alignment);
+
+		if(cursor == NULL || aligned + bytes > end)
+		{
+			grow(bytes + alignment);
+			aligned = align(cursor, alignment);
+		}
+		cursor = aligned + bytes;
+		return aligned;
+	}
+
+	void do_deallocate(void * block, std::size_t bytes, std::size_t alignment) override
+	{
+		(void)block;
+		(void)bytes;
+		(void)alignment;
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+	/*
+	 * Header at the start of each chunk.
+	 */
+	struct chunk
+	{
+		chunk * previous;
+		std::size_t bytes;
+		alignas(std::max_align_t) char data[1];
+	};
+
+	static char * align(char * ptr, std::size_t alignment)
+	{
+		std::size_t address = reinterpret_cast<std::size_t>(ptr);
+		return reinterpret_cast<char *>((address + alignment - 1) & ~(alignment - 1));
+	}
+
+	void grow(std::size_t at_least)
+	{
+		std::size_t bytes = offsetof(chunk, data) + (next_chunk > at_least ? next_chunk : at_least);
+		chunk * added = static_cast<chunk *>(tracker->malloc(bytes));
+
+		if(added == NULL)
+		{
+			throw std::bad_alloc();
+		}
+		added->previous = chunks;
+		added->bytes = bytes;
+		chunks = added;
+		cursor = added->data;
+		end = reinterpret_cast<char *>(added) + bytes;
+		next_chunk *= 2;
+	}
+
+	Tracker * tracker;
+	std::size_t next_chunk;
+	chunk * chunks;
+	char * cursor;
+	char * end;
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * backend.c
+ * Picks the index backend, see backend.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+
+#ifdef MALLOC537_LAZY
+#include "lazy.h"
+#endif
+
+/*
+ * The default heap's tree. With the hash index, every node is in there
+ * by base too. Whichever backend is in use keeps it up to date, and its
+ * lookup() goes there instead of down the tree; the tree is still there
+ * for the range searches.
+ */
+index_tree default_tree;
+
+#ifdef MALLOC537_HEAPS
+__thread index_tree * current_tree = &default_tree;
+#endif
+
+const index_backend * tree_backend = &rbtree_backend;
+
+/*
+ * Runs before main, so the backend never changes under a tree
+ * that's already got something in it.
+ */
+static void choose_backend() __attribute__((constructor));
+
+static void choose_backend()
+{
+	const index_backend * backends[] = { &rbtree_backend, &splay_backend };
+	char * env = getenv("MALLOC537_INDEX");
+	size_t i;
+
+	if(env != NULL && *env != '\0')
+	{
+		for(i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		{
+			if(strcmp(env, backends[i]->name) == 0)
+			{
+				tree_backend = backends[i];
+				break;
+			}
+		}
+		if(i == sizeof(backends) / sizeof(backends[0]))
+		{
+			printf("Unknown MALLOC537_INDEX \"%s\", use rbtree or splay!\n", env);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+#ifdef MALLOC537_LAZY
+	tree_backend = lazy_backend(tree_backend);
+#endif
+}
@@ -0,0 +1,146 @@
+/*
+ * backend.h
+ * The index malloc537 keeps its blocks in, behind a table of functions
+ * so the data structure can be picked when the program starts, with
+ * the MALLOC537_INDEX environment variable:
+ *  rbtree - the red-black tree (rbtree.c), the default.
+ *  splay  - a splay tree (splaytree.c). Every lookup moves the block it
+ *           found to the top, so blocks used over and over stay cheap.
+ * Both use the same nodes (rbtree.h), with parent and child links,
+ * so anything walking the tree works on either.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "rbtree.h"
+
+#ifdef MALLOC537_HASH_INDEX
+#include "hashindex.h"
+#endif
+
+/*
+ * One tree: its root, and with -DMALLOC537_HASH_INDEX the hash index
+ * kept next to it. The backends below work on current_tree, which is
+ * the default heap's tree unless the calling thread is in the middle of
+ * a call on a private heap (-DMALLOC537_HEAPS, see heap.h).
+ */
+typedef struct index_tree
+{
+	node * root;
+	/*
+	 * How many live blocks there are in each size class (see live_class
+	 * below), and a bit for each class above 0 that has any. No live
+	 * block starting further below an address than live_reach() can
+	 * reach it, which is as far back the splay tree's bounds_lookup has
+	 * to look.
+	 */
+	size_t live[65];
+	unsigned long long live_classes;
+#ifdef MALLOC537_HASH_INDEX
+	hash_index index;
+#endif
+}index_tree;
+
+extern index_tree default_tree;
+
+#ifdef MALLOC537_HEAPS
+extern __thread index_tree * current_tree;
+#else
+#define current_tree (&default_tree)
+#endif
+
+/*
+ * The size class of a block: how many bits its bounds take, so a block
+ * in class c is never bigger than 2^c - 1 bytes.
+ */
+static inline int live_class(size_t bounds)
+{
+	return bounds == 0 ? 0 : 64 - __builtin_clzll((unsigned long long)bounds);
+}
+
+/*
+ * Counts a block of bounds bytes that went live in current_tree. Both
+ * backends call this when they insert or build.
+ */
+static inline void live_add(size_t bounds)
+{
+	int class = live_class(bounds);
+
+	if(current_tree->live[class]++ == 0 && class > 0)
+	{
+		current_tree->live_classes |= 1ull << (class - 1);
+	}
+}
+
+/*
+ * Marks a live node freed. Anything freeing a node goes through here
+ * rather than set_free, so the counts above stay right.
+ */
+static inline void mark_freed(node * temp)
+{
+	int class = live_class(node_bounds(temp));
+
+	set_free(temp, 1);
+	if(--current_tree->live[class] == 0 && class > 0)
+	{
+		current_tree->live_classes &= ~(1ull << (class - 1));
+	}
+}
+
+/*
+ * The most bytes any live block in current_tree can have, rounded up to
+ * its size class. Shrinks again once the big blocks are freed.
+ */
+static inline size_t live_reach()
+{
+	int class;
+
+	if(current_tree->live_classes == 0)
+	{
+		return 0;
+	}
+	class = 64 - __builtin_clzll(current_tree->live_classes);
+	return class == 64 ? (size_t)-1 : ((size_t)1 << class) - 1;
+}
+
+typedef struct index_backend
+{
+	const char * name;
+
+	/*
+	 * Same rules as the rbtree.h functions of the same names.
+	 */
+	node * (*lookup)(void * base);
+	node * (*bounds_lookup)(void * base);
+	node * (*contained_lookup)(void * base, size_t bounds);
+	int (*insert)(void * base, size_t bounds);
+	int (*delete_node)(void * base);
+	int (*remove_range)(void * base, size_t bounds);
+
+	/*
+	 * Fills the empty index with count blocks sorted by base,
+	 * all at once (for the lazy index, lazy.h).
+	 */
+	void (*build)(index_entry * entries, size_t count);
+
+	/*
+	 * Top of the tree (NULL when it's empty), for in order walks.
+	 */
+	node * (*top)(void);
+
+	/*
+	 * Whether node colors mean anything, so the verifier
+	 * knows to check them.
+	 */
+	int red_black;
+}index_backend;
+
+extern const index_backend rbtree_backend;
+extern const index_backend splay_backend;
+
+/*
+ * The one in use.
+ */
+extern const index_backend * tree_backend;
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * bench537.c
+ * Quick benchmark for malloc537.
+ * Allocates a bunch of blocks, then times memcheck537 on them,
+ * and reports how much memory the whole thing took.
+ * The random lookups are timed again after malloc537_freeze_index
+ * (which only does anything with -DMALLOC537_FROZEN_INDEX).
+ * The last part reuses the same memory over and over: a run of blocks
+ * is freed and one big block takes over their space, which has to
+ * clear all of their freed nodes out of the index. That needs the
+ * run to be one piece of memory once it's freed, so run it as
+ * bench537_compact - otherwise libc puts the tree's own nodes in
+ * between the blocks, and the big block goes somewhere else.
+ *
+ * Use: bench537 [blocks] [lookups] [reuse rounds]
+ * Build with make bench537 (or bench537_compact for the compact nodes).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "malloc537.h"
+#include "rbtree.h"
+
+/*
+ * Blocks freed in each round of the reuse benchmark, and their
+ * smallest size - too big for libc to keep aside in its per-size
+ * caches, so they're merged back together as soon as they're freed.
+ */
+#define REUSE_RUN 64
+#define REUSE_SIZE 1040
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Resident set size in bytes, from /proc.
+ */
+static long rss_bytes()
+{
+	long pages = 0;
+	long resident = 0;
+	FILE * statm = fopen("/proc/self/statm", "r");
+	if(statm == NULL)
+	{
+		return 0;
+	}
+	if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+	{
+		resident = 0;
+	}
+	fclose(statm);
+	return resident * 4096;
+}
+
+int main(int argc, char ** argv)
+{
+	long blocks = 20000;
+	long lookups = 2000000;
+	long rounds = 2000;
+	long i;
+	long j;
+	void ** ptrs;
+	void * run[REUSE_RUN];
+	void * big;
+	size_t * sizes;
+	long rss_before;
+	long rss_after;
+	double start;
+	double alloc_ns;
+	double check_ns;
+	double repeat_ns;
+	double frozen_ns;
+	double reuse_ns;
+
+	if(argc > 1)
+	{
+		blocks = atol(argv[1]);
+	}
+	if(argc > 2)
+	{
+		lookups = atol(argv[2]);
+	}
+	if(argc > 3)
+	{
+		rounds = atol(argv[3]);
+	}
+
+	ptrs = malloc(blocks * sizeof(void *));
+	sizes = malloc(blocks * sizeof(size_t));
+	srand(537);
+	for(i = 0; i < blocks; i++)
+	{
+		sizes[i] = 16 + rand() % 112;
+	}
+
+	rss_before = rss_bytes();
+	start = now_ns();
+	for(i = 0; i < blocks; i++)
+	{
+		ptrs[i] = malloc537(sizes[i]);
+	}
+	alloc_ns = now_ns() - start;
+	rss_after = rss_bytes();
+
+	/*
+	 * Random lookups, so we're not just walking the same path
+	 * down the tree over and over.
+	 */
+	start = now_ns();
+	for(i = 0; i < lookups; i++)
+	{
+		long which = rand() % blocks;
+		memcheck537(ptrs[which], sizes[which]);
+	}
+	check_ns = now_ns() - start;
+
+	/*
+	 * The usual loop: check each byte of a block before touching it.
+	 * Most of these should never leave the inline check in malloc537.h.
+	 */
+	start = now_ns();
+	for(i = 0; i < lookups; i++)
+	{
+		long which = (i / 16) % blocks;
+		memcheck537((char *)ptrs[which] + (i % 16), 1);
+	}
+	repeat_ns = now_ns() - start;
+
+	/*
+	 * The same random lookups again, from the frozen index.
+	 */
+	malloc537_freeze_index();
+	srand(5370);
+	start = now_ns();
+	for(i = 0; i < lookups; i++)
+	{
+		long which = rand() % blocks;
+		memcheck537(ptrs[which], sizes[which]);
+	}
+	frozen_ns = now_ns() - start;
+
+	/*
+	 * The freed run goes back into one free chunk, so the
+	 * big block lands right on top of it.
+	 */
+	start = now_ns();
+	for(i = 0; i < rounds; i++)
+	{
+		for(j = 0; j < REUSE_RUN; j++)
+		{
+			run[j] = malloc537(REUSE_SIZE + rand() % 64);
+		}
+		for(j = 0; j < REUSE_RUN; j++)
+		{
+			free537(run[j]);
+		}
+		big = malloc537(REUSE_RUN * REUSE_SIZE);
+		free537(big);
+	}
+	reuse_ns = now_ns() - start;
+
+	printf("node size:        %d bytes\n", (int)sizeof(node));
+	printf("blocks:           %ld\n", blocks);
+	printf("malloc537:        %.1f ns/op\n", alloc_ns / blocks);
+	printf("memcheck537:      %.1f ns/op\n", check_ns / lookups);
+	printf("same-block check: %.1f ns/op\n", repeat_ns / lookups);
+	printf("frozen memcheck:  %.1f ns/op\n", frozen_ns / lookups);
+	printf("range reuse:      %.1f ns/round (%d blocks)\n", reuse_ns / rounds, REUSE_RUN);
+	printf("rss growth:       %.1f bytes/block\n", (double)(rss_after - rss_before) / blocks);
+
+	for(i = 0; i < blocks; i++)
+	{
+		free537(ptrs[i]);
+	}
+	free(ptrs);
+	free(sizes);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * bench537_containers.cpp
+ * What tracking a container's memory costs: the same vector, unordered_map
+ * and list work with std::allocator, mem537::allocator, and the pmr
+ * resources from allocator537.hpp (one block per allocation, and a region).
+ *
+ * Use: bench537_containers [elements]
+ * Build with make bench537_containers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <list>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "allocator537.hpp"
+
+/*
+ * The benchmark is single threaded, so no locking.
+ */
+typedef mem537::tracker<mem537::hash_index, mem537::no_lock, mem537::exit_on_error, mem537::libc_backend> bench_tracker;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Keeps the compiler from throwing the work away.
+ */
+static volatile long sink;
+
+/*
+ * push_back elements one at a time, so the vector grows (and reallocates) as it goes.
+ */
+template<class Vector>
+static double time_vector(Vector & vector, long elements)
+{
+	double start = now_ns();
+	long i;
+
+	for(i = 0; i < elements; i++)
+	{
+		vector.push_back((int)i);
+	}
+	sink = (long)vector.size();
+	vector.clear();
+	vector.shrink_to_fit();
+	return (now_ns() - start) / elements;
+}
+
+/*
+ * Insert everything, then erase it all - a node allocation and free each.
+ */
+template<class Map>
+static double time_map(Map & map, long elements)
+{
+	double start = now_ns();
+	long i;
+
+	for(i = 0; i < elements; i++)
+	{
+		map[(int)i] = (int)i;
+	}
+	for(i = 0; i < elements; i++)
+	{
+		map.erase((int)i);
+	}
+	sink = (long)map.size();
+	return (now_ns() - start) / elements;
+}
+
+template<class List>
+static double time_list(List & list, long elements)
+{
+	double start = now_ns();
+	long i;
+
+	for(i = 0; i < elements; i++)
+	{
+		list.push_back((int)i);
+	}
+	while(!list.empty())
+	{
+		list.pop_front();
+	}
+	sink = (long)list.size();
+	return (now_ns() - start) / elements;
+}
+
+static void report(const char * name, double vector_ns, double map_ns, double list_ns)
+{
+	printf("%-22s %10.1f %15.1f %10.1f\n", name, vector_ns, map_ns, list_ns);
+}
+
+int main(int argc, char ** argv)
+{
+	long elements = 200000;
+	double vector_ns;
+	double map_ns;
+	double list_ns;
+
+	if(argc > 1)
+	{
+		elements = atol(argv[1]);
+	}
+	if(elements < 1)
+	{
+		printf("Use: %s [elements]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%ld elements, ns per element\n", elements);
+	printf("%-22s %10s %15s %10s\n", "allocator", "vector", "unordered_map", "list");
+
+	{
+		std::vector<int> vector;
+		std::unordered_map<int, int> map;
+		std::list<int> list;
+		vector_ns = time_vector(vector, elements);
+		map_ns = time_map(map, elements);
+		list_ns = time_list(list, elements);
+		report("std::allocator", vector_ns, map_ns, list_ns);
+	}
+
+	{
+		typedef mem537::allocator<int, bench_tracker> int_allocator;
+		typedef mem537::allocator<std::pair<const int, int>, bench_tracker> pair_allocator;
+		std::vector<int, int_allocator> vector;
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, pair_allocator> map;
+		std::list<int, int_allocator> list;
+		vector_ns = time_vector(vector, elements);
+		map_ns = time_map(map, elements);
+		list_ns = time_list(list, elements);
+		report("mem537::allocator", vector_ns, map_ns, list_ns);
+	}
+
+	{
+		mem537::resource<bench_tracker> resource;
+		std::pmr::vector<int> vector(&resource);
+		std::pmr::unordered_map<int, int> map(&resource);
+		std::pmr::list<int> list(&resource);
+		vector_ns = time_vector(vector, elements);
+		map_ns = time_map(map, elements);
+		list_ns = time_list(list, elements);
+		report("mem537::resource", vector_ns, map_ns, list_ns);
+	}
+
+	{
+		mem537::region_resource<bench_tracker> region;
+		std::pmr::vector<int> vector(&region);
+		std::pmr::unordered_map<int, int> map(&region);
+		std::pmr::list<int> list(&region);
+		vector_ns = time_vector(vector, elements);
+		map_ns = time_map(map, elements);
+		list_ns = time_list(list, elements);
+		report("mem537::region_resource", vector_ns, map_ns, list_ns);
+	}
+
+	return 0;
+}
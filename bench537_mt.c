@@ -0,0 +1,379 @@
+/*
+ * bench537_mt.c
+ * Multithreaded benchmark for malloc537.
+ * Runs 1 to N threads doing a mix of malloc537/free537/memcheck537,
+ * with some blocks handed to another thread to free (producer/consumer),
+ * and reports throughput, scaling and per-operation latency percentiles.
+ *
+ * By default every call goes through one global mutex here in the
+ * benchmark - the baseline for a library that isn't thread safe.
+ * With -d the calls go straight in, which is only safe when the library
+ * does its own locking (built with MALLOC537_DEFERRED or MALLOC537_VERIFIER).
+ *
+ * Use: bench537_mt [-t max threads] [-n ops per thread] [-l live blocks per thread]
+ *                  [-m malloc %] [-f free %] [-x cross-thread free %] [-d]
+ * memcheck537 gets whatever percentage is left over.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "malloc537.h"
+
+#define OP_MALLOC 0
+#define OP_FREE 1
+#define OP_CHECK 2
+#define OPS 3
+
+/*
+ * Latency histograms: 64 powers of two of nanoseconds, each split
+ * into 16 linear steps. Plenty for percentiles.
+ */
+#define SUB_BUCKETS 16
+#define BUCKETS (64 * SUB_BUCKETS)
+
+/*
+ * Blocks waiting to be freed by another thread.
+ */
+#define HANDOFF_SLOTS 1024
+
+typedef struct handoff
+{
+	pthread_mutex_t lock;
+	void * blocks[HANDOFF_SLOTS];
+	int count;
+}handoff;
+
+typedef struct worker
+{
+	pthread_t thread;
+	int id;
+	int threads;
+	unsigned int seed;
+	unsigned long histogram[OPS][BUCKETS];
+	unsigned long counts[OPS];
+	char padding[64];
+}worker;
+
+static const char * op_names[OPS] = { "malloc537", "free537", "memcheck537" };
+
+static long ops_per_thread = 200000;
+static int live_per_thread = 256;
+static int malloc_percent = 40;
+static int free_percent = 30;
+static int cross_percent = 20;
+static int direct;
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static handoff * handoffs;
+static pthread_barrier_t start_line;
+
+static long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int bucket_of(long ns)
+{
+	int power;
+	if(ns < SUB_BUCKETS)
+	{
+		return (int)(ns < 0 ? 0 : ns);
+	}
+	power = 63 - __builtin_clzl((unsigned long)ns);
+	return (power - 3) * SUB_BUCKETS + (int)((ns >> (power - 4)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * Smallest latency in the bucket, for printing.
+ */
+static long bucket_floor(int bucket)
+{
+	int power;
+	if(bucket < SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	power = bucket / SUB_BUCKETS + 3;
+	return (1L << power) + (long)(bucket % SUB_BUCKETS) * (1L << (power - 4));
+}
+
+static void record(worker * self, int op, long start)
+{
+	self->histogram[op][bucket_of(now_ns() - start)]++;
+	self->counts[op]++;
+}
+
+/*
+ * The global-mutex wrapper. With -d it's just the call.
+ */
+static void * do_malloc(size_t size)
+{
+	void * block;
+	if(direct)
+	{
+		return malloc537(size);
+	}
+	pthread_mutex_lock(&global_lock);
+	block = malloc537(size);
+	pthread_mutex_unlock(&global_lock);
+	return block;
+}
+
+static void do_free(void * block)
+{
+	if(direct)
+	{
+		free537(block);
+		return;
+	}
+	pthread_mutex_lock(&global_lock);
+	free537(block);
+	pthread_mutex_unlock(&global_lock);
+}
+
+static void do_check(void * block, size_t size)
+{
+	if(direct)
+	{
+		memcheck537(block, size);
+		return;
+	}
+	pthread_mutex_lock(&global_lock);
+	memcheck537(block, size);
+	pthread_mutex_unlock(&global_lock);
+}
+
+/*
+ * Passes a block to the next thread over, or returns 0 if its box is full.
+ */
+static int hand_off(worker * self, void * block)
+{
+	handoff * box = &handoffs[(self->id + 1) % self->threads];
+	int sent = 0;
+
+	pthread_mutex_lock(&box->lock);
+	if(box->count < HANDOFF_SLOTS)
+	{
+		box->blocks[box->count++] = block;
+		sent = 1;
+	}
+	pthread_mutex_unlock(&box->lock);
+	return sent;
+}
+
+/*
+ * Takes one block someone handed us, or NULL.
+ */
+static void * take_handoff(worker * self)
+{
+	handoff * box = &handoffs[self->id];
+	void * block = NULL;
+
+	pthread_mutex_lock(&box->lock);
+	if(box->count > 0)
+	{
+		block = box->blocks[--box->count];
+	}
+	pthread_mutex_unlock(&box->lock);
+	return block;
+}
+
+static void * run_worker(void * arg)
+{
+	worker * self = arg;
+	void ** live = malloc(live_per_thread * sizeof(void *));
+	int live_count = 0;
+	long i;
+	long start;
+	int roll;
+	int which;
+	void * block;
+
+	pthread_barrier_wait(&start_line);
+
+	for(i = 0; i < ops_per_thread; i++)
+	{
+		roll = rand_r(&self->seed) % 100;
+
+		/*
+		 * Frees of blocks other threads handed us come first,
+		 * that's the consumer half.
+		 */
+		if(roll < free_percent && (block = take_handoff(self)) != NULL)
+		{
+			start = now_ns();
+			do_free(block);
+			record(self, OP_FREE, start);
+		}
+		else if((roll < malloc_percent + free_percent && live_count < live_per_thread) || live_count == 0)
+		{
+			start = now_ns();
+			live[live_count++] = do_malloc(16 + rand_r(&self->seed) % 240);
+			record(self, OP_MALLOC, start);
+		}
+		else if(roll < malloc_percent + free_percent)
+		{
+			which = rand_r(&self->seed) % live_count;
+			block = live[which];
+			live[which] = live[--live_count];
+
+			/*
+			 * The producer half: someone else frees this one.
+			 */
+			if(self->threads > 1 && rand_r(&self->seed) % 100 < cross_percent && hand_off(self, block))
+			{
+				continue;
+			}
+			start = now_ns();
+			do_free(block);
+			record(self, OP_FREE, start);
+		}
+		else
+		{
+			which = rand_r(&self->seed) % live_count;
+			start = now_ns();
+			do_check(live[which], 16);
+			record(self, OP_CHECK, start);
+		}
+	}
+
+	/*
+	 * Everyone has to be done handing things off before we clean up.
+	 */
+	pthread_barrier_wait(&start_line);
+	while((block = take_handoff(self)) != NULL)
+	{
+		do_free(block);
+	}
+	while(live_count > 0)
+	{
+		do_free(live[--live_count]);
+	}
+	free(live);
+	return NULL;
+}
+
+/*
+ * Latency at the given fraction (0.5 for p50) across all the workers.
+ */
+static long percentile(worker * workers, int threads, int op, double fraction)
+{
+	unsigned long total = 0;
+	unsigned long seen = 0;
+	int bucket;
+	int t;
+
+	for(t = 0; t < threads; t++)
+	{
+		total += workers[t].counts[op];
+	}
+	for(bucket = 0; bucket < BUCKETS; bucket++)
+	{
+		for(t = 0; t < threads; t++)
+		{
+			seen += workers[t].histogram[op][bucket];
+		}
+		if(total > 0 && seen >= (unsigned long)(fraction * total))
+		{
+			return bucket_floor(bucket);
+		}
+	}
+	return 0;
+}
+
+/*
+ * One run with the given number of threads. Returns ops per second.
+ */
+static double run(int threads, double single_rate)
+{
+	worker * workers = calloc(threads, sizeof(worker));
+	long start;
+	long elapsed;
+	double rate;
+	unsigned long total_ops = 0;
+	int t;
+	int op;
+
+	handoffs = calloc(threads, sizeof(handoff));
+	pthread_barrier_init(&start_line, NULL, threads + 1);
+	for(t = 0; t < threads; t++)
+	{
+		pthread_mutex_init(&handoffs[t].lock, NULL);
+		workers[t].id = t;
+		workers[t].threads = threads;
+		workers[t].seed = 537 + t;
+		pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+	}
+
+	pthread_barrier_wait(&start_line);
+	start = now_ns();
+	pthread_barrier_wait(&start_line);
+	elapsed = now_ns() - start;
+	for(t = 0; t < threads; t++)
+	{
+		pthread_join(workers[t].thread, NULL);
+		for(op = 0; op < OPS; op++)
+		{
+			total_ops += workers[t].counts[op];
+		}
+	}
+
+	rate = total_ops / (elapsed / 1e9);
+	printf("%2d threads: %8.3f Mops/s  efficiency %5.1f%%\n", threads, rate / 1e6, single_rate > 0 ? 100.0 * rate / (threads * single_rate) : 100.0);
+	for(op = 0; op < OPS; op++)
+	{
+		printf("    %-12s p50 %7ld ns  p99 %7ld ns  p999 %7ld ns\n", op_names[op], percentile(workers, threads, op, 0.5), percentile(workers, threads, op, 0.99), percentile(workers, threads, op, 0.999));
+	}
+
+	pthread_barrier_destroy(&start_line);
+	free(handoffs);
+	free(workers);
+	return rate;
+}
+
+int main(int argc, char ** argv)
+{
+	int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int threads;
+	int option;
+	double single_rate = 0;
+	double rate;
+
+	while((option = getopt(argc, argv, "t:n:l:m:f:x:d")) != -1)
+	{
+		switch(option)
+		{
+			case 't': max_threads = atoi(optarg); break;
+			case 'n': ops_per_thread = atol(optarg); break;
+			case 'l': live_per_thread = atoi(optarg); break;
+			case 'm': malloc_percent = atoi(optarg); break;
+			case 'f': free_percent = atoi(optarg); break;
+			case 'x': cross_percent = atoi(optarg); break;
+			case 'd': direct = 1; break;
+			default:
+				printf("Use: %s [-t threads] [-n ops] [-l live] [-m malloc%%] [-f free%%] [-x cross%%] [-d]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(malloc_percent + free_percent > 100 || live_per_thread < 1)
+	{
+		printf("malloc%% + free%% has to be at most 100, and we need at least one live block.\n");
+		return 1;
+	}
+
+	printf("%s, %ld ops/thread, %d%% malloc %d%% free %d%% memcheck, %d%% of frees cross-thread\n", direct ? "library locking" : "global mutex", ops_per_thread, malloc_percent, free_percent, 100 - malloc_percent - free_percent, cross_percent);
+	for(threads = 1; threads <= max_threads; threads *= 2)
+	{
+		rate = run(threads, single_rate);
+		if(threads == 1)
+		{
+			single_rate = rate;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * checked537.hpp
+ * Pointers and spans that look up their block once, when they're made,
+ * and after that check every access with a couple of compares instead
+ * of a memcheck537 call.
+ *
+ *  - mem537::checked_ptr<T> - *, ->, [] and pointer arithmetic.
+ *  - mem537::checked_span<T> - a pointer and a count, with [], subspan,
+ *    and checked_ptr iterators.
+ *
+ * Each one remembers the generation its block was looked up in. Anything
+ * getting freed moves the generation on, and the next access looks the
+ * block up again - which is where a use after free gets caught. So in a
+ * program that frees a lot, expect more lookups.
+ *
+ * By default they check against the C library (memcheck537_resolve).
+ * The second template parameter can be a mem537::tracker instead, passed
+ * to the constructor. A failed check is reported the usual way; with a
+ * tracker that carries on after errors, the access still happens.
+ *
+ * Below MALLOC537_LEVEL 2 there's no checking at all: both are just the
+ * raw pointer (and count) with the same interface, and compile to the
+ * same code a raw pointer would.
+ */
+#ifndef CHECKED537_HPP
+#define CHECKED537_HPP
+
+#include <cstddef>
+#include "malloc537.h"
+#include "malloc537.hpp"
+
+namespace mem537
+{
+
+/*
+ * The C library, with the same resolve/generation/memcheck
+ * functions a tracker has.
+ */
+struct c_library
+{
+	bool resolve(const void * ptr, block & live, unsigned long & seen)
+	{
+		void * base;
+		memcheck537_resolve(const_cast<void *>(ptr), &base, &live.bounds, &seen);
+		live.base = static_cast<char *>(base);
+		live.free = false;
+		return true;
+	}
+
+	unsigned long generation() const
+	{
+		return __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED);
+	}
+
+	bool memcheck(const void * ptr, std::size_t size)
+	{
+		(memcheck537)(const_cast<void *>(ptr), size);
+		return true;
+	}
+
+	static c_library & instance()
+	{
+		static c_library library;
+		return library;
+	}
+};
+
+#if MALLOC537_LEVEL >= 2
+
+template<class T, class Checker = c_library>
+class checked_ptr
+{
+public:
+	checked_ptr() : ptr(NULL), checker(&Checker::instance()), base(NULL), bounds(0), seen(0) {}
+
+	checked_ptr(T * ptr) : ptr(ptr), checker(&Checker::instance())
+	{
+		resolve();
+	}
+
+	checked_ptr(T * ptr, Checker & checker) : ptr(ptr), checker(&checker)
+	{
+		resolve();
+	}
+
+	T & operator*() const
+	{
+		check(ptr);
+		return *ptr;
+	}
+
+	T * operator->() const
+	{
+		check(ptr);
+		return ptr;
+	}
+
+	T & operator[](std::ptrdiff_t index) const
+	{
+		check(ptr + index);
+		return ptr[index];
+	}
+
+	/*
+	 * Arithmetic is free - we only check where we end up
+	 * when something is actually read or written.
+	 */
+	checked_ptr operator+(std::ptrdiff_t offset) const
+	{
+		checked_ptr moved(*this);
+		moved.ptr += offset;
+		return moved;
+	}
+
+	checked_ptr operator-(std::ptrdiff_t offset) const
+	{
+		return *this + -offset;
+	}
+
+	std::ptrdiff_t operator-(const checked_ptr & other) const
+	{
+		return ptr - other.ptr;
+	}
+
+	checked_ptr & operator+=(std::ptrdiff_t offset)
+	{
+		ptr += offset;
+		return *this;
+	}
+
+	checked_ptr & operator-=(std::ptrdiff_t offset)
+	{
+		ptr -= offset;
+		return *this;
+	}
+
+	checked_ptr & operator++()
+	{
+		++ptr;
+		return *this;
+	}
+
+	checked_ptr & operator--()
+	{
+		--ptr;
+		return *this;
+	}
+
+	checked_ptr operator++(int)
+	{
+		checked_ptr old(*this);
+		++ptr;
+		return old;
+	}
+
+	checked_ptr operator--(int)
+	{
+		checked_ptr old(*this);
+		--ptr;
+		return old;
+	}
+
+	bool operator==(const checked_ptr & other) const { return ptr == other.ptr; }
+	bool operator!=(const checked_ptr & other) const { return ptr != other.ptr; }
+	bool operator<(const checked_ptr & other) const { return ptr < other.ptr; }
+	bool operator<=(const checked_ptr & other) const { return ptr <= other.ptr; }
+	bool operator>(const checked_ptr & other) const { return ptr > other.ptr; }
+	bool operator>=(const checked_ptr & other) const { return ptr >= other.ptr; }
+
+	/*
+	 * The raw pointer, no questions asked.
+	 */
+	T * get() const
+	{
+		return ptr;
+	}
+
+private:
+	void resolve()
+	{
+		block live;
+
+		base = NULL;
+		bounds = 0;
+		seen = checker->generation();
+		if(ptr != NULL && checker->resolve(ptr, live, seen))
+		{
+			base = live.base;
+			bounds = live.bounds;
+		}
+	}
+
+	/*
+	 * The whole check, when nothing's been freed: at has to be
+	 * inside the block with room for a T.
+	 */
+	void check(T * at) const
+	{
+		char * start = reinterpret_cast<char *>(at);
+
+		if(seen != checker->generation())
+		{
+			recheck();
+		}
+		if(start < base || start > base + bounds || sizeof(T) > static_cast<std::size_t>(base + bounds - start))
+		{
+			checker->memcheck(at, sizeof(T));
+		}
+	}
+
+	/*
+	 * Something was freed since we looked - make sure it wasn't us.
+	 * If it was (and the checker carries on after errors), nothing
+	 * stays cached, so every access after this goes to memcheck.
+	 */
+	__attribute__((noinline))
+	void recheck() const
+	{
+		block live;
+		unsigned long now = checker->generation();
+
+		if(base != NULL && checker->resolve(base, live, now))
+		{
+			bounds = live.bounds;
+		}
+		else
+		{
+			base = NULL;
+			bounds = 0;
+		}
+		seen = now;
+	}
+
+	template<class U, class OtherChecker>
+	friend class checked_span;
+
+	T * ptr;
+	Checker * checker;
+	mutable char * base;
+	mutable std::size_t bounds;
+	mutable unsigned long seen;
+};
+
+template<class T, class Checker = c_library>
+class checked_span
+{
+public:
+	typedef checked_ptr<T, Checker> iterator;
+
+	checked_span() : start(), count(0) {}
+
+	/*
+	 * The whole span has to be inside one block.
+	 */
+	checked_span(T * data, std::size_t count) : start(data), count(count)
+	{
+		check_all();
+	}
+
+	checked_span(T * data, std::size_t count, Checker & checker) : start(data, checker), count(count)
+	{
+		check_all();
+	}
+
+	T & operator[](std::size_t index) const
+	{
+		if(index >= count)
+		{
+			start.checker->memcheck(start.ptr + index, sizeof(T));
+		}
+		return start[static_cast<std::ptrdiff_t>(index)];
+	}
+
+	checked_span subspan(std::size_t offset, std::size_t length) const
+	{
+		checked_span part(*this);
+		if(offset > count || length > count - offset)
+		{
+			start.checker->memcheck(start.ptr + offset, length * sizeof(T));
+		}
+		part.start += static_cast<std::ptrdiff_t>(offset);
+		part.count = length;
+		return part;
+	}
+
+	iterator begin() const { return start; }
+	iterator end() const { return start + static_cast<std::ptrdiff_t>(count); }
+	T * data() const { return start.ptr; }
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	void check_all()
+	{
+		if(count > 0)
+		{
+			start.checker->memcheck(start.ptr, count * sizeof(T));
+		}
+	}
+
+	checked_ptr<T, Checker> start;
+	std::size_t count;
+};
+
+#else
+
+/*
+ * No checking - same interface, just the pointer.
+ */
+template<class T, class Checker = c_library>
+class checked_ptr
+{
+public:
+	checked_ptr() : ptr(NULL) {}
+	checked_ptr(T * ptr) : ptr(ptr) {}
+	checked_ptr(T * ptr, Checker & checker) : ptr(ptr) { (void)checker; }
+
+	T & operator*() const { return *ptr; }
+	T * operator->() const { return ptr; }
+	T & operator[](std::ptrdiff_t index) const { return ptr[index]; }
+	checked_ptr operator+(std::ptrdiff_t offset) const { return checked_ptr(ptr + offset); }
+	checked_ptr operator-(std::ptrdiff_t offset) const { return checked_ptr(ptr - offset); }
+	std::ptrdiff_t operator-(const checked_ptr & other) const { return ptr - other.ptr; }
+	checked_ptr & operator+=(std::ptrdiff_t offset) { ptr += offset; return *this; }
+	checked_ptr & operator-=(std::ptrdiff_t offset) { ptr -= offset; return *this; }
+	checked_ptr & operator++() { ++ptr; return *this; }
+	checked_ptr & operator--() { --ptr; return *this; }
+	checked_ptr operator++(int) { return checked_ptr(ptr++); }
+	checked_ptr operator--(int) { return checked_ptr(ptr--); }
+	bool operator==(const checked_ptr & other) const { return ptr == other.ptr; }
+	bool operator!=(const checked_ptr & other) const { return ptr != other.ptr; }
+	bool operator<(const checked_ptr & other) const { return ptr < other.ptr; }
+	bool operator<=(const checked_ptr & other) const { return ptr <= other.ptr; }
+	bool operator>(const checked_ptr & other) const { return ptr > other.ptr; }
+	bool operator>=(const checked_ptr & other) const { return ptr >= other.ptr; }
+	T * get() const { return ptr; }
+
+private:
+	T * ptr;
+};
+
+template<class T, class Checker = c_library>
+class checked_span
+{
+public:
+	typedef T * iterator;
+
+	checked_span() : start(NULL), count(0) {}
+	checked_span(T * data, std::size_t count) : start(data), count(count) {}
+	checked_span(T * data, std::size_t count, Checker & checker) : start(data), count(count) { (void)checker; }
+
+	T & operator[](std::size_t index) const { return start[index]; }
+	checked_span subspan(std::size_t offset, std::size_t length) const { return checked_span(start + offset, length); }
+	iterator begin() const { return start; }
+	iterator end() const { return start + count; }
+	T * data() const { return start; }
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	T * start;
+	std::size_t count;
+};
+
+#endif
+
+}
+
+#endif
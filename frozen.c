@@ -0,0 +1,309 @@
+/*
+ * frozen.c
+ * The frozen copy of the index, see frozen.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "frozen.h"
+
+/*
+ * How far ahead the search fetches: ends[k * FROZEN_PREFETCH] is the
+ * start of k's descendants three levels down, and with 8 byte keys all
+ * eight of them are in that one cache line.
+ */
+#define FROZEN_PREFETCH 8
+#define FROZEN_LINE 64
+
+/*
+ * 1-based, in Eytzinger order: the children of k are 2k and 2k + 1.
+ * ends[k] is one past the last byte of block k (the key we search on),
+ * bases[k] its start, or NULL once it's been freed.
+ */
+static char ** ends;
+static char ** bases;
+static size_t count;
+
+/*
+ * Blocks allocated since the freeze.
+ */
+static char * delta_base[FROZEN_DELTA];
+static size_t delta_bounds[FROZEN_DELTA];
+static int delta_count;
+static int changes;
+
+static unsigned long quiet;
+static unsigned long freeze_after;
+
+/*
+ * Reads MALLOC537_FREEZE_AFTER before main runs.
+ */
+static void setup() __attribute__((constructor));
+
+static void setup()
+{
+	char * env = getenv("MALLOC537_FREEZE_AFTER");
+	if(env != NULL)
+	{
+		freeze_after = strtoul(env, NULL, 0);
+	}
+}
+
+static void drop()
+{
+	free(ends);
+	free(bases);
+	ends = NULL;
+	bases = NULL;
+	count = 0;
+	delta_count = 0;
+	changes = 0;
+}
+
+/*
+ * In order successor, using the parent links.
+ */
+static node * next_node(node * current)
+{
+	node * parent;
+
+	if(node_child(current, RIGHT_CHILD) != NULL)
+	{
+		current = node_child(current, RIGHT_CHILD);
+		while(node_child(current, LEFT_CHILD) != NULL)
+		{
+			current = node_child(current, LEFT_CHILD);
+		}
+		return current;
+	}
+
+	parent = node_parent(current);
+	while(parent != NULL && current == node_child(parent, RIGHT_CHILD))
+	{
+		current = parent;
+		parent = node_parent(current);
+	}
+	return parent;
+}
+
+/*
+ * Fills in the subtree at k from sorted[next...] in order,
+ * and returns where the next subtree picks up.
+ */
+static size_t lay_out(node ** sorted, size_t next, size_t k)
+{
+	if(k > count)
+	{
+		return next;
+	}
+	next = lay_out(sorted, next, 2 * k);
+	bases[k] = node_base(sorted[next]);
+	ends[k] = bases[k] + node_bounds(sorted[next]);
+	next++;
+	return lay_out(sorted, next, 2 * k + 1);
+}
+
+static void * alloc_line_aligned(size_t bytes)
+{
+	void * block = aligned_alloc(FROZEN_LINE, (bytes + FROZEN_LINE - 1) & ~(size_t)(FROZEN_LINE - 1));
+	if(block == NULL)
+	{
+		printf("Couldn't allocate %lu bytes for the frozen index!\n", (unsigned long)bytes);
+		exit(EXIT_FAILURE);
+	}
+	return block;
+}
+
+void frozen_build(node * top)
+{
+	node ** sorted = NULL;
+	node * current = top;
+	size_t live = 0;
+	size_t capacity = 0;
+
+	drop();
+	quiet = 0;
+
+	if(current == NULL)
+	{
+		return;
+	}
+	while(node_child(current, LEFT_CHILD) != NULL)
+	{
+		current = node_child(current, LEFT_CHILD);
+	}
+
+	for(; current != NULL; current = next_node(current))
+	{
+		if(node_free(current))
+		{
+			continue;
+		}
+		if(live == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 1024;
+			sorted = realloc(sorted, capacity * sizeof(node *));
+			if(sorted == NULL)
+			{
+				printf("Couldn't allocate space to sort %lu blocks for the frozen index!\n", (unsigned long)capacity);
+				exit(EXIT_FAILURE);
+			}
+		}
+		sorted[live++] = current;
+	}
+
+	/*
+	 * Slot 0 is never used. Prefetches past the end don't fault,
+	 * so the keys don't need padding.
+	 */
+	count = live;
+	ends = alloc_line_aligned((live + 1) * sizeof(char *));
+	bases = alloc_line_aligned((live + 1) * sizeof(char *));
+	lay_out(sorted, 0, 1);
+	free(sorted);
+}
+
+/*
+ * Slot of the first block ending at or after p, or 0 if there isn't one.
+ * No branches on the keys: each level is a compare and an add, so there's
+ * nothing to mispredict.
+ */
+static size_t search(char * p)
+{
+	size_t k = 1;
+
+	while(k <= count)
+	{
+		__builtin_prefetch(ends + k * FROZEN_PREFETCH);
+		k = 2 * k + (ends[k] < p);
+	}
+
+	/*
+	 * k fell off the bottom. The last time we went left is the answer:
+	 * strip the trailing right turns (ones), then that left turn.
+	 */
+	return k >> __builtin_ffsl((long)~k);
+}
+
+/*
+ * Slot of the next block in address order, or 0 after the last one.
+ */
+static size_t successor(size_t k)
+{
+	if(2 * k + 1 <= count)
+	{
+		k = 2 * k + 1;
+		while(2 * k <= count)
+		{
+			k = 2 * k;
+		}
+		return k;
+	}
+	while(k & 1)
+	{
+		k >>= 1;
+	}
+	return k >> 1;
+}
+
+int frozen_check(void * ptr, size_t size, void ** base, size_t * bounds)
+{
+	char * p = ptr;
+	size_t k;
+	int i;
+
+	if(ends == NULL)
+	{
+		return 0;
+	}
+
+	for(i = 0; i < delta_count; i++)
+	{
+		if(p >= delta_base[i] && size <= delta_bounds[i] && (size_t)(p - delta_base[i]) <= delta_bounds[i] - size)
+		{
+			*base = delta_base[i];
+			*bounds = delta_bounds[i];
+			return 1;
+		}
+	}
+
+	k = search(p);
+	if(k == 0 || bases[k] == NULL || p < bases[k] || size > (size_t)(ends[k] - p))
+	{
+		return 0;
+	}
+	*base = bases[k];
+	*bounds = (size_t)(ends[k] - bases[k]);
+	return 1;
+}
+
+int frozen_quiet()
+{
+	return ends == NULL && freeze_after != 0 && ++quiet >= freeze_after;
+}
+
+/*
+ * One more change since the freeze. Returns 0 if that was one too many
+ * and the copy is gone.
+ */
+static int changed()
+{
+	quiet = 0;
+	if(ends == NULL)
+	{
+		return 0;
+	}
+	if(++changes > FROZEN_DELTA)
+	{
+		drop();
+		return 0;
+	}
+	return 1;
+}
+
+void frozen_added(void * base, size_t bounds)
+{
+	if(!changed())
+	{
+		return;
+	}
+	delta_base[delta_count] = base;
+	delta_bounds[delta_count] = bounds;
+	delta_count++;
+}
+
+void frozen_removed(void * base)
+{
+	size_t k;
+	int i;
+
+	if(!changed())
+	{
+		return;
+	}
+
+	for(i = 0; i < delta_count; i++)
+	{
+		if(delta_base[i] == base)
+		{
+			delta_count--;
+			delta_base[i] = delta_base[delta_count];
+			delta_bounds[i] = delta_bounds[delta_count];
+			return;
+		}
+	}
+
+	/*
+	 * The first block ending at or after base is usually this one, but
+	 * a block ending right where it starts comes first (blocks don't
+	 * overlap, so that's the only kind that can).
+	 */
+	k = search(base);
+	while(k != 0 && bases[k] != base && ends[k] == (char *)base)
+	{
+		k = successor(k);
+	}
+	if(k != 0 && bases[k] == base)
+	{
+		bases[k] = NULL;
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * frozen.h
+ * A read-only copy of the live blocks (build with -DMALLOC537_FROZEN_INDEX),
+ * for programs that are done allocating and mostly call memcheck537.
+ * malloc537_freeze_index() copies every live block out of the tree into
+ * one array in Eytzinger order - the levels of a balanced tree, one after
+ * the other - so a lookup walks down a flat array, fetching the next few
+ * levels ahead of time, instead of chasing a pointer per level.
+ *
+ * The tree is still kept up to date and has the final say: the copy only
+ * ever answers "that's fine", and anything it can't vouch for goes to the
+ * tree like before. Blocks allocated after the freeze go in a small delta
+ * buffer, and freed ones are just marked dead. Once FROZEN_DELTA changes
+ * have piled up, the copy is thrown away until the next freeze.
+ *
+ * MALLOC537_FREEZE_AFTER=n in the environment freezes automatically after
+ * n memcheck537 calls in a row had to go to the tree with no malloc537 or
+ * free537 in between.
+ *
+ * Everything here runs with the tree lock held.
+ */
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include <stddef.h>
+#include "rbtree.h"
+
+#ifndef FROZEN_DELTA
+#define FROZEN_DELTA 64
+#endif
+
+/*
+ * Builds the copy from the live blocks in the tree under top,
+ * replacing any old one.
+ */
+void frozen_build(node * top);
+
+/*
+ * Returns 1 if [ptr, ptr + size) is inside a live block the copy knows
+ * about, with the block in *base and *bounds. 0 means ask the tree.
+ */
+int frozen_check(void * ptr, size_t size, void ** base, size_t * bounds);
+
+/*
+ * A tree lookup the copy couldn't answer. Returns 1 when it's time
+ * to freeze automatically.
+ */
+int frozen_quiet();
+
+/*
+ * A block was added to or freed in the tree.
+ */
+void frozen_added(void * base, size_t bounds);
+void frozen_removed(void * base);
+
+#endif
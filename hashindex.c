@@ -0,0 +1,260 @@
+/*
+ * hashindex.c
+ * Robin Hood hash table from base address to tree node.
+ * See hashindex.h for the big picture.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "hashindex.h"
+
+/*
+ * Starting size (a power of two), and how many old slots each
+ * insert/remove moves over while we're growing. Growing doubles
+ * the table at 3/4 full, so 16 a call finishes the move long
+ * before the new table fills up.
+ */
+#define HASH_START_SHIFT 54
+#define HASH_MIGRATE_STEP 16
+
+/*
+ * dist is how far an entry is from its home slot, plus one.
+ * 0 is an empty slot. A removed entry in the old table keeps
+ * its dist with this bit set, so lookups still probe past it.
+ */
+#define HASH_TOMB 0x80000000u
+
+/*
+ * Fibonacci hashing - multiply and keep the top bits.
+ */
+static size_t hash_home(hash_table * table, void * base)
+{
+	return (size_t)(((uint64_t)(uintptr_t)base * 0x9E3779B97F4A7C15ull) >> table->shift);
+}
+
+static void table_create(hash_table * table, int shift)
+{
+	table->shift = shift;
+	table->capacity = (size_t)1 << (64 - shift);
+	table->slots = calloc(table->capacity, sizeof(hash_slot));
+	if(table->slots == NULL)
+	{
+		printf("Couldn't allocate a hash index of %lu slots!\n", (unsigned long)table->capacity);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Robin Hood insert: walk from the home slot, and whenever we're
+ * further from home than the entry sitting there, take its slot
+ * and carry it along instead.
+ */
+static void table_insert(hash_table * table, void * base, node * value)
+{
+	size_t mask = table->capacity - 1;
+	size_t pos = hash_home(table, base);
+	unsigned int dist = 1;
+	hash_slot carry;
+	hash_slot swap;
+
+	carry.base = base;
+	carry.value = value;
+	carry.dist = dist;
+
+	while(table->slots[pos].dist != 0)
+	{
+		if(table->slots[pos].dist < carry.dist)
+		{
+			swap = table->slots[pos];
+			table->slots[pos] = carry;
+			carry = swap;
+		}
+		pos = (pos + 1) & mask;
+		carry.dist++;
+	}
+	table->slots[pos] = carry;
+}
+
+/*
+ * Slot holding base, or -1.
+ */
+static long table_find(hash_table * table, void * base)
+{
+	size_t mask = table->capacity - 1;
+	size_t pos = hash_home(table, base);
+	unsigned int dist = 1;
+
+	while(table->slots[pos].dist != 0)
+	{
+		/*
+		 * Anything closer to home than we'd be means we're not here.
+		 */
+		if((table->slots[pos].dist & ~HASH_TOMB) < dist)
+		{
+			return -1;
+		}
+		if(!(table->slots[pos].dist & HASH_TOMB) && table->slots[pos].base == base)
+		{
+			return (long)pos;
+		}
+		pos = (pos + 1) & mask;
+		dist++;
+	}
+	return -1;
+}
+
+/*
+ * Removes the entry at pos and shifts the rest of its
+ * run back a slot, so no tombstones are needed.
+ */
+static void table_remove(hash_table * table, size_t pos)
+{
+	size_t mask = table->capacity - 1;
+	size_t next = (pos + 1) & mask;
+
+	while(table->slots[next].dist > 1)
+	{
+		table->slots[pos] = table->slots[next];
+		table->slots[pos].dist--;
+		pos = next;
+		next = (next + 1) & mask;
+	}
+	table->slots[pos].dist = 0;
+}
+
+/*
+ * Moves up to steps slots from the old table into the current one.
+ * A moved slot is tombstoned where it was, so an entry is only ever
+ * live in one of the two tables, and removing it from the current
+ * one is enough.
+ */
+static void migrate(hash_index * index, size_t steps)
+{
+	hash_slot * slot;
+
+	while(index->old.slots != NULL && steps > 0)
+	{
+		slot = &index->old.slots[index->migrated];
+		if(slot->dist != 0 && !(slot->dist & HASH_TOMB))
+		{
+			table_insert(&index->current, slot->base, slot->value);
+			slot->dist |= HASH_TOMB;
+		}
+		index->migrated++;
+		steps--;
+
+		if(index->migrated == index->old.capacity)
+		{
+			free(index->old.slots);
+			index->old.slots = NULL;
+		}
+	}
+}
+
+/*
+ * Starts moving into a table twice the size.
+ */
+static void grow(hash_index * index)
+{
+	/*
+	 * Shouldn't happen with the step size above, but just in case
+	 * we're somehow still moving from last time, finish that first.
+	 */
+	migrate(index, (size_t)-1);
+
+	index->old = index->current;
+	index->migrated = 0;
+	table_create(&index->current, index->old.shift - 1);
+}
+
+void hash_insert(hash_index * index, void * base, node * value)
+{
+	if(index->current.slots == NULL)
+	{
+		table_create(&index->current, HASH_START_SHIFT);
+	}
+
+	migrate(index, HASH_MIGRATE_STEP);
+
+	if((index->count + 1) * 4 > index->current.capacity * 3)
+	{
+		grow(index);
+	}
+
+	table_insert(&index->current, base, value);
+	index->count++;
+}
+
+node * hash_lookup(hash_index * index, void * base)
+{
+	long pos;
+
+	if(index->current.slots == NULL)
+	{
+		return NULL;
+	}
+
+	pos = table_find(&index->current, base);
+	if(pos >= 0)
+	{
+		return index->current.slots[pos].value;
+	}
+
+	if(index->old.slots != NULL)
+	{
+		pos = table_find(&index->old, base);
+		if(pos >= 0)
+		{
+			return index->old.slots[pos].value;
+		}
+	}
+
+	return NULL;
+}
+
+void hash_remove(hash_index * index, void * base)
+{
+	long pos;
+	int found = 0;
+
+	if(index->current.slots == NULL)
+	{
+		return;
+	}
+
+	migrate(index, HASH_MIGRATE_STEP);
+
+	pos = table_find(&index->current, base);
+	if(pos >= 0)
+	{
+		table_remove(&index->current, (size_t)pos);
+		found = 1;
+	}
+
+	/*
+	 * Anything still in the old table just gets tombstoned -
+	 * lookups ignore it and migrate skips it.
+	 */
+	if(index->old.slots != NULL)
+	{
+		pos = table_find(&index->old, base);
+		if(pos >= 0)
+		{
+			index->old.slots[pos].dist |= HASH_TOMB;
+			found = 1;
+		}
+	}
+
+	if(found)
+	{
+		index->count--;
+	}
+}
+
+void hash_clear(hash_index * index)
+{
+	free(index->current.slots);
+	free(index->old.slots);
+	index->current.slots = NULL;
+	index->old.slots = NULL;
+	index->count = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * hashindex.h
+ * Open addressing hash table from a block's base address to its tree node.
+ * Used next to the tree (build with -DMALLOC537_HASH_INDEX) so exact
+ * base lookups - free537, realloc537, most memcheck537s - don't have to
+ * walk down the tree.
+ *
+ * Robin Hood hashing with linear probing: every entry remembers how far it
+ * is from its home slot, and a lookup can stop as soon as it sees an entry
+ * closer to home than it would be.
+ *
+ * Growing doesn't rehash everything at once. The old table hangs around
+ * and every insert/remove moves a few of its slots to the new one.
+ */
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include "rbtree.h"
+
+typedef struct hash_slot
+{
+	void * base;
+	node * value;
+	unsigned int dist;
+}hash_slot;
+
+typedef struct hash_table
+{
+	hash_slot * slots;
+	size_t capacity;
+	int shift;
+}hash_table;
+
+typedef struct hash_index
+{
+	hash_table current;
+	/* Table we're still moving out of, if we're growing. */
+	hash_table old;
+	size_t migrated;
+	size_t count;
+}hash_index;
+
+/*
+ * Adds base -> value. base must not be in the index already.
+ */
+void hash_insert(hash_index * index, void * base, node * value);
+
+/*
+ * Node for exactly this base, or NULL.
+ */
+node * hash_lookup(hash_index * index, void * base);
+
+/*
+ * Removes base, if it's there.
+ */
+void hash_remove(hash_index * index, void * base);
+
+/*
+ * Throws the whole index away, leaving it empty.
+ */
+void hash_clear(hash_index * index);
+
+#endif
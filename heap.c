@@ -0,0 +1,338 @@
+/*
+ * heap.c
+ * Private heaps, see heap.h, and the _in calls from malloc537.h.
+ * A NULL heap is the default one: those calls are just the usual ones.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "malloc537.h"
+#include "heap.h"
+#include "report537.h"
+
+#ifdef MALLOC537_HEAPS
+#include <pthread.h>
+#include "backend.h"
+#include "probes.h"
+
+struct malloc537_heap
+{
+	index_tree tree;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Takes heap's lock and makes its tree the one the backend works on.
+ */
+static void heap_enter(malloc537_heap_t * heap)
+{
+	pthread_mutex_lock(&heap->lock);
+	current_tree = &heap->tree;
+}
+
+/*
+ * Back to the default heap's tree, and lets go of the lock.
+ */
+static void heap_leave(malloc537_heap_t * heap)
+{
+	current_tree = &default_tree;
+	pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * Puts a new block in the heap's tree, clearing out
+ * any freed nodes it covers first.
+ */
+static void heap_track(void * base, size_t size)
+{
+	tree_backend->remove_range(base, size);
+	tree_backend->insert(base, size);
+}
+
+/*
+ * Frees every live block in the tree and every node, bottom up
+ * through the parent links. Nothing is unlinked from anything that
+ * stays, so there's no rebalancing, and no stack either.
+ */
+static void heap_teardown(index_tree * tree)
+{
+	node * current = tree->root;
+	node * parent;
+
+	while(current != NULL)
+	{
+		if(node_child(current, LEFT_CHILD) != NULL)
+		{
+			current = node_child(current, LEFT_CHILD);
+			continue;
+		}
+		if(node_child(current, RIGHT_CHILD) != NULL)
+		{
+			current = node_child(current, RIGHT_CHILD);
+			continue;
+		}
+
+		parent = node_parent(current);
+		if(parent != NULL)
+		{
+			set_child(parent, node_child(parent, LEFT_CHILD) == current ? LEFT_CHILD : RIGHT_CHILD, NULL);
+		}
+		if(!node_free(current))
+		{
+			free(node_base(current));
+		}
+		destroy(current);
+		current = parent;
+	}
+	tree->root = NULL;
+	memset(tree->live, 0, sizeof(tree->live));
+	tree->live_classes = 0;
+#ifdef MALLOC537_HASH_INDEX
+	hash_clear(&tree->index);
+#endif
+}
+#endif
+
+malloc537_heap_t *malloc537_heap_create()
+{
+#ifdef MALLOC537_HEAPS
+	malloc537_heap_t * heap = calloc(1, sizeof(malloc537_heap_t));
+
+	if(heap == NULL)
+	{
+		printf("Couldn't allocate a new heap!\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&heap->lock, NULL);
+	return heap;
+#else
+	printf("Private heaps need the library built with -DMALLOC537_HEAPS!\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+/*
+ * Frees every block still in the heap, then the heap. O(n) in the
+ * blocks the heap has ever had a node for.
+ */
+void malloc537_heap_destroy(malloc537_heap_t *heap)
+{
+#ifdef MALLOC537_HEAPS
+	if(heap == NULL)
+	{
+		printf("The default heap can't be destroyed!\n");
+		exit(EXIT_FAILURE);
+	}
+	heap_enter(heap);
+	heap_teardown(&heap->tree);
+	heap_leave(heap);
+	pthread_mutex_destroy(&heap->lock);
+	free(heap);
+#else
+	(void)heap;
+	printf("Private heaps need the library built with -DMALLOC537_HEAPS!\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+void *malloc537_in(malloc537_heap_t *heap, size_t size)
+{
+#ifdef MALLOC537_HEAPS
+	void * return_ptr;
+
+	if(heap == NULL)
+	{
+		return malloc537(size);
+	}
+	if(size == 0)
+	{
+		printf(REPORT537_ZERO_SIZE);
+	}
+
+	return_ptr = malloc(size);
+	heap_enter(heap);
+	heap_track(return_ptr, size);
+	heap_leave(heap);
+	PROBE2(malloc, return_ptr, size);
+	return return_ptr;
+#else
+	(void)heap;
+	return malloc537(size);
+#endif
+}
+
+void free537_in(malloc537_heap_t *heap, void *ptr)
+{
+#ifdef MALLOC537_HEAPS
+	node * temp;
+
+	if(heap == NULL)
+	{
+		free537(ptr);
+		return;
+	}
+
+	heap_enter(heap);
+	temp = check_free(ptr);
+	if(temp == NULL)
+	{
+		exit(EXIT_FAILURE);
+	}
+	mark_freed(temp);
+	free(ptr);
+	heap_leave(heap);
+	PROBE1(free, ptr);
+#else
+	(void)heap;
+	free537(ptr);
+#endif
+}
+
+void *realloc537_in(malloc537_heap_t *heap, void *ptr, size_t size)
+{
+#ifdef MALLOC537_HEAPS
+	void * return_pointer;
+	node * temp;
+
+	if(heap == NULL)
+	{
+		return realloc537(ptr, size);
+	}
+	if(ptr == NULL)
+	{
+		return malloc537_in(heap, size);
+	}
+	else if(size == 0)
+	{
+		free537_in(heap, ptr);
+		return NULL;
+	}
+
+	heap_enter(heap);
+	temp = tree_backend->top() == NULL ? NULL : tree_backend->lookup(ptr);
+	if(temp == NULL || node_free(temp))
+	{
+		/* Not something we can realloc - check_free says why. */
+		check_free(ptr);
+		exit(EXIT_FAILURE);
+	}
+	mark_freed(temp);
+	return_pointer = realloc(ptr, size);
+	heap_track(return_pointer, size);
+	heap_leave(heap);
+	PROBE3(realloc, ptr, return_pointer, size);
+	return return_pointer;
+#else
+	(void)heap;
+	return realloc537(ptr, size);
+#endif
+}
+
+/*
+ * Private blocks never go in the inline check's cache, so this
+ * always searches the heap's tree.
+ */
+void memcheck537_in(malloc537_heap_t *heap, void *ptr, size_t size)
+{
+#ifdef MALLOC537_HEAPS
+	if(heap == NULL)
+	{
+		memcheck537(ptr, size);
+		return;
+	}
+
+	/*
+	 * check_range quits if anything's wrong.
+	 */
+	heap_enter(heap);
+	check_range(ptr, size);
+	heap_leave(heap);
+#else
+	(void)heap;
+	memcheck537(ptr, size);
+#endif
+}
+
+/*
+ * The batch calls take the heap's lock once for the whole batch.
+ */
+int malloc537_n_in(malloc537_heap_t *heap, size_t size, int count, void ** out)
+{
+#ifdef MALLOC537_HEAPS
+	int allocated = 0;
+	int i;
+
+	if(heap == NULL)
+	{
+		return malloc537_n(size, count, out);
+	}
+	if(size == 0)
+	{
+		printf("Allocating %d pointers of size 0\n", count);
+	}
+
+	heap_enter(heap);
+	for(i = 0; i < count; i++)
+	{
+		out[i] = malloc(size);
+		if(out[i] == NULL && size != 0)
+		{
+			printf("Couldn't allocate block %d of %d (size %d)!\n", i, count, (int)size);
+			continue;
+		}
+		heap_track(out[i], size);
+		allocated++;
+	}
+	heap_leave(heap);
+	return allocated;
+#else
+	(void)heap;
+	return malloc537_n(size, count, out);
+#endif
+}
+
+/*
+ * Like free537_n, everything is checked before anything is freed.
+ * A pointer that's in the batch twice is reported as already freed.
+ */
+void free537_n_in(malloc537_heap_t *heap, void ** ptrs, int count)
+{
+#ifdef MALLOC537_HEAPS
+	node * temp;
+	int failures = 0;
+	int i;
+
+	if(heap == NULL)
+	{
+		free537_n(ptrs, count);
+		return;
+	}
+
+	heap_enter(heap);
+	for(i = 0; i < count; i++)
+	{
+		temp = check_free(ptrs[i]);
+		if(temp == NULL)
+		{
+			failures++;
+			continue;
+		}
+		mark_freed(temp);
+	}
+
+	if(failures > 0)
+	{
+		printf("%d of %d pointers passed to free537_n were bad!\n", failures, count);
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		free(ptrs[i]);
+	}
+	heap_leave(heap);
+#else
+	(void)heap;
+	free537_n(ptrs, count);
+#endif
+}
@@ -0,0 +1,32 @@
+/*
+ * heap.h
+ * Private heaps (build with -DMALLOC537_HEAPS).
+ * malloc537_heap_create makes a heap with its own tree and its own lock,
+ * and the _in calls in malloc537.h work on it, so a subsystem's blocks
+ * sit in a small tree of their own and threads on different heaps never
+ * wait for each other. Destroying a heap frees everything still in it
+ * in one walk, without deleting the nodes one at a time.
+ *
+ * A call on a private heap points the calling thread's current_tree
+ * (backend.h) at the heap's tree while it holds the heap's lock, and
+ * the index backend does the rest like it would for the default heap.
+ *
+ * Private heaps only track: their blocks come straight from malloc,
+ * and the extras built into the library (redzones, quarantine, huge
+ * blocks, tags, deferred merging, the frozen index, the page filter,
+ * the lazy log, the verifier, and the lifetime, latency and heatmap
+ * numbers) stay with the default heap. Errors are reported the same way.
+ */
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "rbtree.h"
+
+/*
+ * The checking halves of free537 and memcheck537, in malloc537.c.
+ * They work on current_tree, with its lock held.
+ */
+node * check_free(void * ptr);
+node * check_range(void * ptr, size_t size);
+
+#endif
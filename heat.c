@@ -0,0 +1,528 @@
+/*
+ * heat.c
+ * Per-block and per-site memcheck537 counts, see heat.h.
+ * The API in malloc537.h is always there; without MALLOC537_HEATMAP
+ * nothing ever gets counted, so the reports are just empty.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#define MALLOC537_INTERNAL
+#include "malloc537.h"
+#include "heat.h"
+
+/*
+ * Starting slots in a thread's table (a power of two).
+ * It doubles when it's half full.
+ */
+#define HEAT_START_SLOTS 256
+
+/*
+ * How many frees a thread logs before it marks them in the tables itself.
+ */
+#define HEAT_LOG_SLOTS 256
+
+/*
+ * A slot is empty until its checks go above 0. The owning thread fills
+ * in the rest first, so a reader that sees checks sees the whole key.
+ * seen is memcheck537_generation at the last check. freed is set when
+ * the logs are applied, from any thread. A slot with a NULL base holds
+ * what a site's freed blocks had.
+ */
+typedef struct heat_slot
+{
+	void * base;
+	void * site;
+	size_t bounds;
+	unsigned long checks;
+	unsigned long bytes;
+	unsigned long seen;
+	int freed;
+}heat_slot;
+
+typedef struct heat_table
+{
+	size_t capacity;
+	size_t used;
+	heat_slot slots[];
+}heat_table;
+
+/*
+ * A free537 that hasn't been marked in the tables yet. generation is
+ * memcheck537_generation once the free moved it on: the block's own
+ * checks all saw less than that, and a new block's at the same address
+ * can't have.
+ */
+typedef struct heat_free
+{
+	void * base;
+	void * site;
+	unsigned long generation;
+}heat_free;
+
+/*
+ * Every thread that ever counted or freed anything. A thread's table is
+ * only swapped for a new one with threads_lock held, and reports and
+ * apply_log only look at other threads' tables with it held, so the old
+ * one can go straight away. Only the thread itself adds to its log, but
+ * anyone holding threads_lock can apply it, under log_lock.
+ */
+typedef struct heat_thread
+{
+	heat_table * table;
+	pthread_mutex_t log_lock;
+	heat_free log[HEAT_LOG_SLOTS];
+	int logged;
+	struct heat_thread * next;
+}heat_thread;
+
+static heat_thread * threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread heat_thread * mine;
+
+static void dump_at_exit()
+{
+	char * env = getenv("MALLOC537_HEAT_TOP");
+	malloc537_heat_dump(env != NULL ? atoi(env) : HEAT_TOP);
+}
+
+static heat_table * new_table(size_t capacity)
+{
+	heat_table * table = calloc(1, sizeof(heat_table) + capacity * sizeof(heat_slot));
+	if(table == NULL)
+	{
+		printf("Couldn't allocate a heatmap table of %lu slots!\n", (unsigned long)capacity);
+		exit(EXIT_FAILURE);
+	}
+	table->capacity = capacity;
+	return table;
+}
+
+static size_t home(heat_table * table, void * base, void * site)
+{
+	uint64_t key = (uint64_t)(uintptr_t)base ^ ((uint64_t)(uintptr_t)site << 17);
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (table->capacity - 1);
+}
+
+/*
+ * Slot for (base, site), or the empty one it goes in.
+ */
+static heat_slot * find(heat_table * table, void * base, void * site)
+{
+	size_t pos = home(table, base, site);
+	heat_slot * slot;
+
+	for(;;)
+	{
+		slot = &table->slots[pos];
+		if(__atomic_load_n(&slot->checks, __ATOMIC_ACQUIRE) == 0 || (slot->base == base && slot->site == site))
+		{
+			return slot;
+		}
+		pos = (pos + 1) & (table->capacity - 1);
+	}
+}
+
+static void register_thread()
+{
+	mine = malloc(sizeof(heat_thread));
+	if(mine == NULL)
+	{
+		printf("Couldn't allocate a heatmap for this thread!\n");
+		exit(EXIT_FAILURE);
+	}
+	mine->table = new_table(HEAT_START_SLOTS);
+	pthread_mutex_init(&mine->log_lock, NULL);
+	mine->logged = 0;
+
+	pthread_mutex_lock(&threads_lock);
+	if(threads == NULL)
+	{
+		atexit(dump_at_exit);
+	}
+	mine->next = threads;
+	threads = mine;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/*
+ * Adds what slot counted to its site's slot in table.
+ */
+static void add_to_site(heat_table * table, heat_slot * slot)
+{
+	heat_slot * site = find(table, NULL, slot->site);
+
+	if(site->checks == 0)
+	{
+		site->base = NULL;
+		site->site = slot->site;
+		site->bounds = 0;
+		table->used++;
+	}
+	__atomic_store_n(&site->bytes, site->bytes + slot->bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&site->checks, site->checks + slot->checks, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies this thread's table into a new one of capacity slots,
+ * folding freed blocks into their sites (whose own slots may
+ * come after them, so those are added in too).
+ */
+static heat_table * copy_table(heat_table * old, size_t capacity)
+{
+	heat_table * fresh = new_table(capacity);
+	heat_slot * slot;
+	size_t i;
+
+	for(i = 0; i < old->capacity; i++)
+	{
+		slot = &old->slots[i];
+		if(slot->checks == 0)
+		{
+			continue;
+		}
+		if(slot->base == NULL || __atomic_load_n(&slot->freed, __ATOMIC_ACQUIRE))
+		{
+			add_to_site(fresh, slot);
+			continue;
+		}
+		*find(fresh, slot->base, slot->site) = *slot;
+		fresh->used++;
+	}
+	return fresh;
+}
+
+/*
+ * Marks the blocks in from's log freed in every table, unless the slot
+ * has been checked since (a new block at the same address, from the
+ * same site - its checks stay with it). Then empties the log.
+ * Caller holds threads_lock and from's log_lock.
+ */
+static void apply_log(heat_thread * from)
+{
+	heat_thread * thread;
+	heat_table * table;
+	heat_slot * slot;
+	int i;
+
+	for(i = 0; i < from->logged; i++)
+	{
+		for(thread = threads; thread != NULL; thread = thread->next)
+		{
+			table = __atomic_load_n(&thread->table, __ATOMIC_ACQUIRE);
+			slot = find(table, from->log[i].base, from->log[i].site);
+			if(__atomic_load_n(&slot->checks, __ATOMIC_ACQUIRE) != 0 && __atomic_load_n(&slot->seen, __ATOMIC_RELAXED) < from->log[i].generation)
+			{
+				__atomic_store_n(&slot->freed, 1, __ATOMIC_RELEASE);
+			}
+		}
+	}
+	from->logged = 0;
+}
+
+/*
+ * Applies every thread's log. Caller holds threads_lock.
+ */
+static void apply_logs()
+{
+	heat_thread * thread;
+
+	for(thread = threads; thread != NULL; thread = thread->next)
+	{
+		pthread_mutex_lock(&thread->log_lock);
+		apply_log(thread);
+		pthread_mutex_unlock(&thread->log_lock);
+	}
+}
+
+/*
+ * Makes room in this thread's table: a new copy without its freed
+ * blocks, twice the size if that's still more than a quarter full.
+ */
+static void make_room()
+{
+	heat_table * old = mine->table;
+	heat_table * fresh;
+
+	pthread_mutex_lock(&threads_lock);
+	apply_logs();
+	fresh = copy_table(old, old->capacity);
+	if(fresh->used * 4 > fresh->capacity)
+	{
+		free(old);
+		old = fresh;
+		fresh = copy_table(old, old->capacity * 2);
+	}
+	__atomic_store_n(&mine->table, fresh, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&threads_lock);
+	free(old);
+}
+
+void heat_record(void * base, size_t bounds, void * site, size_t size)
+{
+	heat_slot * slot;
+	unsigned long generation = __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED);
+
+	if(mine == NULL)
+	{
+		register_thread();
+	}
+	/*
+	 * Room for this block and for its site, if it has to be folded in.
+	 */
+	if((mine->table->used + 2) * 2 > mine->table->capacity)
+	{
+		make_room();
+	}
+
+	slot = find(mine->table, base, site);
+	if(slot->checks != 0 && __atomic_load_n(&slot->freed, __ATOMIC_ACQUIRE))
+	{
+		/*
+		 * The last block at this address (from the same site) was
+		 * freed. It goes to the site, and this one starts over.
+		 */
+		pthread_mutex_lock(&threads_lock);
+		add_to_site(mine->table, slot);
+		__atomic_store_n(&slot->bounds, bounds, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->bytes, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->seen, generation, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->checks, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->freed, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&threads_lock);
+		return;
+	}
+	if(slot->checks == 0)
+	{
+		slot->base = base;
+		slot->site = site;
+		mine->table->used++;
+	}
+	__atomic_store_n(&slot->bounds, bounds, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->bytes, slot->bytes + size, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seen, generation, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->checks, slot->checks + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Only this thread's log - nothing shared until the log fills up.
+ */
+void heat_forget(void * base, void * site)
+{
+	int full;
+
+	if(mine == NULL)
+	{
+		register_thread();
+	}
+
+	pthread_mutex_lock(&mine->log_lock);
+	mine->log[mine->logged].base = base;
+	mine->log[mine->logged].site = site;
+	mine->log[mine->logged].generation = __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED);
+	mine->logged++;
+	full = (mine->logged == HEAT_LOG_SLOTS);
+	pthread_mutex_unlock(&mine->log_lock);
+
+	if(full)
+	{
+		pthread_mutex_lock(&threads_lock);
+		pthread_mutex_lock(&mine->log_lock);
+		apply_log(mine);
+		pthread_mutex_unlock(&mine->log_lock);
+		pthread_mutex_unlock(&threads_lock);
+	}
+}
+
+/*
+ * qsort helpers.
+ */
+static int by_block(const void * a, const void * b)
+{
+	const heat_slot * left = a;
+	const heat_slot * right = b;
+
+	if(left->base != right->base)
+	{
+		return (char *)left->base < (char *)right->base ? -1 : 1;
+	}
+	if(left->site != right->site)
+	{
+		return (char *)left->site < (char *)right->site ? -1 : 1;
+	}
+	return 0;
+}
+
+static int by_site(const void * a, const void * b)
+{
+	const heat_slot * left = a;
+	const heat_slot * right = b;
+
+	if(left->site != right->site)
+	{
+		return (char *)left->site < (char *)right->site ? -1 : 1;
+	}
+	return 0;
+}
+
+static int hottest_first(const void * a, const void * b)
+{
+	const heat_slot * left = a;
+	const heat_slot * right = b;
+
+	if(left->checks != right->checks)
+	{
+		return left->checks > right->checks ? -1 : 1;
+	}
+	return left->bytes > right->bytes ? -1 : (left->bytes < right->bytes);
+}
+
+/*
+ * Copies every thread's counts into one array, then adds up the
+ * entries compare says are the same. Returns how many are left.
+ * With per_site, the blocks are dropped and only sites are kept.
+ */
+static size_t gather(heat_slot ** out, int per_site)
+{
+	heat_thread * thread;
+	heat_table * table;
+	heat_slot * all = NULL;
+	size_t count = 0;
+	size_t room = 0;
+	size_t merged = 0;
+	size_t i;
+	unsigned long checks;
+
+	pthread_mutex_lock(&threads_lock);
+	apply_logs();
+	for(thread = threads; thread != NULL; thread = thread->next)
+	{
+		table = __atomic_load_n(&thread->table, __ATOMIC_ACQUIRE);
+		if(count + table->capacity > room)
+		{
+			room = (count + table->capacity) * 2;
+			all = realloc(all, room * sizeof(heat_slot));
+			if(all == NULL)
+			{
+				printf("Couldn't allocate space to merge the heatmap!\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for(i = 0; i < table->capacity; i++)
+		{
+			checks = __atomic_load_n(&table->slots[i].checks, __ATOMIC_ACQUIRE);
+			if(checks == 0)
+			{
+				continue;
+			}
+			/*
+			 * Freed blocks (and what's already been folded
+			 * into their sites) only count for their sites.
+			 */
+			if(!per_site && (table->slots[i].base == NULL || __atomic_load_n(&table->slots[i].freed, __ATOMIC_ACQUIRE)))
+			{
+				continue;
+			}
+			all[count].base = table->slots[i].base;
+			all[count].site = table->slots[i].site;
+			all[count].bounds = __atomic_load_n(&table->slots[i].bounds, __ATOMIC_RELAXED);
+			all[count].checks = checks;
+			all[count].bytes = __atomic_load_n(&table->slots[i].bytes, __ATOMIC_RELAXED);
+			if(per_site)
+			{
+				all[count].base = NULL;
+				all[count].bounds = 0;
+			}
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	if(count == 0)
+	{
+		free(all);
+		*out = NULL;
+		return 0;
+	}
+
+	qsort(all, count, sizeof(heat_slot), per_site ? by_site : by_block);
+	for(i = 1; i < count; i++)
+	{
+		if((per_site ? by_site : by_block)(&all[merged], &all[i]) == 0)
+		{
+			all[merged].checks += all[i].checks;
+			all[merged].bytes += all[i].bytes;
+		}
+		else
+		{
+			all[++merged] = all[i];
+		}
+	}
+	count = merged + 1;
+
+	qsort(all, count, sizeof(heat_slot), hottest_first);
+	*out = all;
+	return count;
+}
+
+static int top(malloc537_heat * out, int count, int per_site)
+{
+	heat_slot * all;
+	size_t found = gather(&all, per_site);
+	int i;
+
+	for(i = 0; i < count && (size_t)i < found; i++)
+	{
+		out[i].base = all[i].base;
+		out[i].bounds = all[i].bounds;
+		out[i].site = all[i].site;
+		out[i].checks = all[i].checks;
+		out[i].bytes = all[i].bytes;
+	}
+	free(all);
+	return i;
+}
+
+int malloc537_heat_objects(malloc537_heat * out, int count)
+{
+	return top(out, count, 0);
+}
+
+int malloc537_heat_sites(malloc537_heat * out, int count)
+{
+	return top(out, count, 1);
+}
+
+void malloc537_heat_dump(int count)
+{
+	malloc537_heat * hottest;
+	int found;
+	int i;
+
+	if(count <= 0)
+	{
+		return;
+	}
+	hottest = malloc(count * sizeof(malloc537_heat));
+	if(hottest == NULL)
+	{
+		printf("Couldn't allocate space for the heatmap report!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	found = malloc537_heat_objects(hottest, count);
+	printf("malloc537 hottest blocks (memcheck537 calls, bytes checked):\n");
+	for(i = 0; i < found; i++)
+	{
+		printf("  %p (%lu bytes) from %p: %lu checks, %lu bytes\n", hottest[i].base, (unsigned long)hottest[i].bounds, hottest[i].site, hottest[i].checks, hottest[i].bytes);
+	}
+
+	found = malloc537_heat_sites(hottest, count);
+	printf("malloc537 hottest allocation sites:\n");
+	for(i = 0; i < found; i++)
+	{
+		printf("  %p: %lu checks, %lu bytes\n", hottest[i].site, hottest[i].checks, hottest[i].bytes);
+	}
+	free(hottest);
+}
@@ -0,0 +1,46 @@
+/*
+ * heat.h
+ * memcheck537 heatmap (build with -DMALLOC537_HEATMAP).
+ * Every memcheck537 that finds its block counts one check, and the bytes
+ * checked, against that block and the place it was allocated from (the
+ * return address of the malloc537-family call, kept in its node).
+ *
+ * Each thread counts into its own table, which only it ever writes, so
+ * checking never bounces a cache line between threads. The tables are
+ * only added up when somebody asks for a report (malloc537_heat_objects,
+ * malloc537_heat_sites, malloc537_heat_dump - see malloc537.h), and
+ * the top MALLOC537_HEAT_TOP (environment, default 10) are printed at exit.
+ *
+ * Frees go in a log kept by the thread that freed the block, so freeing
+ * doesn't touch anybody else's memory either. The logs are applied to
+ * every table (marking the freed blocks' entries) when a log fills up,
+ * when a thread makes room in its table, and before a report. Each
+ * thread folds its marked entries into their site's totals when it makes
+ * room, so the tables only hold blocks that are still around (plus one
+ * entry per site) and the block report only shows live blocks. A block
+ * allocated from the same site at the address of one that was freed,
+ * and checked before that free was applied, keeps the old block's counts.
+ *
+ * None of these need the tree lock.
+ */
+#ifndef HEAT_H
+#define HEAT_H
+
+#include <stddef.h>
+
+#ifndef HEAT_TOP
+#define HEAT_TOP 10
+#endif
+
+/*
+ * One check of size bytes inside the block at base, allocated from site.
+ */
+void heat_record(void * base, size_t bounds, void * site, size_t size);
+
+/*
+ * The block at base, allocated from site, was freed. Call it after the
+ * free has moved memcheck537_generation on.
+ */
+void heat_forget(void * base, void * site);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * hugeblock.c
+ * Huge blocks straight from mmap, see hugeblock.h.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "hugeblock.h"
+#ifdef MALLOC537_LIFETIME
+#include "lifetime.h"
+#endif
+
+/*
+ * How many freed blocks we remember for double free reports.
+ * Past this, the one freed longest ago is forgotten.
+ */
+#define HUGE_GRAVEYARD 256
+
+typedef struct huge_block
+{
+	char * base;
+	size_t bounds;
+	/* What's actually mapped - bounds rounded up to pages. */
+	size_t length;
+	/* 0 while it's live, otherwise when it was freed (bigger is later). */
+	unsigned long freed;
+#ifdef MALLOC537_LIFETIME
+	/* When its current lifetime started. */
+	uint64_t stamp;
+#endif
+}huge_block;
+
+/*
+ * Sorted by base.
+ */
+static huge_block * blocks;
+static size_t block_count;
+static size_t block_capacity;
+static size_t freed_count;
+static unsigned long free_clock;
+
+/*
+ * Everything in the array is somewhere in [lowest, highest).
+ * Read without the lock, so most pointers never take it.
+ */
+static char * lowest;
+static char * highest;
+
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t threshold = HUGE_THRESHOLD;
+static size_t page_size;
+
+/*
+ * Reads the threshold from the environment before main runs.
+ */
+static void setup() __attribute__((constructor));
+
+static void setup()
+{
+	char * env = getenv("MALLOC537_HUGE_THRESHOLD");
+	if(env != NULL)
+	{
+		threshold = (size_t)strtoull(env, NULL, 0);
+	}
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+size_t huge_threshold()
+{
+	return threshold;
+}
+
+static int outside_range(char * start, char * end)
+{
+	return end <= __atomic_load_n(&lowest, __ATOMIC_RELAXED) || start >= __atomic_load_n(&highest, __ATOMIC_RELAXED);
+}
+
+/*
+ * Index of the last block with a base at or below ptr, or -1.
+ * Caller holds huge_lock.
+ */
+static long find(char * ptr)
+{
+	long low = 0;
+	long high = (long)block_count - 1;
+	long found = -1;
+	long middle;
+
+	while(low <= high)
+	{
+		middle = (low + high) / 2;
+		if(blocks[middle].base <= ptr)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+/*
+ * Caller holds huge_lock.
+ */
+static void remove_at(size_t at)
+{
+	if(blocks[at].freed)
+	{
+		freed_count--;
+	}
+	memmove(&blocks[at], &blocks[at + 1], (block_count - at - 1) * sizeof(huge_block));
+	block_count--;
+	if(block_count == 0)
+	{
+		__atomic_store_n(&lowest, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&highest, NULL, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Drops freed blocks overlapping [start, end).
+ * Caller holds huge_lock.
+ */
+static void forget_range(char * start, char * end)
+{
+	long at = find(start);
+
+	if(at < 0)
+	{
+		at = 0;
+	}
+	while((size_t)at < block_count && blocks[at].base < end)
+	{
+		if(blocks[at].freed && blocks[at].base + blocks[at].length > start)
+		{
+			remove_at((size_t)at);
+		}
+		else
+		{
+			at++;
+		}
+	}
+}
+
+/*
+ * Adds a live block, keeping the array sorted.
+ * Caller holds huge_lock.
+ */
+static void add(char * base, size_t bounds, size_t length)
+{
+	size_t at;
+	huge_block * new_blocks;
+
+	forget_range(base, base + length);
+
+	if(block_count == block_capacity)
+	{
+		block_capacity = block_capacity ? block_capacity * 2 : 16;
+		new_blocks = realloc(blocks, block_capacity * sizeof(huge_block));
+		if(new_blocks == NULL)
+		{
+			printf("Couldn't grow the huge block list to %lu entries!\n", (unsigned long)block_capacity);
+			exit(EXIT_FAILURE);
+		}
+		blocks = new_blocks;
+	}
+
+	at = (size_t)(find(base) + 1);
+	memmove(&blocks[at + 1], &blocks[at], (block_count - at) * sizeof(huge_block));
+	blocks[at].base = base;
+	blocks[at].bounds = bounds;
+	blocks[at].length = length;
+	blocks[at].freed = 0;
+#ifdef MALLOC537_LIFETIME
+	blocks[at].stamp = lifetime_now();
+#endif
+	block_count++;
+
+	if(lowest == NULL || base < lowest)
+	{
+		__atomic_store_n(&lowest, base, __ATOMIC_RELAXED);
+	}
+	if(base + length > highest)
+	{
+		__atomic_store_n(&highest, base + length, __ATOMIC_RELAXED);
+	}
+}
+
+static size_t round_to_pages(size_t size)
+{
+	return size == 0 ? page_size : (size + page_size - 1) & ~(page_size - 1);
+}
+
+void * huge_alloc(size_t size)
+{
+	size_t length = round_to_pages(size);
+	char * base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(base == MAP_FAILED)
+	{
+		printf("Couldn't map %lu bytes for a huge block!\n", (unsigned long)size);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&huge_lock);
+	add(base, size, length);
+	pthread_mutex_unlock(&huge_lock);
+	return base;
+}
+
+void huge_free(void * ptr)
+{
+	long at;
+	long oldest;
+	size_t i;
+
+	pthread_mutex_lock(&huge_lock);
+	at = find(ptr);
+	munmap(blocks[at].base, blocks[at].length);
+	blocks[at].freed = ++free_clock;
+#ifdef MALLOC537_LIFETIME
+	lifetime_record(blocks[at].bounds, blocks[at].stamp);
+#endif
+	freed_count++;
+
+	if(freed_count > HUGE_GRAVEYARD)
+	{
+		oldest = -1;
+		for(i = 0; i < block_count; i++)
+		{
+			if(blocks[i].freed && (oldest < 0 || blocks[i].freed < blocks[oldest].freed))
+			{
+				oldest = (long)i;
+			}
+		}
+		remove_at((size_t)oldest);
+	}
+	pthread_mutex_unlock(&huge_lock);
+}
+
+void * huge_realloc(void * ptr, size_t size)
+{
+	size_t length = round_to_pages(size);
+	long at;
+	char * base;
+	huge_block old;
+
+	pthread_mutex_lock(&huge_lock);
+	at = find(ptr);
+	old = blocks[at];
+
+	if(length == old.length)
+	{
+#ifdef MALLOC537_LIFETIME
+		/* Same as a moved one: the old lifetime ends, a new one starts. */
+		lifetime_record(old.bounds, old.stamp);
+		blocks[at].stamp = lifetime_now();
+#endif
+		blocks[at].bounds = size;
+		pthread_mutex_unlock(&huge_lock);
+		return ptr;
+	}
+
+	base = mremap(old.base, old.length, length, MREMAP_MAYMOVE);
+	if(base == MAP_FAILED)
+	{
+		pthread_mutex_unlock(&huge_lock);
+		printf("Couldn't remap huge block %p from %lu to %lu bytes!\n", ptr, (unsigned long)old.bounds, (unsigned long)size);
+		return NULL;
+	}
+
+#ifdef MALLOC537_LIFETIME
+	lifetime_record(old.bounds, old.stamp);
+#endif
+	remove_at((size_t)at);
+	add(base, size, length);
+	pthread_mutex_unlock(&huge_lock);
+	return base;
+}
+
+/*
+ * Whether anything has mapped the page holding p since the huge block
+ * there was unmapped: mincore fails with ENOMEM on a page nothing maps.
+ */
+static int mapped_again(char * p)
+{
+	unsigned char resident;
+
+	return mincore((void *)((size_t)p & ~(page_size - 1)), 1, &resident) == 0;
+}
+
+int huge_lookup(void * ptr, void ** base, size_t * bounds)
+{
+	char * p = ptr;
+	long at;
+	int found = HUGE_NONE;
+
+	if(outside_range(p, p + 1))
+	{
+		return HUGE_NONE;
+	}
+
+	pthread_mutex_lock(&huge_lock);
+	at = find(p);
+	if(at >= 0 && p <= blocks[at].base + blocks[at].bounds)
+	{
+		/*
+		 * A freed block whose pages something else has mapped since
+		 * (add would have dropped it for one of ours) no longer says
+		 * anything about the pointer. One past the end is looked up on
+		 * the block's last page, the next one was never the block's.
+		 */
+		if(blocks[at].freed && mapped_again(p < blocks[at].base + blocks[at].length ? p : p - 1))
+		{
+			remove_at((size_t)at);
+		}
+		else
+		{
+			*base = blocks[at].base;
+			*bounds = blocks[at].bounds;
+			found = blocks[at].freed ? HUGE_FREED : HUGE_LIVE;
+		}
+	}
+	pthread_mutex_unlock(&huge_lock);
+	return found;
+}
+
+void huge_forget(void * base, size_t size)
+{
+	char * start = base;
+
+	if(base == NULL || outside_range(start, start + size + 1))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&huge_lock);
+	forget_range(start, start + size + 1);
+	pthread_mutex_unlock(&huge_lock);
+}
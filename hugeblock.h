@@ -0,0 +1,74 @@
+/*
+ * hugeblock.h
+ * Huge blocks (build with -DMALLOC537_HUGE_BLOCKS).
+ * Anything of at least the threshold (MALLOC537_HUGE_THRESHOLD in the
+ * environment, or HUGE_THRESHOLD) gets its own mmap instead of coming
+ * from malloc, is munmapped as soon as it's freed, and grows or shrinks
+ * in place with mremap. There aren't many, so they're kept in a small
+ * sorted array here instead of in the tree, and checking one never
+ * touches the tree.
+ *
+ * Freed huge blocks stay in the array (so a double free still gets
+ * reported) until something new is allocated over them, or until a
+ * lookup finds their pages mapped again by something else.
+ *
+ * With MALLOC537_LIFETIME each entry carries its lifetime stamp, and
+ * huge_free and huge_realloc count the lifetime that ends.
+ *
+ * The array has its own lock; none of these need the tree lock.
+ */
+#ifndef HUGEBLOCK_H
+#define HUGEBLOCK_H
+
+#include <stddef.h>
+
+#ifndef HUGE_THRESHOLD
+#define HUGE_THRESHOLD (1024 * 1024)
+#endif
+
+/*
+ * What huge_lookup found.
+ */
+#define HUGE_NONE 0
+#define HUGE_LIVE 1
+#define HUGE_FREED 2
+
+/*
+ * Sizes from here up are huge.
+ */
+size_t huge_threshold();
+
+/*
+ * Maps and tracks a new huge block. Prints why and returns NULL
+ * if the mmap fails.
+ */
+void * huge_alloc(size_t size);
+
+/*
+ * Unmaps the live huge block starting at ptr, remembering it as freed.
+ * The caller has already checked it with huge_lookup.
+ */
+void huge_free(void * ptr);
+
+/*
+ * Resizes the live huge block starting at ptr with mremap, which moves
+ * it without copying if it can't grow where it is. Returns the new base,
+ * or NULL (with the old block untouched) if that didn't work.
+ */
+void * huge_realloc(void * ptr, size_t size);
+
+/*
+ * Finds the huge block ptr is in (counting one past its end, like the
+ * tree does). Returns HUGE_NONE if there isn't one - it's the tree's
+ * problem - otherwise HUGE_LIVE or HUGE_FREED, with the block's base
+ * and bounds in *base and *bounds.
+ */
+int huge_lookup(void * ptr, void ** base, size_t * bounds);
+
+/*
+ * Drops any freed huge blocks overlapping a block that was just
+ * allocated, so old huge frees don't get blamed for it.
+ */
+void huge_forget(void * base, size_t size);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * latency.c
+ * Per-thread latency histograms, see latency.h.
+ * The API in malloc537.h is always there; without MALLOC537_LATENCY
+ * nothing ever gets counted, so the histograms just stay empty.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#define MALLOC537_INTERNAL
+#include "latency.h"
+
+/*
+ * One thread's histograms. They're never freed, since a
+ * report could be reading them after the thread's gone.
+ */
+typedef struct latency_thread
+{
+	unsigned long counts[MALLOC537_LATENCY_OPS][MALLOC537_LATENCY_BUCKETS];
+	struct latency_thread * next;
+}latency_thread;
+
+static latency_thread * threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread latency_thread * mine;
+
+static const char * op_names[MALLOC537_LATENCY_OPS] =
+{
+	"malloc537",
+	"free537",
+	"realloc537",
+	"memcheck537 (start)",
+	"memcheck537 (inside)",
+	"malloc537_n",
+	"free537_n",
+	"malloc537_tagged",
+	"free537_tag"
+};
+
+static void dump_at_exit()
+{
+	malloc537_latency_dump();
+}
+
+static void register_thread()
+{
+	mine = calloc(1, sizeof(latency_thread));
+	if(mine == NULL)
+	{
+		printf("Couldn't allocate latency histograms for this thread!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	if(threads == NULL)
+	{
+		atexit(dump_at_exit);
+	}
+	mine->next = threads;
+	threads = mine;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+void latency_record(int op, uint64_t ticks)
+{
+	unsigned long * count;
+
+	if(mine == NULL)
+	{
+		register_thread();
+	}
+	count = &mine->counts[op][latency_bucket(ticks)];
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+void malloc537_latency(int op, unsigned long counts[MALLOC537_LATENCY_BUCKETS])
+{
+	latency_thread * thread;
+	int bucket;
+
+	memset(counts, 0, MALLOC537_LATENCY_BUCKETS * sizeof(unsigned long));
+	if(op < 0 || op >= MALLOC537_LATENCY_OPS)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	for(thread = threads; thread != NULL; thread = thread->next)
+	{
+		for(bucket = 0; bucket < MALLOC537_LATENCY_BUCKETS; bucket++)
+		{
+			counts[bucket] += __atomic_load_n(&thread->counts[op][bucket], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+unsigned long malloc537_latency_value(int bucket)
+{
+	int power;
+
+	if(bucket < LATENCY_EXACT)
+	{
+		return (unsigned long)bucket;
+	}
+	power = (bucket - LATENCY_EXACT) / LATENCY_SUB + LATENCY_SUB_BITS + 1;
+	return (unsigned long)(LATENCY_SUB + (bucket - LATENCY_EXACT) % LATENCY_SUB) << (power - LATENCY_SUB_BITS);
+}
+
+/*
+ * The top of the bucket the percent'th call landed in, from counts
+ * that add up to total.
+ */
+static unsigned long percentile(unsigned long * counts, unsigned long total, double percent)
+{
+	double wanted = (double)total * percent / 100.0;
+	unsigned long seen = 0;
+	int bucket;
+
+	for(bucket = 0; bucket < MALLOC537_LATENCY_BUCKETS - 1; bucket++)
+	{
+		seen += counts[bucket];
+		if(seen > 0 && (double)seen >= wanted)
+		{
+			break;
+		}
+	}
+	if(bucket == MALLOC537_LATENCY_BUCKETS - 1)
+	{
+		return malloc537_latency_value(bucket);
+	}
+	return malloc537_latency_value(bucket + 1) - 1;
+}
+
+unsigned long malloc537_latency_percentile(int op, double percent)
+{
+	unsigned long counts[MALLOC537_LATENCY_BUCKETS];
+	unsigned long total = 0;
+	int bucket;
+
+	malloc537_latency(op, counts);
+	for(bucket = 0; bucket < MALLOC537_LATENCY_BUCKETS; bucket++)
+	{
+		total += counts[bucket];
+	}
+	return total ? percentile(counts, total, percent) : 0;
+}
+
+void malloc537_latency_dump()
+{
+	unsigned long counts[MALLOC537_LATENCY_BUCKETS];
+	unsigned long total;
+	int op;
+	int bucket;
+
+	printf("malloc537 call latency (" LIFETIME_UNIT "):\n");
+	printf("  %-22s %10s %10s %10s %10s %10s\n", "", "calls", "p50", "p99", "p99.9", "max");
+	for(op = 0; op < MALLOC537_LATENCY_OPS; op++)
+	{
+		malloc537_latency(op, counts);
+		total = 0;
+		for(bucket = 0; bucket < MALLOC537_LATENCY_BUCKETS; bucket++)
+		{
+			total += counts[bucket];
+		}
+		if(total == 0)
+		{
+			continue;
+		}
+		printf("  %-22s %10lu %10lu %10lu %10lu %10lu\n", op_names[op], total,
+			percentile(counts, total, 50.0), percentile(counts, total, 99.0),
+			percentile(counts, total, 99.9), percentile(counts, total, 100.0));
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * latency.h
+ * Per-call latency histograms (build with -DMALLOC537_LATENCY).
+ * Every public call in malloc537.c that returns is timed with the
+ * lifetime clock (TSC on x86) and counted in the calling thread's own
+ * histograms, which only it writes. malloc537_latency (malloc537.h)
+ * adds up every thread's when somebody asks.
+ *
+ * None of this needs the tree lock.
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include "lifetime.h"
+
+/*
+ * Values below LATENCY_EXACT get a bucket each. After that, each power
+ * of two is split into LATENCY_SUB buckets (the top bits below its
+ * leading one).
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_EXACT (2 * LATENCY_SUB)
+
+static inline int latency_bucket(uint64_t ticks)
+{
+	int power;
+	int bucket;
+
+	if(ticks < LATENCY_EXACT)
+	{
+		return (int)ticks;
+	}
+	power = 63 - __builtin_clzll(ticks);
+	bucket = LATENCY_EXACT + (power - LATENCY_SUB_BITS - 1) * LATENCY_SUB + (int)((ticks >> (power - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+	return bucket < MALLOC537_LATENCY_BUCKETS ? bucket : MALLOC537_LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Counts one call to op that took ticks.
+ */
+void latency_record(int op, uint64_t ticks);
+
+#endif
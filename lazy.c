@@ -0,0 +1,158 @@
+/*
+ * lazy.c
+ * The allocation log and the one-time build, see lazy.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "lazy.h"
+
+#ifdef MALLOC537_LIFETIME
+#include "lifetime.h"
+#endif
+
+static index_backend lazy_table;
+static const index_backend * real_backend;
+
+/*
+ * Private heaps (heap.h) never have a log - their trees
+ * go straight to the real backend.
+ */
+#ifdef MALLOC537_HEAPS
+#define PRIVATE_TREE() (current_tree != &default_tree)
+#else
+#define PRIVATE_TREE() 0
+#endif
+
+static index_entry * entries;
+static size_t entry_count;
+static size_t entry_capacity;
+
+/*
+ * qsort helper - orders entries by base.
+ */
+static int compare_entries(const void * a, const void * b)
+{
+	const char * left = ((const index_entry *)a)->base;
+	const char * right = ((const index_entry *)b)->base;
+	return left < right ? -1 : (left > right);
+}
+
+/*
+ * Puts the logged blocks in the real index and switches over to it.
+ */
+static void build()
+{
+	qsort(entries, entry_count, sizeof(index_entry), compare_entries);
+	real_backend->build(entries, entry_count);
+	free(entries);
+	entries = NULL;
+	entry_count = 0;
+	entry_capacity = 0;
+	tree_backend = real_backend;
+}
+
+/*
+ * Nothing in the log has been freed (a free537 has to search, which
+ * builds the index first), and blocks don't overlap, so a new block
+ * never covers anything.
+ */
+static node * lazy_contained_lookup(void * base, size_t bounds)
+{
+	if(PRIVATE_TREE())
+	{
+		return real_backend->contained_lookup(base, bounds);
+	}
+	return NULL;
+}
+
+static int lazy_remove_range(void * base, size_t bounds)
+{
+	if(PRIVATE_TREE())
+	{
+		return real_backend->remove_range(base, bounds);
+	}
+	return 0;
+}
+
+static int lazy_insert(void * base, size_t bounds)
+{
+	index_entry * bigger;
+
+	if(PRIVATE_TREE())
+	{
+		return real_backend->insert(base, bounds);
+	}
+
+	if(entry_count == entry_capacity)
+	{
+		entry_capacity = entry_capacity ? entry_capacity * 2 : LAZY_START_ENTRIES;
+		bigger = realloc(entries, entry_capacity * sizeof(index_entry));
+		if(bigger == NULL)
+		{
+			printf("Couldn't grow the allocation log to %lu blocks!\n", (unsigned long)entry_capacity);
+			exit(EXIT_FAILURE);
+		}
+		entries = bigger;
+	}
+
+	entries[entry_count].base = base;
+	entries[entry_count].bounds = bounds;
+#ifdef MALLOC537_LIFETIME
+	entries[entry_count].stamp = lifetime_now();
+#endif
+	entry_count++;
+	return 1;
+}
+
+/*
+ * Everything else needs the real index.
+ */
+static node * lazy_lookup(void * base)
+{
+	if(!PRIVATE_TREE())
+	{
+		build();
+	}
+	return real_backend->lookup(base);
+}
+
+static node * lazy_bounds_lookup(void * base)
+{
+	if(!PRIVATE_TREE())
+	{
+		build();
+	}
+	return real_backend->bounds_lookup(base);
+}
+
+static int lazy_delete_node(void * base)
+{
+	if(!PRIVATE_TREE())
+	{
+		build();
+	}
+	return real_backend->delete_node(base);
+}
+
+static node * lazy_top()
+{
+	if(!PRIVATE_TREE())
+	{
+		build();
+	}
+	return real_backend->top();
+}
+
+const index_backend * lazy_backend(const index_backend * real)
+{
+	real_backend = real;
+	lazy_table = *real;
+	lazy_table.lookup = lazy_lookup;
+	lazy_table.bounds_lookup = lazy_bounds_lookup;
+	lazy_table.contained_lookup = lazy_contained_lookup;
+	lazy_table.remove_range = lazy_remove_range;
+	lazy_table.insert = lazy_insert;
+	lazy_table.delete_node = lazy_delete_node;
+	lazy_table.top = lazy_top;
+	return &lazy_table;
+}
@@ -0,0 +1,33 @@
+/*
+ * lazy.h
+ * Lazy index (build with -DMALLOC537_LAZY), for programs that make lots
+ * of blocks before they check any of them.
+ *
+ * Until something needs to search the index, malloc537 just appends
+ * the block to a log. The first search (a memcheck537, a free537, a
+ * realloc537...) sorts the log and builds the whole tree from it in one
+ * pass, with no per-block searches or rebalancing, and from then on
+ * it's the normal index, kept up to date one block at a time.
+ *
+ * It works by standing in for the real backend (backend.h) while there's
+ * a log, so everything here runs with the tree lock held.
+ */
+#ifndef LAZY_H
+#define LAZY_H
+
+#include "backend.h"
+
+/*
+ * Starting log size in blocks. It doubles as it fills.
+ */
+#ifndef LAZY_START_ENTRIES
+#define LAZY_START_ENTRIES 4096
+#endif
+
+/*
+ * The backend to use until the first search, which then
+ * hands everything over to real.
+ */
+const index_backend * lazy_backend(const index_backend * real);
+
+#endif
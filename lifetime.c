@@ -0,0 +1,90 @@
+/*
+ * lifetime.c
+ * Lifetime histograms, see lifetime.h.
+ * The API in malloc537.h is always there; without MALLOC537_LIFETIME
+ * nothing ever gets counted, so the histograms just stay empty.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#define MALLOC537_INTERNAL
+#include "lifetime.h"
+
+static unsigned long histogram[MALLOC537_SIZE_CLASSES][MALLOC537_LIFETIME_BUCKETS];
+static int dump_registered;
+
+/*
+ * floor(log2(value)), with 0 for 0.
+ */
+static int log2_floor(uint64_t value)
+{
+	return value ? 63 - __builtin_clzll(value) : 0;
+}
+
+static void dump_at_exit()
+{
+	malloc537_lifetime_dump();
+}
+
+void lifetime_record(size_t bounds, uint64_t stamp)
+{
+	int bucket = log2_floor(lifetime_now() - stamp);
+
+	if(!__atomic_load_n(&dump_registered, __ATOMIC_RELAXED) && !__atomic_exchange_n(&dump_registered, 1, __ATOMIC_RELAXED))
+	{
+		atexit(dump_at_exit);
+	}
+
+	if(bucket >= MALLOC537_LIFETIME_BUCKETS)
+	{
+		bucket = MALLOC537_LIFETIME_BUCKETS - 1;
+	}
+	__atomic_add_fetch(&histogram[malloc537_size_class(bounds)][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void malloc537_lifetimes(unsigned long counts[MALLOC537_SIZE_CLASSES][MALLOC537_LIFETIME_BUCKETS])
+{
+	int class;
+	int bucket;
+
+	for(class = 0; class < MALLOC537_SIZE_CLASSES; class++)
+	{
+		for(bucket = 0; bucket < MALLOC537_LIFETIME_BUCKETS; bucket++)
+		{
+			counts[class][bucket] = __atomic_load_n(&histogram[class][bucket], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void malloc537_lifetime_dump()
+{
+	int class;
+	int bucket;
+	unsigned long total;
+
+	printf("malloc537 block lifetimes (" LIFETIME_UNIT ", log2 buckets):\n");
+	for(class = 0; class < MALLOC537_SIZE_CLASSES; class++)
+	{
+		total = 0;
+		for(bucket = 0; bucket < MALLOC537_LIFETIME_BUCKETS; bucket++)
+		{
+			total += histogram[class][bucket];
+		}
+		if(total == 0)
+		{
+			continue;
+		}
+
+		if(class == MALLOC537_SIZE_CLASSES - 1)
+		printf("  > %lu bytes, %lu blocks:\n", 8ul << class, total);
+		else
+		printf("  <= %lu bytes, %lu blocks:\n", 16ul << class, total);
+
+		for(bucket = 0; bucket < MALLOC537_LIFETIME_BUCKETS; bucket++)
+		{
+			if(histogram[class][bucket] != 0)
+			{
+				printf("    2^%-2d %10lu\n", bucket, histogram[class][bucket]);
+			}
+		}
+	}
+}
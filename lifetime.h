@@ -0,0 +1,44 @@
+/*
+ * lifetime.h
+ * Allocation lifetime histograms (build with -DMALLOC537_LIFETIME).
+ * Every node gets stamped when it goes into the tree (huge blocks in
+ * hugeblock.c's array), and when the block is freed we count how long
+ * it lived, split up by size class.
+ * Lifetimes are in clock ticks: TSC cycles on x86, nanoseconds elsewhere.
+ */
+#ifndef LIFETIME_H
+#define LIFETIME_H
+
+#include <stdint.h>
+#include <time.h>
+#include "malloc537.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LIFETIME_UNIT "cycles"
+#else
+#define LIFETIME_UNIT "ns"
+#endif
+
+/*
+ * Cheapest clock we can get - this runs on every malloc537 and free537.
+ */
+static inline uint64_t lifetime_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * Counts one block of bounds bytes that lived from stamp until now.
+ * The counts are atomic: huge blocks are counted under their own lock,
+ * not the tree's.
+ */
+void lifetime_record(size_t bounds, uint64_t stamp);
+
+#endif
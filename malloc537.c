@@ -8,8 +8,96 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#define MALLOC537_INTERNAL
 #include "malloc537.h"
 #include "rbtree.h"
+#include "backend.h"
+#include "pagefilter.h"
+#include "probes.h"
+#include "heap.h"
+#include "report537.h"
+
+/*
+ * Deferred mode and the background verifier both mean more than one
+ * thread in the tree, so the tree gets a lock.
+ */
+#if defined(MALLOC537_DEFERRED) || defined(MALLOC537_VERIFIER)
+#include <pthread.h>
+#define MALLOC537_LOCKING
+#endif
+
+#ifdef MALLOC537_VERIFIER
+#include <time.h>
+#include "verifier.h"
+#endif
+
+#ifdef MALLOC537_LIFETIME
+#include "lifetime.h"
+#endif
+
+#ifdef MALLOC537_QUARANTINE
+#include "quarantine.h"
+#endif
+
+#ifdef MALLOC537_REDZONE
+#include "redzone.h"
+#endif
+
+#ifdef MALLOC537_HUGE_BLOCKS
+#include <string.h>
+#include "hugeblock.h"
+#endif
+
+#ifdef MALLOC537_FROZEN_INDEX
+#include "frozen.h"
+#endif
+
+#ifdef MALLOC537_TAGS
+#include "tags.h"
+#endif
+
+#ifdef MALLOC537_HEATMAP
+#include "heat.h"
+#endif
+
+#ifdef MALLOC537_LATENCY
+#include "latency.h"
+/*
+ * Times a public call: LATENCY_START() goes last in its declarations,
+ * and LATENCY_RECORD(op) just before each return.
+ */
+#define LATENCY_START() uint64_t latency_started = lifetime_now()
+#define LATENCY_RECORD(op) latency_record((op), lifetime_now() - latency_started)
+#else
+#define LATENCY_START()
+#define LATENCY_RECORD(op)
+#endif
+
+/*
+ * memcheck537 is timed separately for block starts and pointers inside blocks.
+ */
+#define LATENCY_MEMCHECK(base) LATENCY_RECORD((void *)(base) == ptr ? MALLOC537_LATENCY_MEMCHECK_EXACT : MALLOC537_LATENCY_MEMCHECK_INTERIOR)
+
+#ifdef MALLOC537_MODES
+#include "mode.h"
+/*
+ * The public names belong to mode.c, which jumps to these
+ * or to libc depending on the mode.
+ */
+#define malloc537 malloc537_tracked
+#define free537 free537_tracked
+#define realloc537 realloc537_tracked
+#define memcheck537 memcheck537_tracked
+#endif
+
+/*
+ * With quarantine or redzones, realloc537 can't just call realloc -
+ * the old block has to go through release() like any other.
+ */
+#if defined(MALLOC537_QUARANTINE) || defined(MALLOC537_REDZONE)
+#include <string.h>
+#define MOVE_ON_REALLOC
+#endif
 
 /*
  * Allocates memory using malloc, and stores a tuple of address and length
@@ -19,212 +107,1794 @@
 
 
 /*
- * TODO: make sure we remove nodes when we do an insert.
  * When we insert a node that fully covers a freed node,
  * remove the freed node.
  *
- * NOTE: our contained_lookup function, which should return a
- * freed node that is covered by what we just allocated, doesn't
- * seem to work. So we never delete any nodes from the tree.
- * Not sure if that's due to the behavior of 537ps, or
- * our code.
+ * NOTE: this used to never happen - contained_lookup was fine,
+ * but delete_node was broken. Fixed along with the compact nodes.
  */
 
 
-extern node * root;
+/*
+ * Last block memcheck537 passed on this thread, for the inline check
+ * in malloc537.h. Anything that frees a block bumps the generation,
+ * which throws away every thread's cached block.
+ */
+__thread memcheck537_cache memcheck537_last;
+unsigned long memcheck537_generation = 1;
+
+#define FORGET_CHECKS() __atomic_add_fetch(&memcheck537_generation, 1, __ATOMIC_RELAXED)
 
 /*
- * malloc537 is a wrapper around malloc.
- * It add the tuple (base, bounds) to a range
- * tree to track memory allocation!
+ * Remembers the block memcheck537 just passed, for the inline check.
  */
-void *malloc537(size_t size)
+static void remember_check(void * base, size_t bounds, unsigned long generation)
 {
-	void * return_ptr;
-	node * remove_node = NULL;
-	if(size == 0)
-	{
-		printf("Allocating a pointer of size 0\n");
-	}
+	memcheck537_last.base = base;
+	memcheck537_last.bounds = bounds;
+#ifdef MALLOC537_HEATMAP
+	/*
+	 * Every check has to get here to be counted, so the inline
+	 * check is never allowed a hit (generations start at 1).
+	 */
+	generation = 0;
+#endif
+	memcheck537_last.generation = generation;
+}
+
+#ifdef MALLOC537_DEFERRED
+/*
+ * Deferred mode, built with -DMALLOC537_DEFERRED.
+ * Each thread keeps its recent mallocs and frees in a small buffer,
+ * and only takes the tree lock to merge the whole buffer at once,
+ * sorted by address so the inserts walk the same part of the tree.
+ * The buffer is merged when it fills, or when memcheck537 can't
+ * answer from it. Before the tree's "no" is taken as an error,
+ * every thread's buffer is merged and the tree asked again.
+ *
+ * A deferred free537 holds on to the memory until the merge, so
+ * malloc can't hand the same address to someone else while the
+ * tree still thinks it's in use.
+ */
+#ifndef DEFER_EVENTS
+#define DEFER_EVENTS 64
+#endif
+
+typedef struct pending_event
+{
+	void * base;
+	size_t bounds;
+	unsigned int seq;
+	int free;
+#ifdef MALLOC537_HEATMAP
+	void * site;
+#endif
+}pending_event;
+
+/*
+ * A thread's buffer has a lock of its own, so that other threads can
+ * merge it too: a free537 or memcheck537 the tree can't answer may be
+ * about a block whose malloc is still in some other thread's buffer.
+ * Only the owner adds to it, so the lock is hardly ever contended.
+ */
+typedef struct pending_buffer
+{
+	pthread_mutex_t lock;
+	pending_event events[DEFER_EVENTS];
+	int count;
+	int registered;
+	struct pending_buffer * next;
+}pending_buffer;
+
+static pthread_once_t pending_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pending_key;
 
-	return_ptr = malloc(size);
+/*
+ * Every thread's buffer. Locks are taken in this order: buffers_lock,
+ * then a buffer's lock, then the tree lock.
+ */
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pending_buffer * buffers;
+
+static __thread pending_buffer pending;
+/*
+ * Whether this thread holds a buffer's lock, for flush_at_exit.
+ */
+static __thread int pending_held;
+#endif
+
+#ifdef MALLOC537_LOCKING
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Whether this thread holds the tree lock. Errors quit with it held,
+ * and the exit hooks mustn't wait for it then.
+ */
+static __thread int tree_held;
 
-	/*printf("Inserting node: Pointer: %p, bounds %d\n", return_ptr, (int)size);*/
+#define LOCK_TREE() do { pthread_mutex_lock(&tree_lock); tree_held = 1; } while(0)
+#define UNLOCK_TREE() do { tree_held = 0; pthread_mutex_unlock(&tree_lock); } while(0)
+#else
+#define LOCK_TREE()
+#define UNLOCK_TREE()
+#endif
+
+/*
+ * Adds a new block to the tree, clearing out any freed
+ * nodes it covers first.
+ * Caller holds the tree lock.
+ */
+static void track_alloc(void * base, size_t size)
+{
+	/*printf("Inserting node: Pointer: %p, bounds %d\n", base, (int)size);*/
 	/*
 	 * Need to find all nodes within range base+1 to size, and delete them.
+	 * One walk for all of them - looking them up one at a time
+	 * started over from the top for every node.
 	 */
-	
-	remove_node = contained_lookup(return_ptr, size);
+	tree_backend->remove_range(base, size);
 
-	while(remove_node != NULL)
-	{
-		delete_node(remove_node->base);	
-		remove_node = contained_lookup(return_ptr, size);
-	}
-	
 
 	/*HERE WE DO AN INSERT!*/
-	insert(return_ptr, size);
+	tree_backend->insert(base, size);
+	page_filter_add(base, size);
+#ifdef MALLOC537_FROZEN_INDEX
+	frozen_added(base, size);
+#endif
 
-	/*Debug! print the tree*/ 
+	/*Debug! print the tree*/
 	/*
-	print(root, 0);
+	print(tree_backend->top(), 0);
 	printf("\n");
 	*/
-	return return_ptr;
 }
 
+#ifdef MALLOC537_HEATMAP
 /*
- * Checks to make sure a 537malloc-family command allocated the memory
- * in ptr, and then calls free on the pointer. If an error is detected,
- * prints a descriptive message and closes with EXIT_FAILURE.
-*/
-void free537(void *ptr)
+ * Remembers where the block at base was allocated from, for the heatmap.
+ * Caller holds the tree lock.
+ */
+static void track_site(void * base, void * site)
 {
-	node * temp;
-	temp = lookup(ptr);
+	node * temp = tree_backend->lookup(base);
+	if(temp != NULL)
+	{
+		set_site(temp, site);
+	}
+}
+#endif
 
-	/* check for a null pointer to free */
-	if(ptr == NULL)
+/*
+ * What report537.h needs to know about temp, in *block.
+ * NULL if there's no node.
+ */
+static const report537_block * as_block(node * temp, report537_block * block)
+{
+	if(temp == NULL)
 	{
-		printf("Trying to free a null pointer!\n");
-		exit(EXIT_FAILURE);
+		return NULL;
 	}
+	block->base = node_base(temp);
+	block->bounds = node_bounds(temp);
+	block->free = node_free(temp);
+	return block;
+}
+
+/*
+ * Checks that ptr is the start of a live block.
+ * Returns its node, or prints what's wrong and returns NULL.
+ * Caller holds the tree lock.
+ */
+node * check_free(void * ptr)
+{
+	node * exact = NULL;
+	node * around = NULL;
+	report537_block exact_block;
+	report537_block around_block;
+	char message[REPORT537_LENGTH];
+
 	/*
-	 * Check to make sure we have a node at that pointer!
+	 * Not anywhere near the heap (a stack buffer, say), or nothing to
+	 * search (a private heap with no blocks) - report537 says so.
 	 */
-	if(temp == NULL)
+	if(ptr != NULL && tree_backend->top() != NULL && !page_filter_rejects(ptr))
 	{
-		
-		temp = bounds_lookup(ptr);
-		if(temp == NULL)
+		exact = tree_backend->lookup(ptr);
+		if(exact == NULL)
 		{
-			printf("Pointer at %p was never allocated!", ptr);
-			exit(EXIT_FAILURE);
-		}
-		else
-		{
-			printf("Attempting to free pointer at %p, but that pointer is in memory allocated starting at %p with bounds %d.\n", ptr, temp->base, (int)temp->bounds);
-			exit(EXIT_FAILURE); 
+			around = tree_backend->bounds_lookup(ptr);
 		}
+	}
 
-	}	
-	/*
-	 * If we've already freed this node, say that there's a double free! woo.
-	 */
-	if(temp->free == 1)
+	if(report537_free(ptr, REPORT537_UNSIZED, as_block(exact, &exact_block), as_block(around, &around_block), message) == NULL)
+	{
+		printf("%s", message);
+		return NULL;
+	}
+	return exact;
+}
+
+/*
+ * Gets a new block from the system, with redzones around it
+ * if we're built with -DMALLOC537_REDZONE.
+ */
+static void * get_block(size_t size)
+{
+	void * block;
+#ifdef MALLOC537_REDZONE
+	block = redzone_alloc(size);
+#else
+	block = malloc(size);
+#endif
+#ifdef MALLOC537_HUGE_BLOCKS
+	huge_forget(block, size);
+#endif
+	return block;
+}
+
+/*
+ * Gives a block we're done tracking back to the system -
+ * or to the quarantine, with -DMALLOC537_QUARANTINE.
+ * With redzones, they get checked first (and we quit if they're damaged).
+ * Caller holds the tree lock.
+ */
+static void release(void * base, size_t bounds)
+{
+#ifdef MALLOC537_REDZONE
+	if(redzone_verify(base, bounds))
 	{
-		printf("Pointer at %p of previous size %i was already freed!\n", ptr, (int)temp->bounds);
 		exit(EXIT_FAILURE);
 	}
+	base = redzone_real(base, bounds);
+	bounds = redzone_total(bounds);
+#endif
+#ifdef MALLOC537_QUARANTINE
+	quarantine_add(base, bounds);
+#else
+	(void)bounds;
+	free(base);
+#endif
+}
 
-	temp->free = 1;
-	free(ptr);
-	
-	/*
-	print(root, 0);
-	printf("\n");
-	*/
+#ifdef MALLOC537_QUARANTINE
+/*
+ * Process exit hook: checks and frees whatever's still in quarantine.
+ * It's registered before main runs, so it runs after every other exit
+ * hook - the deferred merge, and stopping the verifier, which reads the
+ * same blocks. Takes the tree lock, unless we're quitting over an error
+ * with it already held (the verifier can't be in the middle of a slice
+ * then either).
+ */
+static void drain_at_exit()
+{
+#ifdef MALLOC537_LOCKING
+	if(tree_held)
+	{
+		quarantine_drain();
+		return;
+	}
+#endif
+	LOCK_TREE();
+	quarantine_drain();
+	UNLOCK_TREE();
+}
+
+static void register_drain() __attribute__((constructor));
+
+static void register_drain()
+{
+	atexit(drain_at_exit);
 }
+#endif
 
 /*
- * Functions similarly to realloc, but does checking on the input
- * pointer, and stores output pointer data in our hash table
-*/
-void *realloc537(void *ptr, size_t size)
+ * Checks ptr with check_free, quitting on an error,
+ * then marks it free in the tree and gives it back to free().
+ * Caller holds the tree lock.
+ */
+static void track_free(void * ptr)
 {
-	void * return_pointer;
-	node * remove_node = NULL;
+	node * temp = check_free(ptr);
+	if(temp == NULL)
+	{
+		exit(EXIT_FAILURE);
+	}
 
-	/* If the pointer is null, this is just a malloc! let malloc537 handle it.*/
-	if(ptr == NULL)
+	mark_freed(temp);
+	FORGET_CHECKS();
+#ifdef MALLOC537_FROZEN_INDEX
+	frozen_removed(ptr);
+#endif
+#ifdef MALLOC537_HEATMAP
+	heat_forget(ptr, node_site(temp));
+#endif
+#ifdef MALLOC537_TAGS
+	tag_remove(temp);
+#endif
+#ifdef MALLOC537_LIFETIME
+	lifetime_record(node_bounds(temp), node_stamp(temp));
+#endif
+	release(ptr, node_bounds(temp));
+}
+
+#ifdef MALLOC537_HUGE_BLOCKS
+/*
+ * What huge_lookup found, as report537.h's exact and around:
+ * it's exact if it starts at ptr.
+ */
+static void as_huge_block(void * ptr, int found, void * base, size_t bounds, report537_block * block, const report537_block ** exact, const report537_block ** around)
+{
+	block->base = base;
+	block->bounds = bounds;
+	block->free = (found == HUGE_FREED);
+	*exact = base == ptr ? block : NULL;
+	*around = base == ptr ? NULL : block;
+}
+
+/*
+ * The huge block half of check_free. Returns 0 if ptr isn't in a huge
+ * block (so it's up to the tree), 1 if it's the start of a live one,
+ * with its size in *bounds, or -1 after printing what's wrong.
+ */
+static int check_huge_free(void * ptr, size_t * bounds)
+{
+	void * base;
+	int found = huge_lookup(ptr, &base, bounds);
+	report537_block block;
+	const report537_block * exact;
+	const report537_block * around;
+	char message[REPORT537_LENGTH];
+
+	if(found == HUGE_NONE)
 	{
-		return malloc537(size);
+		return 0;
 	}
-	/* If the size is null, it's just a free.*/
-	else if(size == 0)
+	as_huge_block(ptr, found, base, *bounds, &block, &exact, &around);
+	if(report537_free(ptr, REPORT537_UNSIZED, exact, around, message) == NULL)
 	{
-		free537(ptr);
-		return NULL;
+		printf("%s", message);
+		return -1;
 	}
-	else
+	return 1;
+}
+
+/*
+ * The huge block half of check_range. Returns 0 if ptr isn't in a huge
+ * block, or 1 if the range fits in a live one (which the inline check
+ * then remembers). Quits on an error.
+ */
+static int check_huge_range(void * ptr, size_t size, unsigned long generation)
+{
+	void * base;
+	size_t bounds;
+	int found = huge_lookup(ptr, &base, &bounds);
+	report537_block block;
+	const report537_block * exact;
+	const report537_block * around;
+	char message[REPORT537_LENGTH];
+
+	if(found == HUGE_NONE)
 	{
-		/*HERE WE DO A REMOVE/mark as unused/whatever*/
-		node * temp;
-		temp = lookup(ptr);
-		temp->free = 1;
+		return 0;
 	}
-	
-	return_pointer = realloc(ptr, size);
+	as_huge_block(ptr, found, base, bounds, &block, &exact, &around);
+	if(report537_range(ptr, size, exact, around, message) == NULL)
+	{
+		printf("%s", message);
+		PROBE2(memcheck_fail, ptr, size);
+		exit(EXIT_FAILURE);
+	}
+	remember_check(base, bounds, generation);
+#ifdef MALLOC537_HEATMAP
+	heat_record(base, bounds, NULL, size);
+#endif
+	PROBE4(memcheck_pass, ptr, size, base, -1);
+	return 1;
+}
+#endif
 
-	/* Before we insert, remove any nodes that will be overlapped.*/
+/*
+ * qsort helper - orders pointers by address.
+ */
+static int compare_ptrs(const void * a, const void * b)
+{
+	const char * left = *(void * const *)a;
+	const char * right = *(void * const *)b;
+	return left < right ? -1 : (left > right);
+}
+
+/*
+ * The actual checking part of memcheck537.
+ * Returns the block ptr is in, or prints what's wrong and quits.
+ * Caller holds the tree lock.
+ */
+node * check_range(void * ptr, size_t size)
+{
 	/*
-	 * Need to find all nodes within range base+1 to size, and delete them.
+	 * Find the node at ptr. If there isn't a live one, find the
+	 * block ptr is inside, and let report537_range sort it out.
 	 */
-			
-	remove_node = contained_lookup(return_pointer, size);
-	while(remove_node != NULL)
+	node * exact = NULL;
+	node * around = NULL;
+	report537_block exact_block;
+	report537_block around_block;
+	const report537_block * found;
+	char message[REPORT537_LENGTH];
+
+	if(tree_backend->top() != NULL && !page_filter_rejects(ptr))
 	{
-		delete_node(remove_node->base);	
-		remove_node = contained_lookup(return_pointer, size);
+		exact = tree_backend->lookup(ptr);
+		if(exact == NULL || node_free(exact))
+		{
+			around = tree_backend->bounds_lookup(ptr);
+		}
 	}
 
-	insert(ptr, size);
-	/*
-	print(root, 0);
-	printf("\n");
-	*/
-	
-	return return_pointer;
+	found = report537_range(ptr, size, as_block(exact, &exact_block), as_block(around, &around_block), message);
+	if(found == NULL)
+	{
+		printf("%s", message);
+		PROBE2(memcheck_fail, ptr, size);
+		exit(EXIT_FAILURE);
+	}
+	return found == &exact_block ? exact : around;
 }
 
+#ifdef MALLOC537_DEFERRED
 /*
- * Checks pointer ptr with address range size to see
- * if it has been allocated (and not freed) by 537malloc/537realloc.
- * Prints a nice, verbose error message and quits on an error.
-*/
-void memcheck537(void *ptr, size_t size)
+ * Sort pending events by address. Events for the same address
+ * keep the order they happened in (a malloc before its free).
+ */
+static int compare_events(const void * a, const void * b)
 {
-	/*
-	 *Find the node!
-	 *If it doesn't exist, see if it's in the previous
-	 *node's range and print appropriate error
-	 *Otherwise, check the size.
-	 *If they don't match, print an error.
-	 */	
-	node * temp = lookup(ptr);
-	
-	if(temp == NULL)
+	const pending_event * left = a;
+	const pending_event * right = b;
+
+	if(left->base != right->base)
 	{
-		temp = bounds_lookup(ptr);
-		if(temp == NULL)
+		return left->base < right->base ? -1 : 1;
+	}
+	return left->seq < right->seq ? -1 : (left->seq > right->seq);
+}
+
+/*
+ * Merges buffer's events into the tree. Caller holds buffer's lock.
+ * The events are taken out of the buffer before any go in, so if one
+ * of them is bad and we quit, the exit hook has nothing to merge again.
+ */
+static void merge_pending(pending_buffer * buffer)
+{
+	int count = buffer->count;
+	int i;
+
+	if(count == 0)
+	{
+		return;
+	}
+
+	buffer->count = 0;
+	qsort(buffer->events, count, sizeof(pending_event), compare_events);
+
+	LOCK_TREE();
+	for(i = 0; i < count; i++)
+	{
+		if(buffer->events[i].free)
 		{
-			printf("Pointer at %p was never allocated!\n", ptr);
-			exit(EXIT_FAILURE);
+			track_free(buffer->events[i].base);
 		}
 		else
 		{
-			/* As long as the pointer we're looking up is within the bounds
-			 * of the allocated space, we're fine!
-			 */
-			if((long)((long)ptr + size) <= (long)((long)temp->base + temp->bounds))
-			{
-				return;
-			}
-			else
-			{
-				printf("Pointer at %p is inside pointer %p of size %d, but there's not enough room in the allocated space!\n", ptr, temp->base, (int)temp->bounds);
-				exit(EXIT_FAILURE);
-			}
+			track_alloc(buffer->events[i].base, buffer->events[i].bounds);
+#ifdef MALLOC537_HEATMAP
+			track_site(buffer->events[i].base, buffer->events[i].site);
+#endif
 		}
+	}
+	UNLOCK_TREE();
+}
+
+/*
+ * merge_pending with buffer's lock taken for it.
+ */
+static void merge_buffer(pending_buffer * buffer)
+{
+	pthread_mutex_lock(&buffer->lock);
+	pending_held = 1;
+	merge_pending(buffer);
+	pending_held = 0;
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+/*
+ * Merges this thread's pending events into the tree.
+ */
+static void flush_pending()
+{
+	if(pending.registered)
+	{
+		merge_buffer(&pending);
+	}
+}
+
+/*
+ * Merges every thread's pending events into the tree, for when
+ * the tree has to know about everything. Caller holds no locks.
+ */
+static void flush_all_pending()
+{
+	pending_buffer * buffer;
 
+	pthread_mutex_lock(&buffers_lock);
+	for(buffer = buffers; buffer != NULL; buffer = buffer->next)
+	{
+		merge_buffer(buffer);
 	}
+	pthread_mutex_unlock(&buffers_lock);
+}
+
+/*
+ * Thread exit hook - don't lose a dying thread's events,
+ * and take its buffer off the list before it goes away.
+ */
+static void flush_on_exit(void * unused)
+{
+	pending_buffer ** link;
+
+	(void)unused;
+	merge_buffer(&pending);
 
-	/* If we find a pointer at ptr, check the size! */
-	else if(size > temp->bounds)
+	pthread_mutex_lock(&buffers_lock);
+	for(link = &buffers; *link != &pending; link = &(*link)->next)
 	{
-		printf("Trying to use %d bytes, but the pointer %p only has a size of %d bytes.\n", (int)size, ptr, (int)temp->bounds);
-		exit(EXIT_FAILURE);
+	}
+	*link = pending.next;
+	pthread_mutex_unlock(&buffers_lock);
+	pthread_mutex_destroy(&pending.lock);
+	pending.registered = 0;
+}
+
+/*
+ * Process exit hook - the thread calling exit() doesn't get
+ * its key destructor run, so merge its events here. Not if
+ * it's quitting over an error with a lock held, though.
+ */
+static void flush_at_exit()
+{
+	if(tree_held || pending_held)
+	{
+		return;
+	}
+	flush_pending();
+}
+
+static void make_pending_key()
+{
+	pthread_key_create(&pending_key, flush_on_exit);
+	atexit(flush_at_exit);
+}
+
+/*
+ * Takes this thread's buffer lock, putting the buffer
+ * on the list the first time through.
+ */
+static void lock_pending()
+{
+	if(!pending.registered)
+	{
+		pthread_once(&pending_once, make_pending_key);
+		pthread_mutex_init(&pending.lock, NULL);
+		pthread_mutex_lock(&buffers_lock);
+		pending.next = buffers;
+		buffers = &pending;
+		pthread_mutex_unlock(&buffers_lock);
+		pthread_setspecific(pending_key, &pending);
+		pending.registered = 1;
+	}
+	pthread_mutex_lock(&pending.lock);
+	pending_held = 1;
+}
 
+static void unlock_pending()
+{
+	pending_held = 0;
+	pthread_mutex_unlock(&pending.lock);
+}
+
+/*
+ * Appends an event, merging first if the buffer is full.
+ * Caller holds this thread's buffer lock.
+ */
+static void push_pending(void * base, size_t bounds, int free, void * site)
+{
+	pending_event * event;
+
+	if(pending.count == DEFER_EVENTS)
+	{
+		merge_pending(&pending);
+	}
+
+	event = &pending.events[pending.count];
+	event->base = base;
+	event->bounds = bounds;
+	event->seq = pending.count;
+	event->free = free;
+#ifdef MALLOC537_HEATMAP
+	event->site = site;
+#else
+	(void)site;
+#endif
+	pending.count++;
+}
+
+/*
+ * Newest pending event for exactly this base, or NULL.
+ */
+static pending_event * find_pending(void * base)
+{
+	int i;
+	for(i = pending.count - 1; i >= 0; i--)
+	{
+		if(pending.events[i].base == base)
+		{
+			return &pending.events[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Pending (not yet freed) malloc whose range holds ptr, or NULL.
+ */
+static pending_event * find_pending_range(void * ptr)
+{
+	pending_event * event;
+	int i;
+	for(i = pending.count - 1; i >= 0; i--)
+	{
+		event = &pending.events[i];
+		if(!event->free && (char *)ptr >= (char *)event->base && (char *)ptr <= (char *)event->base + event->bounds)
+		{
+			return find_pending(event->base) == event ? event : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The live node at exactly ptr, or NULL if there isn't one even with
+ * every thread's events merged. Returns with the tree lock held.
+ */
+static node * find_live(void * ptr)
+{
+	node * temp;
+
+	LOCK_TREE();
+	temp = tree_backend->top() != NULL ? tree_backend->lookup(ptr) : NULL;
+	if(temp == NULL || node_free(temp))
+	{
+		UNLOCK_TREE();
+		flush_all_pending();
+		LOCK_TREE();
+		temp = tree_backend->top() != NULL ? tree_backend->lookup(ptr) : NULL;
+	}
+	return temp != NULL && !node_free(temp) ? temp : NULL;
+}
+
+/*
+ * The live block holding all of ptr to ptr + size, or NULL -
+ * check_range without the complaining. Caller holds the tree lock.
+ */
+static node * live_range(void * ptr, size_t size)
+{
+	node * temp;
+
+	if(tree_backend->top() == NULL || page_filter_rejects(ptr))
+	{
+		return NULL;
+	}
+	temp = tree_backend->lookup(ptr);
+	if(temp == NULL || node_free(temp))
+	{
+		temp = tree_backend->bounds_lookup(ptr);
+	}
+	if(temp == NULL || node_free(temp) || (char *)ptr + size > (char *)node_base(temp) + node_bounds(temp))
+	{
+		return NULL;
+	}
+	return temp;
+}
+#endif
+
+/*
+ * malloc537 is a wrapper around malloc.
+ * It add the tuple (base, bounds) to a range
+ * tree to track memory allocation!
+ */
+void *malloc537(size_t size)
+{
+	void * return_ptr;
+	LATENCY_START();
+
+	if(size == 0)
+	{
+		printf(REPORT537_ZERO_SIZE);
+	}
+
+#ifdef MALLOC537_HUGE_BLOCKS
+	/*
+	 * Huge blocks are mapped on their own, and never go in the tree.
+	 */
+	if(size >= huge_threshold())
+	{
+		return_ptr = huge_alloc(size);
+		PROBE2(malloc, return_ptr, size);
+		LATENCY_RECORD(MALLOC537_LATENCY_MALLOC);
+		return return_ptr;
+	}
+#endif
+
+	return_ptr = get_block(size);
+
+#ifdef MALLOC537_DEFERRED
+	lock_pending();
+	push_pending(return_ptr, size, 0, __builtin_return_address(0));
+	unlock_pending();
+#else
+	LOCK_TREE();
+	track_alloc(return_ptr, size);
+#ifdef MALLOC537_HEATMAP
+	track_site(return_ptr, __builtin_return_address(0));
+#endif
+	UNLOCK_TREE();
+#endif
+
+	PROBE2(malloc, return_ptr, size);
+	LATENCY_RECORD(MALLOC537_LATENCY_MALLOC);
+	return return_ptr;
+}
+
+/*
+ * Checks to make sure a 537malloc-family command allocated the memory
+ * in ptr, and then calls free on the pointer. If an error is detected,
+ * prints a descriptive message and closes with EXIT_FAILURE.
+*/
+void free537(void *ptr)
+{
+#ifdef MALLOC537_DEFERRED
+	pending_event * event;
+	node * temp;
+	size_t bounds;
+	report537_block freed;
+	char message[REPORT537_LENGTH];
+#endif
+#ifdef MALLOC537_HUGE_BLOCKS
+	size_t huge_bounds;
+#endif
+	LATENCY_START();
+
+#ifdef MALLOC537_HUGE_BLOCKS
+	switch(check_huge_free(ptr, &huge_bounds))
+	{
+		case -1:
+			exit(EXIT_FAILURE);
+		case 1:
+			FORGET_CHECKS();
+#ifdef MALLOC537_HEATMAP
+			heat_forget(ptr, NULL);
+#endif
+			huge_free(ptr);
+			PROBE1(free, ptr);
+			LATENCY_RECORD(MALLOC537_LATENCY_FREE);
+			return;
+	}
+#endif
+
+#ifdef MALLOC537_DEFERRED
+
+	if(ptr == NULL)
+	{
+		check_free(ptr);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Our own pending events know the answer first.
+	 * Otherwise check the tree now, so the error still comes from this call.
+	 * The merge checks again, in case another thread beat us to it.
+	 */
+	lock_pending();
+	event = find_pending(ptr);
+	if(event != NULL && event->free)
+	{
+		freed.base = ptr;
+		freed.bounds = event->bounds;
+		freed.free = 1;
+		report537_free(ptr, REPORT537_UNSIZED, &freed, NULL, message);
+		printf("%s", message);
+		exit(EXIT_FAILURE);
+	}
+	else if(event != NULL)
+	{
+		bounds = event->bounds;
+	}
+	else
+	{
+		unlock_pending();
+		temp = find_live(ptr);
+		if(temp == NULL)
+		{
+			/*
+			 * Nobody has it. track_free says what's wrong and quits -
+			 * or if the block's there after all, frees it, and
+			 * there's nothing left to defer.
+			 */
+			track_free(ptr);
+			UNLOCK_TREE();
+			PROBE1(free, ptr);
+			LATENCY_RECORD(MALLOC537_LATENCY_FREE);
+			return;
+		}
+		bounds = node_bounds(temp);
+		UNLOCK_TREE();
+		lock_pending();
+	}
+
+	FORGET_CHECKS();
+	push_pending(ptr, bounds, 1, NULL);
+	unlock_pending();
+#else
+	LOCK_TREE();
+	track_free(ptr);
+	UNLOCK_TREE();
+#endif
+	PROBE1(free, ptr);
+	LATENCY_RECORD(MALLOC537_LATENCY_FREE);
+
+	/*
+	print(tree_backend->top(), 0);
+	printf("\n");
+	*/
+}
+
+#ifdef MALLOC537_HUGE_BLOCKS
+/*
+ * realloc537 when the old block or the new one is huge.
+ * Huge to huge is an mremap. Otherwise it's a new block, a copy,
+ * and a free537 of the old one.
+ */
+static void * realloc_huge(void * ptr, size_t size)
+{
+	void * new_ptr;
+	size_t bounds;
+	node * temp;
+	unsigned long tag = 0;
+
+	switch(check_huge_free(ptr, &bounds))
+	{
+		case -1:
+			exit(EXIT_FAILURE);
+
+		case 1:
+			if(size >= huge_threshold())
+			{
+				FORGET_CHECKS();
+#ifdef MALLOC537_HEATMAP
+				heat_forget(ptr, NULL);
+#endif
+				new_ptr = huge_realloc(ptr, size);
+				PROBE3(realloc, ptr, new_ptr, size);
+				return new_ptr;
+			}
+			break;
+
+		default:
+			/*
+			 * A tree block that's getting huge. Check it like any other realloc.
+			 */
+#ifdef MALLOC537_DEFERRED
+			flush_pending();
+			temp = find_live(ptr);
+#else
+			LOCK_TREE();
+			temp = tree_backend->lookup(ptr);
+#endif
+			if(temp == NULL || node_free(temp))
+			{
+				track_free(ptr);
+			}
+			bounds = node_bounds(temp);
+#ifdef MALLOC537_TAGS
+			tag = node_tag(temp);
+#endif
+			UNLOCK_TREE();
+			break;
+	}
+
+	/*
+	 * A tagged block keeps its tag (and so stays in the tree).
+	 */
+	new_ptr = tag != 0 ? malloc537_tagged(size, tag) : malloc537(size);
+	if(new_ptr == NULL)
+	{
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, bounds < size ? bounds : size);
+	free537(ptr);
+	PROBE3(realloc, ptr, new_ptr, size);
+	return new_ptr;
+}
+#endif
+
+/*
+ * Functions similarly to realloc, but does checking on the input
+ * pointer, and stores output pointer data in our hash table
+*/
+void *realloc537(void *ptr, size_t size)
+{
+	void * return_pointer;
+	node * temp;
+#ifdef MOVE_ON_REALLOC
+	size_t old_bounds;
+#endif
+#ifdef MALLOC537_TAGS
+	unsigned long tag;
+#endif
+#ifdef MALLOC537_HUGE_BLOCKS
+	void * huge_base;
+	size_t huge_bounds;
+#endif
+	LATENCY_START();
+
+	/* If the pointer is null, this is just a malloc! let malloc537 handle it.*/
+	if(ptr == NULL)
+	{
+		return malloc537(size);
+	}
+	/* If the size is null, it's just a free.*/
+	else if(size == 0)
+	{
+		free537(ptr);
+		return NULL;
+	}
+
+#ifdef MALLOC537_HUGE_BLOCKS
+	if(size >= huge_threshold() || huge_lookup(ptr, &huge_base, &huge_bounds) != HUGE_NONE)
+	{
+		return_pointer = realloc_huge(ptr, size);
+		LATENCY_RECORD(MALLOC537_LATENCY_REALLOC);
+		return return_pointer;
+	}
+#endif
+
+#ifdef MALLOC537_DEFERRED
+	/*
+	 * realloc can move the block, so it goes straight to the tree.
+	 */
+	flush_pending();
+	temp = find_live(ptr);
+#else
+	LOCK_TREE();
+	temp = tree_backend->lookup(ptr);
+#endif
+	if(temp == NULL || node_free(temp))
+	{
+		/* Not something we can realloc - track_free says why and quits. */
+		track_free(ptr);
+	}
+
+#ifdef MOVE_ON_REALLOC
+	/*
+	 * realloc would hand the old block straight back to free(),
+	 * so move it ourselves and let release() deal with the old one.
+	 */
+	old_bounds = node_bounds(temp);
+	return_pointer = get_block(size);
+	if(return_pointer != NULL)
+	{
+		memcpy(return_pointer, ptr, old_bounds < size ? old_bounds : size);
+	}
+#else
+	return_pointer = realloc(ptr, size);
+#endif
+
+	/*
+	 * A failed realloc leaves the old block alone, so it stays live
+	 * and tracked, and the caller still has it.
+	 */
+	if(return_pointer == NULL)
+	{
+		UNLOCK_TREE();
+		LATENCY_RECORD(MALLOC537_LATENCY_REALLOC);
+		return NULL;
+	}
+#if defined(MALLOC537_HUGE_BLOCKS) && !defined(MOVE_ON_REALLOC)
+	huge_forget(return_pointer, size);
+#endif
+
+	{
+		/*
+		 * HERE WE DO A REMOVE/mark as unused/whatever.
+		 * ptr may be gone now, so the node's base stands in for it.
+		 */
+		mark_freed(temp);
+		FORGET_CHECKS();
+#ifdef MALLOC537_FROZEN_INDEX
+		frozen_removed(node_base(temp));
+#endif
+#ifdef MALLOC537_HEATMAP
+		heat_forget(node_base(temp), node_site(temp));
+#endif
+#ifdef MALLOC537_TAGS
+		tag = node_tag(temp);
+		tag_remove(temp);
+#endif
+	}
+
+	/* Before we insert, remove any nodes that will be overlapped.*/
+	track_alloc(return_pointer, size);
+#ifdef MALLOC537_HEATMAP
+	track_site(return_pointer, __builtin_return_address(0));
+#endif
+#ifdef MALLOC537_TAGS
+	/*
+	 * The new block keeps the old one's tag.
+	 */
+	if(tag != 0)
+	{
+		tag_add(tree_backend->lookup(return_pointer), tag);
+	}
+#endif
+#ifdef MOVE_ON_REALLOC
+	release(ptr, old_bounds);
+#endif
+	UNLOCK_TREE();
+	PROBE3(realloc, ptr, return_pointer, size);
+	LATENCY_RECORD(MALLOC537_LATENCY_REALLOC);
+
+	/*
+	print(tree_backend->top(), 0);
+	printf("\n");
+	*/
+
+	return return_pointer;
+}
+
+/*
+ * Checks pointer ptr with address range size to see
+ * if it has been allocated (and not freed) by 537malloc/537realloc.
+ * Prints a nice, verbose error message and quits on an error.
+ * This is the out-of-line half of the memcheck537 in malloc537.h -
+ * it remembers the block it found for the inline half.
+*/
+void memcheck537(void *ptr, size_t size)
+{
+	node * temp;
+	unsigned long generation = __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED);
+#ifdef MALLOC537_DEFERRED
+	pending_event * event;
+#endif
+#if defined(MALLOC537_FROZEN_INDEX) && !defined(MALLOC537_HEATMAP)
+	void * frozen_base;
+	size_t frozen_bounds;
+#endif
+	LATENCY_START();
+
+#ifdef MALLOC537_HUGE_BLOCKS
+	if(check_huge_range(ptr, size, generation))
+	{
+		LATENCY_MEMCHECK(memcheck537_last.base);
+		return;
+	}
+#endif
+
+#ifdef MALLOC537_DEFERRED
+	/*
+	 * If one of our own pending mallocs covers the range, that's our answer.
+	 * Anything else needs the tree, with our events merged in.
+	 */
+	lock_pending();
+	event = find_pending_range(ptr);
+	if(event != NULL && (char *)ptr + size <= (char *)event->base + event->bounds)
+	{
+		remember_check(event->base, event->bounds, generation);
+#ifdef MALLOC537_HEATMAP
+		heat_record(event->base, event->bounds, event->site, size);
+#endif
+		PROBE4(memcheck_pass, ptr, size, event->base, -1);
+		LATENCY_MEMCHECK(event->base);
+		unlock_pending();
+		return;
+	}
+	merge_pending(&pending);
+	unlock_pending();
+#endif
+
+	LOCK_TREE();
+#if defined(MALLOC537_FROZEN_INDEX) && !defined(MALLOC537_HEATMAP)
+	/*
+	 * The frozen copy can only say yes. Anything else, and anything
+	 * that went wrong, is still up to the tree.
+	 * (The heatmap needs the node, so it always goes to the tree.)
+	 */
+	if(frozen_check(ptr, size, &frozen_base, &frozen_bounds))
+	{
+		remember_check(frozen_base, frozen_bounds, generation);
+		UNLOCK_TREE();
+		PROBE4(memcheck_pass, ptr, size, frozen_base, -1);
+		LATENCY_MEMCHECK(frozen_base);
+		return;
+	}
+	if(frozen_quiet())
+	{
+		frozen_build(tree_backend->top());
+	}
+#endif
+#ifdef MALLOC537_DEFERRED
+	/*
+	 * Not in the tree might just mean not merged yet.
+	 */
+	temp = live_range(ptr, size);
+	if(temp == NULL)
+	{
+		UNLOCK_TREE();
+		flush_all_pending();
+		LOCK_TREE();
+		temp = check_range(ptr, size);
+	}
+#else
+	temp = check_range(ptr, size);
+#endif
+	remember_check(node_base(temp), node_bounds(temp), generation);
+#ifdef MALLOC537_HEATMAP
+	heat_record(node_base(temp), node_bounds(temp), node_site(temp), size);
+#endif
+	PROBE4(memcheck_pass, ptr, size, node_base(temp), PROBE_DEPTH(memcheck_pass, temp));
+	UNLOCK_TREE();
+	LATENCY_MEMCHECK(node_base(temp));
+}
+
+/*
+ * memcheck537 with nothing to check but ptr itself,
+ * handing back what it found.
+ */
+void memcheck537_resolve(void *ptr, void ** base, size_t * bounds, unsigned long * generation)
+{
+#ifdef MALLOC537_MODES
+	mode_memcheck(ptr, 0);
+#else
+	memcheck537(ptr, 0);
+#endif
+	*base = memcheck537_last.base;
+	*bounds = memcheck537_last.bounds;
+	*generation = memcheck537_last.generation;
+}
+
+/*
+ * malloc537, with the block put on tag's list. Tagged blocks always
+ * go straight in the tree (even huge ones), since the list goes
+ * through their nodes.
+ */
+void *malloc537_tagged(size_t size, unsigned long tag)
+{
+#ifdef MALLOC537_TAGS
+	void * return_ptr;
+	LATENCY_START();
+
+	if(tag == 0)
+	{
+		return malloc537(size);
+	}
+	if(size == 0)
+	{
+		printf(REPORT537_ZERO_SIZE);
+	}
+
+	return_ptr = get_block(size);
+	if(return_ptr == NULL && size != 0)
+	{
+		return NULL;
+	}
+
+	LOCK_TREE();
+	track_alloc(return_ptr, size);
+	tag_add(tree_backend->lookup(return_ptr), tag);
+#ifdef MALLOC537_HEATMAP
+	track_site(return_ptr, __builtin_return_address(0));
+#endif
+	UNLOCK_TREE();
+	LATENCY_RECORD(MALLOC537_LATENCY_TAGGED);
+	return return_ptr;
+#else
+	(void)size;
+	(void)tag;
+	printf("Tagged allocations need the library built with -DMALLOC537_TAGS!\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+/*
+ * Frees every live block with tag, walking the tag's list - no
+ * tree searches. The nodes stay in the tree as freed blocks, like
+ * after free537, so using or freeing them again is still caught.
+ */
+void free537_tag(unsigned long tag)
+{
+#ifdef MALLOC537_TAGS
+	node * temp;
+	node * next;
+	LATENCY_START();
+
+#ifdef MALLOC537_DEFERRED
+	flush_all_pending();
+#endif
+
+	LOCK_TREE();
+	temp = tag_first(tag);
+	if(temp != NULL)
+	{
+		FORGET_CHECKS();
+	}
+	for(; temp != NULL; temp = next)
+	{
+		next = node_tag_link(temp, TAG_NEXT);
+		tag_remove(temp);
+		mark_freed(temp);
+#ifdef MALLOC537_FROZEN_INDEX
+		frozen_removed(node_base(temp));
+#endif
+#ifdef MALLOC537_HEATMAP
+		heat_forget(node_base(temp), node_site(temp));
+#endif
+#ifdef MALLOC537_LIFETIME
+		lifetime_record(node_bounds(temp), node_stamp(temp));
+#endif
+		release(node_base(temp), node_bounds(temp));
+	}
+	UNLOCK_TREE();
+	LATENCY_RECORD(MALLOC537_LATENCY_FREE_TAG);
+#else
+	(void)tag;
+	printf("Tagged allocations need the library built with -DMALLOC537_TAGS!\n");
+	exit(EXIT_FAILURE);
+#endif
+}
+
+/*
+ * Live bytes allocated with tag.
+ */
+size_t malloc537_tag_bytes(unsigned long tag)
+{
+#ifdef MALLOC537_TAGS
+	size_t bytes;
+
+#ifdef MALLOC537_DEFERRED
+	flush_all_pending();
+#endif
+	LOCK_TREE();
+	bytes = tag_bytes(tag);
+	UNLOCK_TREE();
+	return bytes;
+#else
+	(void)tag;
+	return 0;
+#endif
+}
+
+#ifdef MALLOC537_MODES
+/*
+ * What the tree knows about ptr, for tracked_block.
+ * Caller holds the tree lock.
+ */
+static int tracked_state(void * ptr, int exact)
+{
+	node * temp;
+	int state;
+
+	if(tree_backend->top() == NULL || page_filter_rejects(ptr))
+	{
+		return TRACKED_NONE;
+	}
+
+	temp = tree_backend->lookup(ptr);
+	if(temp != NULL && !node_free(temp))
+	{
+		return TRACKED_LIVE;
+	}
+	state = temp != NULL ? TRACKED_FREED : TRACKED_NONE;
+
+	if(!exact)
+	{
+		temp = tree_backend->bounds_lookup(ptr);
+		if(temp != NULL)
+		{
+			return node_free(temp) ? TRACKED_FREED : TRACKED_LIVE;
+		}
+	}
+	return state;
+}
+
+/*
+ * What the tree (or the huge blocks) know about ptr, for mode.c.
+ * With exact, it has to be the block's start.
+ */
+int tracked_block(void * ptr, int exact)
+{
+	int state;
+#ifdef MALLOC537_HUGE_BLOCKS
+	void * huge_base;
+	size_t huge_bounds;
+
+	switch(huge_lookup(ptr, &huge_base, &huge_bounds))
+	{
+		case HUGE_NONE:
+			break;
+		case HUGE_FREED:
+			return !exact || huge_base == ptr ? TRACKED_FREED : TRACKED_NONE;
+		default:
+			return !exact || huge_base == ptr ? TRACKED_LIVE : TRACKED_NONE;
+	}
+#endif
+
+#ifdef MALLOC537_DEFERRED
+	flush_pending();
+#endif
+	LOCK_TREE();
+	state = tracked_state(ptr, exact);
+#ifdef MALLOC537_DEFERRED
+	if(state != TRACKED_LIVE)
+	{
+		UNLOCK_TREE();
+		flush_all_pending();
+		LOCK_TREE();
+		state = tracked_state(ptr, exact);
+	}
+#endif
+	UNLOCK_TREE();
+	return state;
+}
+
+void untracked_block(void * ptr, size_t size)
+{
+	node * temp;
+
+	if(ptr == NULL)
+	{
+		return;
+	}
+#ifdef MALLOC537_HUGE_BLOCKS
+	huge_forget(ptr, size);
+#else
+	(void)size;
+#endif
+
+	LOCK_TREE();
+	if(tree_backend->top() != NULL && !page_filter_rejects(ptr))
+	{
+		temp = tree_backend->lookup(ptr);
+		if(temp != NULL && node_free(temp))
+		{
+			tree_backend->delete_node(ptr);
+		}
+	}
+	UNLOCK_TREE();
+}
+#else
+/*
+ * Without -DMALLOC537_MODES, everything is always tracked.
+ */
+void malloc537_set_mode(int mode)
+{
+	(void)mode;
+}
+
+int malloc537_mode()
+{
+	return MALLOC537_MODE_FULL;
+}
+#endif
+
+/*
+ * Copies the live blocks into the read-only index memcheck537 checks
+ * first. Only with -DMALLOC537_FROZEN_INDEX.
+ */
+void malloc537_freeze_index()
+{
+#ifdef MALLOC537_FROZEN_INDEX
+#ifdef MALLOC537_DEFERRED
+	flush_all_pending();
+#endif
+	LOCK_TREE();
+	frozen_build(tree_backend->top());
+	UNLOCK_TREE();
+#endif
+}
+
+/*
+ * Allocates count blocks of size bytes into out[].
+ * The new blocks are sorted by address and put in the tree in one go,
+ * so the inserts walk the tree left to right instead of all over.
+ * Returns how many blocks we got. A failed malloc leaves NULL in
+ * its out[] slot and prints which one it was.
+ */
+int malloc537_n(size_t size, int count, void ** out)
+{
+	void ** sorted;
+	int allocated = 0;
+	int i;
+	LATENCY_START();
+
+	if(size == 0)
+	{
+		printf("Allocating %d pointers of size 0\n", count);
+	}
+
+#ifdef MALLOC537_MODES
+	/*
+	 * Only full mode tracks every block. Otherwise it's up to the mode,
+	 * one at a time.
+	 */
+	if(malloc537_mode() != MALLOC537_MODE_FULL)
+	{
+		for(i = 0; i < count; i++)
+		{
+			out[i] = mode_malloc(size);
+			allocated += (out[i] != NULL);
+		}
+		LATENCY_RECORD(MALLOC537_LATENCY_MALLOC_N);
+		return allocated;
+	}
+#endif
+
+#ifdef MALLOC537_HUGE_BLOCKS
+	/*
+	 * Huge blocks don't go in the tree, so there's nothing to sort.
+	 */
+	if(size >= huge_threshold())
+	{
+		for(i = 0; i < count; i++)
+		{
+			out[i] = huge_alloc(size);
+			allocated += (out[i] != NULL);
+		}
+		LATENCY_RECORD(MALLOC537_LATENCY_MALLOC_N);
+		return allocated;
+	}
+#endif
+
+	sorted = malloc(count * sizeof(void *));
+	if(sorted == NULL)
+	{
+		printf("Couldn't allocate space to sort %d pointers!\n", count);
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		out[i] = get_block(size);
+		if(out[i] == NULL && size != 0)
+		{
+			printf("Couldn't allocate block %d of %d (size %d)!\n", i, count, (int)size);
+			continue;
+		}
+		sorted[allocated++] = out[i];
+	}
+
+	qsort(sorted, allocated, sizeof(void *), compare_ptrs);
+
+#ifdef MALLOC537_DEFERRED
+	flush_pending();
+#endif
+
+	LOCK_TREE();
+	for(i = 0; i < allocated; i++)
+	{
+		track_alloc(sorted[i], size);
+#ifdef MALLOC537_HEATMAP
+		track_site(sorted[i], __builtin_return_address(0));
+#endif
+	}
+	UNLOCK_TREE();
+
+	free(sorted);
+	LATENCY_RECORD(MALLOC537_LATENCY_MALLOC_N);
+	return allocated;
+}
+
+/*
+ * Frees count pointers from ptrs[].
+ * Everything is checked before anything is freed: every bad pointer
+ * (including one that shows up twice in the batch) gets its own message,
+ * and if there were any we quit without freeing the rest.
+ */
+void free537_n(void ** ptrs, int count)
+{
+	void ** sorted;
+	node ** nodes;
+	int failures = 0;
+	int i;
+#ifdef MALLOC537_HUGE_BLOCKS
+	size_t huge_bounds;
+	int huge;
+#endif
+	LATENCY_START();
+
+#ifdef MALLOC537_MODES
+	/*
+	 * With untracked blocks about, the tree can't vouch for the whole
+	 * batch, so each pointer goes wherever the mode sends it.
+	 */
+	if(mode_untracked())
+	{
+		for(i = 0; i < count; i++)
+		{
+			mode_free(ptrs[i]);
+		}
+		LATENCY_RECORD(MALLOC537_LATENCY_FREE_N);
+		return;
+	}
+#endif
+
+	sorted = malloc(count * sizeof(void *));
+	nodes = malloc(count * sizeof(node *));
+	if(sorted == NULL || nodes == NULL)
+	{
+		printf("Couldn't allocate space to sort %d pointers!\n", count);
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < count; i++)
+	{
+		sorted[i] = ptrs[i];
+	}
+	qsort(sorted, count, sizeof(void *), compare_ptrs);
+
+#ifdef MALLOC537_DEFERRED
+	flush_all_pending();
+#endif
+
+	LOCK_TREE();
+	for(i = 0; i < count; i++)
+	{
+		/*
+		 * Sorted, so a pointer freed twice in the batch shows up twice in a row.
+		 */
+		if(i > 0 && sorted[i] == sorted[i - 1] && sorted[i] != NULL)
+		{
+			printf("Pointer at %p is freed more than once in the same batch!\n", sorted[i]);
+			nodes[i] = NULL;
+			failures++;
+			continue;
+		}
+
+#ifdef MALLOC537_HUGE_BLOCKS
+		/*
+		 * Huge blocks have no node. They're the NULL ones
+		 * left once we know there were no failures.
+		 */
+		huge = check_huge_free(sorted[i], &huge_bounds);
+		if(huge != 0)
+		{
+			nodes[i] = NULL;
+			failures += (huge < 0);
+			continue;
+		}
+#endif
+
+		nodes[i] = check_free(sorted[i]);
+		if(nodes[i] == NULL)
+		{
+			failures++;
+		}
+	}
+
+	if(failures > 0)
+	{
+		printf("%d of %d pointers passed to free537_n were bad!\n", failures, count);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Before any of them go: the heatmap tells a freed block's
+	 * checks from a new one's by which side of this they're on.
+	 */
+	FORGET_CHECKS();
+	for(i = 0; i < count; i++)
+	{
+#ifdef MALLOC537_HUGE_BLOCKS
+		if(nodes[i] == NULL)
+		{
+#ifdef MALLOC537_HEATMAP
+			heat_forget(sorted[i], NULL);
+#endif
+			huge_free(sorted[i]);
+			continue;
+		}
+#endif
+		mark_freed(nodes[i]);
+#ifdef MALLOC537_FROZEN_INDEX
+		frozen_removed(sorted[i]);
+#endif
+#ifdef MALLOC537_HEATMAP
+		heat_forget(sorted[i], node_site(nodes[i]));
+#endif
+#ifdef MALLOC537_TAGS
+		tag_remove(nodes[i]);
+#endif
+#ifdef MALLOC537_LIFETIME
+		lifetime_record(node_bounds(nodes[i]), node_stamp(nodes[i]));
+#endif
+		release(sorted[i], node_bounds(nodes[i]));
+	}
+	UNLOCK_TREE();
+
+	free(sorted);
+	free(nodes);
+	LATENCY_RECORD(MALLOC537_LATENCY_FREE_N);
+}
+
+#ifdef MALLOC537_REDZONE
+/*
+ * In-order walk checking every live block's redzones, through the
+ * parent links - sequential mallocs can leave the splay tree as one
+ * long chain, far too deep to recurse down.
+ * Returns how many were damaged.
+ */
+static int verify_subtree(node * top)
+{
+	node * current = top;
+	node * parent;
+	int damaged = 0;
+
+	if(current == NULL)
+	{
+		return 0;
+	}
+	while(node_child(current, LEFT_CHILD) != NULL)
+	{
+		current = node_child(current, LEFT_CHILD);
+	}
+
+	while(current != NULL)
+	{
+		if(!node_free(current))
+		{
+			damaged += redzone_verify(node_base(current), node_bounds(current));
+		}
+
+		if(node_child(current, RIGHT_CHILD) != NULL)
+		{
+			current = node_child(current, RIGHT_CHILD);
+			while(node_child(current, LEFT_CHILD) != NULL)
+			{
+				current = node_child(current, LEFT_CHILD);
+			}
+			continue;
+		}
+		parent = node_parent(current);
+		while(parent != NULL && current == node_child(parent, RIGHT_CHILD))
+		{
+			current = parent;
+			parent = node_parent(current);
+		}
+		current = parent;
+	}
+	return damaged;
+}
+#endif
+
+/*
+ * Checks every live block at once, instead of waiting for them
+ * to be freed. Without redzones there's nothing to check.
+ */
+void memcheck537_verify_all()
+{
+#ifdef MALLOC537_REDZONE
+	int damaged;
+
+#ifdef MALLOC537_DEFERRED
+	flush_all_pending();
+#endif
+
+	LOCK_TREE();
+	damaged = verify_subtree(tree_backend->top());
+	UNLOCK_TREE();
+
+	if(damaged > 0)
+	{
+		printf("%d blocks have damaged redzones!\n", damaged);
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
+
+#ifdef MALLOC537_VERIFIER
+/*
+ * The background verifier thread. Every interval it takes the lock
+ * for one slice of checking, then lets everyone else have the tree.
+ */
+static pthread_t verifier_thread;
+static int verifier_running;
+static int verifier_stopping;
+static int verifier_hooked;
+static long verifier_slice_ns;
+static long verifier_interval_ns;
+
+/*
+ * Process exit hook: stops the verifier before the quarantine drain
+ * frees what it's reading. Not when this thread quits over an error
+ * holding the tree lock - the verifier could be waiting for it.
+ */
+static void stop_at_exit()
+{
+	if(tree_held)
+	{
+		return;
+	}
+	malloc537_verifier_stop();
+}
+
+static void * verifier_loop(void * unused)
+{
+	void * cursor = NULL;
+	struct timespec pause;
+
+	(void)unused;
+	pause.tv_sec = verifier_interval_ns / 1000000000L;
+	pause.tv_nsec = verifier_interval_ns % 1000000000L;
+
+	while(!__atomic_load_n(&verifier_stopping, __ATOMIC_ACQUIRE))
+	{
+		LOCK_TREE();
+		if(verify_slice(&cursor, verifier_slice_ns) > 0)
+		{
+			printf("Background heap check found problems!\n");
+			exit(EXIT_FAILURE);
+		}
+		UNLOCK_TREE();
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Starts checking the heap in the background, slice_us microseconds
+ * at a time, every interval_us. Only with -DMALLOC537_VERIFIER.
+ */
+void malloc537_verifier_start(unsigned int slice_us, unsigned int interval_us)
+{
+#ifdef MALLOC537_VERIFIER
+	if(verifier_running)
+	{
+		return;
+	}
+	verifier_slice_ns = (long)slice_us * 1000L;
+	verifier_interval_ns = (long)interval_us * 1000L;
+	verifier_stopping = 0;
+	if(!verifier_hooked)
+	{
+		atexit(stop_at_exit);
+		verifier_hooked = 1;
+	}
+	if(pthread_create(&verifier_thread, NULL, verifier_loop, NULL) != 0)
+	{
+		printf("Couldn't start the heap verifier thread!\n");
+		exit(EXIT_FAILURE);
+	}
+	verifier_running = 1;
+#else
+	(void)slice_us;
+	(void)interval_us;
+#endif
+}
+
+void malloc537_verifier_stop()
+{
+#ifdef MALLOC537_VERIFIER
+	if(!verifier_running)
+	{
+		return;
 	}
+	__atomic_store_n(&verifier_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(verifier_thread, NULL);
+	verifier_running = 0;
+#endif
 }
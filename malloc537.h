@@ -1,8 +1,283 @@
 /*
-537malloc.h 
+537malloc.h
 Written by Nik Ingrassia (ningrassia) and Blake Martin (blakem)
 */
+#ifndef MALLOC537_H
+#define MALLOC537_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * How much checking callers get, picked when they compile:
+ *  0 - off. Everything goes straight to libc, checks compile to nothing.
+ *  1 - malloc/free tracking only (bad and double frees), memcheck537 is nothing.
+ *  2 - everything (the default).
+ * The library itself is always built with everything.
+ */
+#ifndef MALLOC537_LEVEL
+#define MALLOC537_LEVEL 2
+#endif
+
 void *malloc537(size_t size);
 void free537(void *ptr);
 void *realloc537(void *ptr, size_t size);
 void memcheck537(void *ptr, size_t size);
+
+/*
+ * Looks up the live block ptr is in (quitting like memcheck537 if there
+ * isn't one), and fills in its base and bounds, and the generation
+ * (see memcheck537_generation below) they're good for.
+ * For checked_ptr and checked_span in checked537.hpp.
+ */
+void memcheck537_resolve(void *ptr, void ** base, size_t * bounds, unsigned long * generation);
+
+/*
+ * Tagged blocks (only when the library is built with -DMALLOC537_TAGS).
+ * malloc537_tagged is malloc537 with the block put on tag's list (tag 0
+ * means no tag). free537_tag frees every live block with that tag in one
+ * pass down the list, and malloc537_tag_bytes says how many bytes are
+ * live under a tag. Tagged blocks can still be freed one at a time, and
+ * realloc537 keeps the tag.
+ * These always call the library, even at MALLOC537_LEVEL 0, where
+ * tagged blocks should only be freed with free537_tag.
+ */
+void *malloc537_tagged(size_t size, unsigned long tag);
+void free537_tag(unsigned long tag);
+size_t malloc537_tag_bytes(unsigned long tag);
+
+/*
+ * Read-mostly phase (only when the library is built with
+ * -DMALLOC537_FROZEN_INDEX): copies every live block into a flat,
+ * read-only index that memcheck537 searches before the tree. New
+ * mallocs and frees are tracked on the side until there are too
+ * many of them, and then it's back to the tree until the next call.
+ */
+void malloc537_freeze_index(void);
+
+/*
+ * Tracking modes (only when the library is built with -DMALLOC537_MODES,
+ * otherwise it's always full): off sends everything straight to libc,
+ * sampled tracks one malloc537 in MALLOC537_SAMPLE, full tracks them
+ * all. The mode starts as MALLOC537_MODE in the environment (off,
+ * sampled or full, the default) and can be changed at any time.
+ * Blocks from before a change are still freed the right way.
+ */
+#define MALLOC537_MODE_OFF 0
+#define MALLOC537_MODE_SAMPLED 1
+#define MALLOC537_MODE_FULL 2
+
+void malloc537_set_mode(int mode);
+int malloc537_mode(void);
+
+/*
+ * Private heaps (only when the library is built with -DMALLOC537_HEAPS).
+ * Each one has its own tree and its own lock, so lookups only search
+ * that heap's blocks and threads on different heaps don't wait for each
+ * other. The _in calls are the usual ones on a heap, with NULL being
+ * the default heap everything else uses; a block has to be freed,
+ * realloc'd and checked in the heap it came from. Destroying a heap
+ * frees every block still in it in one pass.
+ * Private heaps only track (see heap.h for what stays with the default).
+ */
+typedef struct malloc537_heap malloc537_heap_t;
+
+malloc537_heap_t *malloc537_heap_create(void);
+void malloc537_heap_destroy(malloc537_heap_t *heap);
+void *malloc537_in(malloc537_heap_t *heap, size_t size);
+void free537_in(malloc537_heap_t *heap, void *ptr);
+void *realloc537_in(malloc537_heap_t *heap, void *ptr, size_t size);
+void memcheck537_in(malloc537_heap_t *heap, void *ptr, size_t size);
+int malloc537_n_in(malloc537_heap_t *heap, size_t size, int count, void ** out);
+void free537_n_in(malloc537_heap_t *heap, void ** ptrs, int count);
+
+/*
+ * Batch versions for allocating/freeing lots of blocks at once.
+ * malloc537_n returns how many of the count blocks it got.
+ */
+int malloc537_n(size_t size, int count, void ** out);
+void free537_n(void ** ptrs, int count);
+
+/*
+ * Size classes: class 0 is blocks up to 16 bytes, 1 up to 32 and so on,
+ * with everything bigger than that in the last one.
+ */
+#define MALLOC537_SIZE_CLASSES 16
+
+static inline int malloc537_size_class(size_t bounds)
+{
+	int size_class = bounds > 16 ? 60 - __builtin_clzll((unsigned long long)bounds - 1) : 0;
+	return size_class < MALLOC537_SIZE_CLASSES ? size_class : MALLOC537_SIZE_CLASSES - 1;
+}
+
+/*
+ * Lifetime histograms (only filled in when the library is built with
+ * -DMALLOC537_LIFETIME): counts[size class][bucket], where bucket b is
+ * lifetimes of 2^b up to 2^(b+1) clock ticks.
+ * malloc537_lifetime_dump prints them, and runs at exit.
+ */
+#define MALLOC537_LIFETIME_BUCKETS 48
+
+void malloc537_lifetimes(unsigned long counts[MALLOC537_SIZE_CLASSES][MALLOC537_LIFETIME_BUCKETS]);
+void malloc537_lifetime_dump(void);
+
+/*
+ * Latency histograms (only filled in when the library is built with
+ * -DMALLOC537_LATENCY): how long each call took, in the same clock
+ * ticks as the lifetimes. Buckets are log-linear like an HDR histogram:
+ * exact below 32, then 16 to each power of two, so a bucket is never
+ * more than 1/16 wide. memcheck537 is split by whether ptr was the
+ * start of its block or inside it (inline hits never get here).
+ * realloc537(NULL, size) and realloc537(ptr, 0) count as the malloc537
+ * and free537 they turn into, not as reallocs. A realloc537 that moves
+ * a block into or out of the huge blocks counts as a realloc, and also
+ * as the malloc537 and free537 it does along the way.
+ * malloc537_latency fills counts[] for one op, summed over every thread.
+ * malloc537_latency_value is the smallest time bucket counts,
+ * malloc537_latency_percentile the time percent of the op's calls were
+ * under (to within a bucket), and malloc537_latency_dump prints every
+ * op's count, p50, p99, p99.9 and max, and runs at exit.
+ */
+#define MALLOC537_LATENCY_MALLOC 0
+#define MALLOC537_LATENCY_FREE 1
+#define MALLOC537_LATENCY_REALLOC 2
+#define MALLOC537_LATENCY_MEMCHECK_EXACT 3
+#define MALLOC537_LATENCY_MEMCHECK_INTERIOR 4
+#define MALLOC537_LATENCY_MALLOC_N 5
+#define MALLOC537_LATENCY_FREE_N 6
+#define MALLOC537_LATENCY_TAGGED 7
+#define MALLOC537_LATENCY_FREE_TAG 8
+#define MALLOC537_LATENCY_OPS 9
+#define MALLOC537_LATENCY_BUCKETS 736
+
+void malloc537_latency(int op, unsigned long counts[MALLOC537_LATENCY_BUCKETS]);
+unsigned long malloc537_latency_value(int bucket);
+unsigned long malloc537_latency_percentile(int op, double percent);
+void malloc537_latency_dump(void);
+
+/*
+ * memcheck537 heatmap (only filled in when the library is built with
+ * -DMALLOC537_HEATMAP): how many checks, and how many bytes checked,
+ * landed in each block and on each allocation site (the return address
+ * of the malloc537-family call that made the block).
+ * malloc537_heat_objects and malloc537_heat_sites fill out[] with the
+ * count hottest, most checks first, and return how many they found.
+ * For sites, base and bounds are 0. malloc537_heat_dump prints the
+ * count hottest of each, and runs at exit.
+ */
+typedef struct malloc537_heat
+{
+	void * base;
+	size_t bounds;
+	void * site;
+	unsigned long checks;
+	unsigned long bytes;
+}malloc537_heat;
+
+int malloc537_heat_objects(malloc537_heat * out, int count);
+int malloc537_heat_sites(malloc537_heat * out, int count);
+void malloc537_heat_dump(int count);
+
+/*
+ * Redzones (only when the library is built with -DMALLOC537_REDZONE).
+ * Sets how many canary bytes go on each side of blocks in a size class,
+ * rounded up to a multiple of 16. Has to happen before the first malloc537.
+ * memcheck537_verify_all checks the redzones of every live block,
+ * reports each damaged one and quits if there were any.
+ */
+void malloc537_set_redzone(int size_class, size_t bytes);
+void memcheck537_verify_all(void);
+
+/*
+ * Background heap verifier (only when the library is built with
+ * -DMALLOC537_VERIFIER). A thread wakes up every interval_us and spends
+ * at most slice_us holding the lock, checking the next stretch of blocks
+ * in address order: tree invariants, redzones and quarantined blocks'
+ * poison where those are built in. Problems are reported like any
+ * other error.
+ */
+void malloc537_verifier_start(unsigned int slice_us, unsigned int interval_us);
+void malloc537_verifier_stop(void);
+
+/*
+ * The block the last memcheck537 on this thread passed.
+ * Only good while generation matches memcheck537_generation,
+ * which goes up whenever anything is freed.
+ */
+typedef struct memcheck537_cache
+{
+	char * base;
+	size_t bounds;
+	unsigned long generation;
+}memcheck537_cache;
+
+extern __thread memcheck537_cache memcheck537_last;
+extern unsigned long memcheck537_generation;
+
+#ifndef MALLOC537_INTERNAL
+
+#if MALLOC537_LEVEL >= 2
+/*
+ * Inline half of memcheck537: if the range is inside the same block
+ * the last check on this thread found, we're done without a call.
+ * Otherwise the real memcheck537 does the whole check.
+ */
+static inline void memcheck537_inline(void *ptr, size_t size)
+{
+	char * p = (char *)ptr;
+	if(memcheck537_last.generation == __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED)
+		&& p >= memcheck537_last.base
+		&& size <= memcheck537_last.bounds
+		&& (size_t)(p - memcheck537_last.base) <= memcheck537_last.bounds - size)
+	{
+		return;
+	}
+	(memcheck537)(ptr, size);
+}
+#define memcheck537(ptr, size) memcheck537_inline((ptr), (size))
+
+#elif MALLOC537_LEVEL == 1
+#define memcheck537(ptr, size) ((void)0)
+
+#else
+#include <stdlib.h>
+
+static inline int malloc537_n_off(size_t size, int count, void ** out)
+{
+	int i;
+	int allocated = 0;
+	for(i = 0; i < count; i++)
+	{
+		out[i] = malloc(size);
+		allocated += (out[i] != NULL);
+	}
+	return allocated;
+}
+
+static inline void free537_n_off(void ** ptrs, int count)
+{
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		free(ptrs[i]);
+	}
+}
+
+#define malloc537(size) malloc(size)
+#define free537(ptr) free(ptr)
+#define realloc537(ptr, size) realloc((ptr), (size))
+#define memcheck537(ptr, size) ((void)0)
+#define malloc537_n(size, count, out) malloc537_n_off((size), (count), (out))
+#define free537_n(ptrs, count) free537_n_off((ptrs), (count))
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
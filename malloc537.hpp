@@ -0,0 +1,701 @@
+/*
+ * malloc537.hpp
+ * Header-only C++ version of the malloc537 checks, for programs that want
+ * more than one tracker (one per subsystem, say), or errors that don't
+ * end the program.
+ *
+ *   mem537::tracker<IndexPolicy, LockPolicy, ErrorPolicy, Backend>
+ *
+ * does the checks malloc537/free537/realloc537/memcheck537 do. What's an
+ * error and how it's worded come from report537.h, which the C library
+ * uses too; the tracker only has its own ways of finding blocks. All it
+ * keeps is in the object and each policy is a template parameter, so it
+ * all inlines:
+ *  - IndexPolicy: rbtree_index (std::map, which is a red-black tree),
+ *    hash_index (the same plus a hash table for exact bases, like
+ *    MALLOC537_HASH_INDEX), or array_index (a sorted vector - best for
+ *    a handful of blocks).
+ *  - LockPolicy: no_lock, mutex_lock, or sharded_lock<N>, which splits
+ *    the blocks over N indexes by address, each with its own lock.
+ *  - ErrorPolicy: exit_on_error (like the C library), abort_on_error,
+ *    throw_on_error (throws mem537::error), or count_errors (prints,
+ *    counts and carries on; the call does nothing).
+ *  - Backend: where the memory comes from. libc_backend is malloc/free.
+ *
+ * mem537::default_tracker is the combination that behaves like the C
+ * library built without options (none of the redzones, quarantine, huge
+ * blocks and so on). The C entry points in malloc537.h are still the C
+ * library - this is a separate tracker with its own blocks. (The namespace
+ * can't be malloc537, that's already the function.)
+ */
+#ifndef MALLOC537_HPP
+#define MALLOC537_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "report537.h"
+
+namespace mem537
+{
+
+/*
+ * One tracked block.
+ */
+typedef report537_block block;
+
+/*
+ * Index policies. Each keeps blocks by base, and has:
+ *  find(base)          - block with exactly that base (live or freed), or NULL.
+ *  containing(ptr)     - live block with base <= ptr <= base + bounds, or else
+ *                        the freed one right below ptr if it reaches ptr, or
+ *                        NULL - what bounds_lookup does in the C library.
+ *  clear_freed(b, n)   - drops freed blocks that fit strictly inside [b, b + n),
+ *                        like the contained_lookup loop in malloc537.c.
+ *  insert(base, n)     - adds a live block, reusing a freed one at the same base.
+ *                        NULL if there's a live one there already.
+ * Pointers they return are good until the next insert or clear_freed.
+ */
+
+/*
+ * std::map of blocks (a red-black tree). With Hashed, there's also a
+ * hash table for exact bases - std::map nodes never move, so it can
+ * point straight at them.
+ */
+template<bool Hashed>
+class map_index
+{
+public:
+	block * find(char * base)
+	{
+		if(Hashed)
+		{
+			typename std::unordered_map<char *, block *>::iterator found = exact.find(base);
+			return found == exact.end() ? NULL : found->second;
+		}
+		else
+		{
+			typename std::map<char *, block>::iterator found = blocks.find(base);
+			return found == blocks.end() ? NULL : &found->second;
+		}
+	}
+
+	block * containing(char * ptr)
+	{
+		typename std::map<char *, block>::iterator at = blocks.upper_bound(ptr);
+		block * freed = NULL;
+
+		/*
+		 * The freed block right below ptr, if it reaches ptr,
+		 * is only the answer if no live one is.
+		 */
+		if(at != blocks.begin())
+		{
+			freed = &std::prev(at)->second;
+			if(!freed->free || ptr > freed->base + freed->bounds)
+			{
+				freed = NULL;
+			}
+		}
+
+		/*
+		 * Live blocks never overlap, so the only one that can hold ptr
+		 * is the first live one at or below it.
+		 */
+		while(at != blocks.begin())
+		{
+			--at;
+			if(!at->second.free)
+			{
+				return ptr <= at->first + at->second.bounds ? &at->second : freed;
+			}
+		}
+		return freed;
+	}
+
+	void clear_freed(char * base, std::size_t size)
+	{
+		typename std::map<char *, block>::iterator at = blocks.upper_bound(base);
+
+		while(at != blocks.end() && at->first < base + size)
+		{
+			if(at->second.free && at->first + at->second.bounds < base + size)
+			{
+				if(Hashed)
+				{
+					exact.erase(at->first);
+				}
+				blocks.erase(at++);
+			}
+			else
+			{
+				++at;
+			}
+		}
+	}
+
+	block * insert(char * base, std::size_t bounds)
+	{
+		block added = { base, bounds, false };
+		std::pair<typename std::map<char *, block>::iterator, bool> result = blocks.insert(std::make_pair(base, added));
+
+		if(!result.second)
+		{
+			if(!result.first->second.free)
+			{
+				return NULL;
+			}
+			result.first->second = added;
+		}
+		else if(Hashed)
+		{
+			exact[base] = &result.first->second;
+		}
+		return &result.first->second;
+	}
+
+private:
+	std::map<char *, block> blocks;
+	std::unordered_map<char *, block *> exact;
+};
+
+typedef map_index<false> rbtree_index;
+typedef map_index<true> hash_index;
+
+/*
+ * Sorted vector. Inserts move everything above them, so this is for
+ * trackers that only ever hold a few blocks.
+ */
+class array_index
+{
+public:
+	block * find(char * base)
+	{
+		std::size_t at = lower(base);
+		return at < blocks.size() && blocks[at].base == base ? &blocks[at] : NULL;
+	}
+
+	block * containing(char * ptr)
+	{
+		std::size_t at = lower(ptr + 1);
+		block * freed = NULL;
+
+		if(at > 0 && blocks[at - 1].free && ptr <= blocks[at - 1].base + blocks[at - 1].bounds)
+		{
+			freed = &blocks[at - 1];
+		}
+
+		while(at > 0)
+		{
+			--at;
+			if(!blocks[at].free)
+			{
+				return ptr <= blocks[at].base + blocks[at].bounds ? &blocks[at] : freed;
+			}
+		}
+		return freed;
+	}
+
+	void clear_freed(char * base, std::size_t size)
+	{
+		std::size_t at = lower(base + 1);
+
+		while(at < blocks.size() && blocks[at].base < base + size)
+		{
+			if(blocks[at].free && blocks[at].base + blocks[at].bounds < base + size)
+			{
+				blocks.erase(blocks.begin() + at);
+			}
+			else
+			{
+				at++;
+			}
+		}
+	}
+
+	block * insert(char * base, std::size_t bounds)
+	{
+		block added = { base, bounds, false };
+		std::size_t at = lower(base);
+
+		if(at < blocks.size() && blocks[at].base == base)
+		{
+			if(!blocks[at].free)
+			{
+				return NULL;
+			}
+			blocks[at] = added;
+			return &blocks[at];
+		}
+		blocks.insert(blocks.begin() + at, added);
+		return &blocks[at];
+	}
+
+private:
+	/*
+	 * First block with a base at or above ptr.
+	 */
+	std::size_t lower(char * ptr)
+	{
+		std::size_t low = 0;
+		std::size_t high = blocks.size();
+		std::size_t middle;
+
+		while(low < high)
+		{
+			middle = (low + high) / 2;
+			if(blocks[middle].base < ptr)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		return low;
+	}
+
+	std::vector<block> blocks;
+};
+
+/*
+ * Lock policies. shards is how many separate indexes the tracker keeps
+ * (each with its own mutex_type), and region_shift how addresses are
+ * split between them: a block lives in shard (base >> region_shift) % shards.
+ */
+
+struct no_lock
+{
+	struct mutex_type
+	{
+		void lock() {}
+		void unlock() {}
+	};
+	static const std::size_t shards = 1;
+	static const int region_shift = 0;
+};
+
+struct mutex_lock
+{
+	typedef std::mutex mutex_type;
+	static const std::size_t shards = 1;
+	static const int region_shift = 0;
+};
+
+/*
+ * Threads working on blocks in different 64KB regions (by default)
+ * mostly take different locks.
+ */
+template<std::size_t Shards, int RegionShift = 16>
+struct sharded_lock
+{
+	typedef std::mutex mutex_type;
+	static const std::size_t shards = Shards;
+	static const int region_shift = RegionShift;
+};
+
+/*
+ * Error policies. fail() gets the whole message, newline and all.
+ * If it returns, the call that failed returns without doing anything
+ * (NULL from malloc/realloc, false from memcheck).
+ */
+
+struct exit_on_error
+{
+	void fail(const std::string & message)
+	{
+		std::fputs(message.c_str(), stdout);
+		std::exit(EXIT_FAILURE);
+	}
+};
+
+struct abort_on_error
+{
+	void fail(const std::string & message)
+	{
+		std::fputs(message.c_str(), stdout);
+		std::fflush(stdout);
+		std::abort();
+	}
+};
+
+class error : public std::runtime_error
+{
+public:
+	explicit error(const std::string & message) : std::runtime_error(message) {}
+};
+
+struct throw_on_error
+{
+	void fail(const std::string & message)
+	{
+		throw error(message);
+	}
+};
+
+class count_errors
+{
+public:
+	count_errors() : count(0) {}
+
+	void fail(const std::string & message)
+	{
+		std::fputs(message.c_str(), stdout);
+		count++;
+	}
+
+	unsigned long errors() const
+	{
+		return count.load();
+	}
+
+private:
+	std::atomic<unsigned long> count;
+};
+
+/*
+ * Backends.
+ */
+struct libc_backend
+{
+	static void * allocate(std::size_t size)
+	{
+		return std::malloc(size);
+	}
+
+	static void deallocate(void * ptr, std::size_t size)
+	{
+		(void)size;
+		std::free(ptr);
+	}
+
+	static void * reallocate(void * ptr, std::size_t old_size, std::size_t size)
+	{
+		(void)old_size;
+		return std::realloc(ptr, size);
+	}
+};
+
+template<class IndexPolicy, class LockPolicy, class ErrorPolicy, class Backend>
+class tracker : public ErrorPolicy
+{
+public:
+	tracker() : largest(0), frees(0) {}
+
+	/*
+	 * malloc537.
+	 */
+	void * malloc(std::size_t size)
+	{
+		char * base;
+
+		if(size == 0)
+		{
+			std::printf(REPORT537_ZERO_SIZE);
+		}
+
+		base = static_cast<char *>(Backend::allocate(size));
+		if(!track(base, size))
+		{
+			Backend::deallocate(base, size);
+			return NULL;
+		}
+		return base;
+	}
+
+	/*
+	 * free537.
+	 */
+	void free(void * ptr)
+	{
+		std::size_t bounds;
+
+		if(take(ptr, bounds, unsized))
+		{
+			Backend::deallocate(ptr, bounds);
+		}
+	}
+
+	/*
+	 * Sized free537, for callers that know how big the block is
+	 * (allocators do). The size has to match what was allocated,
+	 * and goes straight to the backend.
+	 */
+	void free(void * ptr, std::size_t size)
+	{
+		std::size_t bounds;
+
+		if(take(ptr, bounds, size))
+		{
+			Backend::deallocate(ptr, size);
+		}
+	}
+
+	/*
+	 * realloc537.
+	 */
+	void * realloc(void * ptr, std::size_t size)
+	{
+		std::size_t bounds;
+		char * moved;
+
+		if(ptr == NULL)
+		{
+			return malloc(size);
+		}
+		else if(size == 0)
+		{
+			free(ptr);
+			return NULL;
+		}
+
+		if(!take(ptr, bounds, unsized))
+		{
+			return NULL;
+		}
+		moved = static_cast<char *>(Backend::reallocate(ptr, bounds, size));
+
+		/*
+		 * A failed realloc leaves the old block alone, so it's still live.
+		 */
+		track(moved != NULL ? moved : static_cast<char *>(ptr), moved != NULL ? size : bounds);
+		return moved;
+	}
+
+	/*
+	 * memcheck537. True if [ptr, ptr + size) is all in one live block.
+	 */
+	bool memcheck(const void * ptr, std::size_t size)
+	{
+		block live;
+		return check(ptr, size, live);
+	}
+
+	/*
+	 * Finds the live block ptr is in, for checked_ptr and friends
+	 * (checked537.hpp). *seen is the generation it's good for.
+	 * Reports it like memcheck if there isn't one.
+	 */
+	bool resolve(const void * ptr, block & live, unsigned long & seen)
+	{
+		seen = generation();
+		return check(ptr, 0, live);
+	}
+
+	/*
+	 * Goes up every time a block is freed.
+	 */
+	unsigned long generation() const
+	{
+		return frees.load(std::memory_order_acquire);
+	}
+
+private:
+	/*
+	 * memcheck, handing back the block on success.
+	 */
+	bool check(const void * ptr, std::size_t size, block & live)
+	{
+		char * p = static_cast<char *>(const_cast<void *>(ptr));
+		block * indexed;
+		block exact;
+		block around;
+		const block * found_exact = NULL;
+		const block * found_around = NULL;
+		const block * found;
+		char message[REPORT537_LENGTH];
+
+		{
+			shard_lock held(shard_for(p));
+			indexed = held.index().find(p);
+			if(indexed != NULL)
+			{
+				exact = *indexed;
+				found_exact = &exact;
+			}
+		}
+
+		if((found_exact == NULL || exact.free) && containing(p, around))
+		{
+			found_around = &around;
+		}
+
+		found = report537_range(p, size, found_exact, found_around, message);
+		if(found == NULL)
+		{
+			this->fail(message);
+			return false;
+		}
+		live = *found;
+		return true;
+	}
+
+	struct shard
+	{
+		typename LockPolicy::mutex_type lock;
+		IndexPolicy index;
+	};
+
+	/*
+	 * Holds a shard's lock for as long as it's around, even through a throw.
+	 */
+	class shard_lock
+	{
+	public:
+		explicit shard_lock(shard & held) : held(held) { held.lock.lock(); }
+		~shard_lock() { held.lock.unlock(); }
+		IndexPolicy & index() { return held.index; }
+
+	private:
+		shard_lock(const shard_lock &);
+		shard_lock & operator=(const shard_lock &);
+		shard & held;
+	};
+
+	static std::size_t region(const char * ptr)
+	{
+		return reinterpret_cast<std::size_t>(ptr) >> LockPolicy::region_shift;
+	}
+
+	shard & shard_for(const char * ptr)
+	{
+		return shards[region(ptr) % LockPolicy::shards];
+	}
+
+	__attribute__((format(printf, 1, 2)))
+	static std::string format(const char * pattern, ...)
+	{
+		char buffer[256];
+		va_list args;
+		va_start(args, pattern);
+		std::vsnprintf(buffer, sizeof(buffer), pattern, args);
+		va_end(args);
+		return buffer;
+	}
+
+	/*
+	 * The block holding ptr, copied into around: a live one if any shard
+	 * has one, otherwise a freed one. A block can start in an earlier
+	 * region than ptr, but no further back than the biggest block we've
+	 * seen, so that's as many shards as we need to look in.
+	 */
+	bool containing(char * ptr, block & around)
+	{
+		std::size_t last = region(ptr);
+		std::size_t reach = largest.load(std::memory_order_relaxed);
+		std::size_t address = reinterpret_cast<std::size_t>(ptr);
+		std::size_t first = region(ptr - (reach < address ? reach : address));
+		std::size_t step;
+		block * found;
+		bool freed = false;
+
+		for(step = 0; step < LockPolicy::shards && step <= last - first; step++)
+		{
+			shard_lock held(shards[(last - step) % LockPolicy::shards]);
+			found = held.index().containing(ptr);
+			if(found != NULL && (!found->free || !freed))
+			{
+				around = *found;
+				if(!found->free)
+				{
+					return true;
+				}
+				freed = true;
+			}
+		}
+		return freed;
+	}
+
+	/*
+	 * Clears out freed blocks base covers, and adds it.
+	 */
+	bool track(char * base, std::size_t size)
+	{
+		std::size_t last = region(base + size);
+		std::size_t first = region(base);
+		std::size_t step;
+		std::size_t seen = largest.load(std::memory_order_relaxed);
+
+		for(step = 0; step < LockPolicy::shards && step <= last - first; step++)
+		{
+			shard_lock held(shards[(first + step) % LockPolicy::shards]);
+			held.index().clear_freed(base, size);
+		}
+
+		while(seen < size && !largest.compare_exchange_weak(seen, size, std::memory_order_relaxed))
+		{
+		}
+
+		{
+			shard_lock held(shard_for(base));
+			if(held.index().insert(base, size) != NULL)
+			{
+				return true;
+			}
+		}
+		this->fail(format(REPORT537_OCCUPIED, (void *)base));
+		return false;
+	}
+
+	static const std::size_t unsized = REPORT537_UNSIZED;
+
+	/*
+	 * The checks free537 does, plus checking the size if it's not unsized.
+	 * Marks the block free and hands back its size, or reports what's wrong.
+	 */
+	bool take(void * ptr, std::size_t & bounds, std::size_t size)
+	{
+		char * p = static_cast<char *>(ptr);
+		block * indexed = NULL;
+		block around;
+		char message[REPORT537_LENGTH];
+
+		if(ptr != NULL)
+		{
+			shard_lock held(shard_for(p));
+			indexed = held.index().find(p);
+			if(indexed != NULL && report537_free(ptr, size, indexed, NULL, message) != NULL)
+			{
+				indexed->free = true;
+				frees.fetch_add(1, std::memory_order_release);
+				bounds = indexed->bounds;
+				return true;
+			}
+		}
+
+		/*
+		 * Only a block based at ptr could have made it good, so
+		 * without one, finding the block around ptr just tells us what to say.
+		 */
+		if(indexed == NULL)
+		{
+			report537_free(ptr, size, NULL, ptr != NULL && containing(p, around) ? &around : NULL, message);
+		}
+		this->fail(message);
+		return false;
+	}
+
+	std::array<shard, LockPolicy::shards> shards;
+	std::atomic<std::size_t> largest;
+	std::atomic<unsigned long> frees;
+};
+
+/*
+ * The one that acts like the C library.
+ */
+typedef tracker<rbtree_index, mutex_lock, exit_on_error, libc_backend> default_tracker;
+
+}
+
+#endif
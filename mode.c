@@ -0,0 +1,327 @@
+/*
+ * mode.c
+ * The public malloc537/free537/realloc537/memcheck537, jumping to
+ * whatever the current mode wants, see mode.h.
+ * Built with -O2, so each of these is one jump and the tracking
+ * versions still see the caller's return address (for the heatmap).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#define MALLOC537_INTERNAL
+#include "malloc537.h"
+#include "mode.h"
+
+#ifdef MALLOC537_MODES
+
+typedef struct mode_table
+{
+	int mode;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*realloc)(void *ptr, size_t size);
+	void (*memcheck)(void *ptr, size_t size);
+}mode_table;
+
+static const mode_table startup_table;
+static const mode_table * table = &startup_table;
+static pthread_mutex_t switch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Set for good once anything has been tracked, or anything has
+ * come from libc untracked.
+ */
+static int ever_tracked;
+static int ever_untracked;
+static unsigned long sample = MODE_SAMPLE;
+static __thread unsigned long sample_countdown;
+
+static const mode_table * current()
+{
+	return __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Off: every range is fine. The inline check is told about a block
+ * covering all of memory, so it stops calling us until the mode (or
+ * anything freed) moves the generation on.
+ */
+static void pass_memcheck(void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+	memcheck537_last.base = NULL;
+	memcheck537_last.bounds = (size_t)-1;
+	memcheck537_last.generation = __atomic_load_n(&memcheck537_generation, __ATOMIC_RELAXED);
+}
+
+/*
+ * The tree only knows its own blocks. Anything else could be from
+ * libc, so it goes back there (free537(NULL) is still an error).
+ */
+static void mixed_free(void *ptr)
+{
+	/*
+	 * A tracked block that was freed is still the tree's,
+	 * and free537 says it was already freed.
+	 */
+	if(ptr == NULL || tracked_block(ptr, 1) != TRACKED_NONE)
+	{
+		free537_tracked(ptr);
+		return;
+	}
+	free(ptr);
+}
+
+/*
+ * A block from libc, with the tree told about it.
+ */
+static void *untracked_malloc(size_t size)
+{
+	void * ptr = malloc(size);
+
+	untracked_block(ptr, size);
+	return ptr;
+}
+
+static void *mixed_realloc(void *ptr, size_t size)
+{
+	void * new_ptr;
+
+	if(ptr == NULL)
+	{
+		return current()->malloc(size);
+	}
+	if(tracked_block(ptr, 1) != TRACKED_NONE)
+	{
+		return realloc537_tracked(ptr, size);
+	}
+	/*
+	 * An untracked block stays untracked.
+	 */
+	if(size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	new_ptr = realloc(ptr, size);
+	untracked_block(new_ptr, size);
+	return new_ptr;
+}
+
+/*
+ * Only live blocks are checked: libc may have handed out part of
+ * a freed one again, untracked.
+ */
+static void mixed_memcheck(void *ptr, size_t size)
+{
+	if(tracked_block(ptr, 0) == TRACKED_LIVE)
+	{
+		memcheck537_tracked(ptr, size);
+	}
+}
+
+static void *sampled_malloc(size_t size)
+{
+	if(sample_countdown == 0)
+	{
+		sample_countdown = sample;
+	}
+	if(--sample_countdown == 0)
+	{
+		return malloc537_tracked(size);
+	}
+	return untracked_malloc(size);
+}
+
+static const mode_table off_table =
+{
+	MALLOC537_MODE_OFF, malloc, free, realloc, pass_memcheck
+};
+
+/*
+ * Off, with tracked blocks that might still be around.
+ */
+static const mode_table off_mixed_table =
+{
+	MALLOC537_MODE_OFF, untracked_malloc, mixed_free, mixed_realloc, pass_memcheck
+};
+
+static const mode_table sampled_table =
+{
+	MALLOC537_MODE_SAMPLED, sampled_malloc, mixed_free, mixed_realloc, mixed_memcheck
+};
+
+static const mode_table full_table =
+{
+	MALLOC537_MODE_FULL, malloc537_tracked, free537_tracked, realloc537_tracked, memcheck537_tracked
+};
+
+/*
+ * Full, with untracked blocks that might still be around.
+ */
+static const mode_table full_mixed_table =
+{
+	MALLOC537_MODE_FULL, malloc537_tracked, mixed_free, mixed_realloc, mixed_memcheck
+};
+
+/*
+ * Caller holds switch_lock.
+ */
+static void switch_to(int mode)
+{
+	const mode_table * next;
+
+	switch(mode)
+	{
+		case MALLOC537_MODE_OFF:
+			ever_untracked = 1;
+			next = ever_tracked ? &off_mixed_table : &off_table;
+			break;
+
+		case MALLOC537_MODE_SAMPLED:
+			ever_tracked = 1;
+			ever_untracked = 1;
+			next = &sampled_table;
+			break;
+
+		case MALLOC537_MODE_FULL:
+			ever_tracked = 1;
+			next = ever_untracked ? &full_mixed_table : &full_table;
+			break;
+
+		default:
+			printf("There's no malloc537 mode %d!\n", mode);
+			exit(EXIT_FAILURE);
+	}
+
+	__atomic_store_n(&table, next, __ATOMIC_RELEASE);
+	/*
+	 * Every thread's inline check has to ask the new mode.
+	 */
+	__atomic_add_fetch(&memcheck537_generation, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The table, picked from the environment by the first call to get here.
+ */
+static const mode_table * start()
+{
+	char * env;
+
+	if(current() != &startup_table)
+	{
+		return current();
+	}
+	pthread_mutex_lock(&switch_lock);
+	if(current() == &startup_table)
+	{
+		env = getenv("MALLOC537_SAMPLE");
+		if(env != NULL && atol(env) > 0)
+		{
+			sample = (unsigned long)atol(env);
+		}
+
+		env = getenv("MALLOC537_MODE");
+		if(env == NULL || strcmp(env, "full") == 0)
+		{
+			switch_to(MALLOC537_MODE_FULL);
+		}
+		else if(strcmp(env, "sampled") == 0)
+		{
+			switch_to(MALLOC537_MODE_SAMPLED);
+		}
+		else if(strcmp(env, "off") == 0)
+		{
+			switch_to(MALLOC537_MODE_OFF);
+		}
+		else
+		{
+			printf("MALLOC537_MODE should be off, sampled or full, not %s!\n", env);
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_mutex_unlock(&switch_lock);
+	return current();
+}
+
+static void *start_malloc(size_t size)
+{
+	return start()->malloc(size);
+}
+
+static void start_free(void *ptr)
+{
+	start()->free(ptr);
+}
+
+static void *start_realloc(void *ptr, size_t size)
+{
+	return start()->realloc(ptr, size);
+}
+
+static void start_memcheck(void *ptr, size_t size)
+{
+	start()->memcheck(ptr, size);
+}
+
+static const mode_table startup_table =
+{
+	-1, start_malloc, start_free, start_realloc, start_memcheck
+};
+
+void *malloc537(size_t size)
+{
+	return current()->malloc(size);
+}
+
+void *mode_malloc(size_t size)
+{
+	return current()->malloc(size);
+}
+
+void free537(void *ptr)
+{
+	current()->free(ptr);
+}
+
+void mode_free(void *ptr)
+{
+	current()->free(ptr);
+}
+
+void *realloc537(void *ptr, size_t size)
+{
+	return current()->realloc(ptr, size);
+}
+
+void memcheck537(void *ptr, size_t size)
+{
+	current()->memcheck(ptr, size);
+}
+
+void mode_memcheck(void *ptr, size_t size)
+{
+	current()->memcheck(ptr, size);
+}
+
+void malloc537_set_mode(int mode)
+{
+	start();
+	pthread_mutex_lock(&switch_lock);
+	switch_to(mode);
+	pthread_mutex_unlock(&switch_lock);
+}
+
+int malloc537_mode()
+{
+	return start()->mode;
+}
+
+int mode_untracked()
+{
+	return __atomic_load_n(&ever_untracked, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * mode.h
+ * Tracking modes picked at run time (build with -DMALLOC537_MODES).
+ * malloc537, free537, realloc537 and memcheck537 jump through a table
+ * for the current mode (mode.c):
+ *  off     - straight to libc, and memcheck537 passes everything.
+ *  sampled - one malloc537 in MALLOC537_SAMPLE (environment, default
+ *            100) is tracked, the rest come from libc.
+ *  full    - everything is tracked, like without the flag.
+ * MALLOC537_MODE (environment: off, sampled or full, the default) sets
+ * the mode at startup, and malloc537_set_mode changes it later.
+ *
+ * Once a block might have come from libc untracked, the tree can only
+ * speak for the blocks in it: free537 and realloc537 hand pointers it
+ * doesn't know to libc, and memcheck537 lets them through. A pointer
+ * to a tracked block that was freed is still reported as a double free. Until then
+ * (a program that starts off and is never switched) off mode is the
+ * libc calls and nothing else.
+ */
+#ifndef MODE_H
+#define MODE_H
+
+#include <stddef.h>
+
+#ifndef MODE_SAMPLE
+#define MODE_SAMPLE 100
+#endif
+
+/*
+ * The tracking versions, in malloc537.c.
+ */
+void *malloc537_tracked(size_t size);
+void free537_tracked(void *ptr);
+void *realloc537_tracked(void *ptr, size_t size);
+void memcheck537_tracked(void *ptr, size_t size);
+
+/*
+ * What the tree knows about ptr (with exact, as the start of a block):
+ * TRACKED_NONE if nothing, TRACKED_LIVE if it's in a live tracked block,
+ * or TRACKED_FREED if it's in one that was freed. Never complains.
+ * In malloc537.c.
+ */
+#define TRACKED_NONE 0
+#define TRACKED_LIVE 1
+#define TRACKED_FREED 2
+
+int tracked_block(void * ptr, int exact);
+
+/*
+ * Tells the tree about a block libc just handed out untracked, so it
+ * forgets any freed block it has at the same address - otherwise
+ * freeing this one would look like a double free. In malloc537.c.
+ */
+void untracked_block(void * ptr, size_t size);
+
+/*
+ * The current mode's malloc537, free537 and memcheck537, for
+ * malloc537.c, where those names are the tracking versions.
+ */
+void *mode_malloc(size_t size);
+void mode_free(void *ptr);
+void mode_memcheck(void *ptr, size_t size);
+
+/*
+ * Whether blocks from libc might be mixed in with the tracked ones,
+ * so the batch calls know to go one pointer at a time.
+ */
+int mode_untracked(void);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * pagefilter.c
+ * The tracked page filter, see pagefilter.h.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "pagefilter.h"
+#include "backend.h"
+
+#define PAGE_SHIFT 12
+
+static uint64_t bits[PAGE_FILTER_BITS / 64];
+static size_t bits_set;
+static size_t rebuild_at = PAGE_FILTER_BITS / 2;
+static char * lowest;
+static char * highest;
+
+/*
+ * The two bits for a page come from the top and the middle
+ * of one multiply.
+ */
+static uint64_t page_hash(uintptr_t page)
+{
+	return (uint64_t)page * 0x9E3779B97F4A7C15ull;
+}
+
+static size_t first_bit(uint64_t hash)
+{
+	return (size_t)(hash >> 40) & (PAGE_FILTER_BITS - 1);
+}
+
+static size_t second_bit(uint64_t hash)
+{
+	return (size_t)(hash >> 20) & (PAGE_FILTER_BITS - 1);
+}
+
+static void set_bit(size_t bit)
+{
+	uint64_t mask = 1ull << (bit & 63);
+
+	if(!(bits[bit / 64] & mask))
+	{
+		bits[bit / 64] |= mask;
+		bits_set++;
+	}
+}
+
+static int test_bit(size_t bit)
+{
+	return (bits[bit / 64] >> (bit & 63)) & 1;
+}
+
+/*
+ * Marks every page from base to one past its end.
+ */
+static void mark(void * base, size_t bounds)
+{
+	char * start = base;
+	char * end = start + bounds;
+	uintptr_t page;
+	uint64_t hash;
+
+	if(lowest == NULL || start < lowest)
+	{
+		lowest = start;
+	}
+	if(end > highest)
+	{
+		highest = end;
+	}
+
+	for(page = (uintptr_t)start >> PAGE_SHIFT; page <= (uintptr_t)end >> PAGE_SHIFT; page++)
+	{
+		hash = page_hash(page);
+		set_bit(first_bit(hash));
+		set_bit(second_bit(hash));
+	}
+}
+
+/*
+ * Starts over with just what's in the tree now. The tree's
+ * in order walk uses the parent links, so there's no recursion.
+ */
+static void rebuild(node * top)
+{
+	node * current = top;
+	node * parent;
+
+	memset(bits, 0, sizeof(bits));
+	bits_set = 0;
+	lowest = NULL;
+	highest = NULL;
+
+	if(current == NULL)
+	{
+		return;
+	}
+	while(node_child(current, LEFT_CHILD) != NULL)
+	{
+		current = node_child(current, LEFT_CHILD);
+	}
+
+	while(current != NULL)
+	{
+		mark(node_base(current), node_bounds(current));
+
+		if(node_child(current, RIGHT_CHILD) != NULL)
+		{
+			current = node_child(current, RIGHT_CHILD);
+			while(node_child(current, LEFT_CHILD) != NULL)
+			{
+				current = node_child(current, LEFT_CHILD);
+			}
+			continue;
+		}
+		parent = node_parent(current);
+		while(parent != NULL && current == node_child(parent, RIGHT_CHILD))
+		{
+			current = parent;
+			parent = node_parent(current);
+		}
+		current = parent;
+	}
+}
+
+void page_filter_add(void * base, size_t bounds)
+{
+	mark(base, bounds);
+	if(bits_set > rebuild_at)
+	{
+		rebuild(tree_backend->top());
+		/*
+		 * If the tree itself fills most of the filter, rebuilding
+		 * again soon won't help - wait until it's doubled.
+		 */
+		rebuild_at = bits_set * 2 > PAGE_FILTER_BITS / 2 ? bits_set * 2 : PAGE_FILTER_BITS / 2;
+	}
+}
+
+int page_filter_rejects(void * ptr)
+{
+	char * p = ptr;
+	uint64_t hash;
+
+#ifdef MALLOC537_HEAPS
+	/*
+	 * Private heaps' blocks never go in the filter.
+	 */
+	if(current_tree != &default_tree)
+	{
+		return 0;
+	}
+#endif
+
+	/*
+	 * An empty tree has its own complaint.
+	 */
+	if(lowest == NULL)
+	{
+		return 0;
+	}
+	if(p < lowest || p > highest)
+	{
+		return 1;
+	}
+	hash = page_hash((uintptr_t)p >> PAGE_SHIFT);
+	return !test_bit(first_bit(hash)) || !test_bit(second_bit(hash));
+}
@@ -0,0 +1,38 @@
+/*
+ * pagefilter.h
+ * A quick "never allocated" test, so a stack or global pointer handed to
+ * memcheck537 or free537 doesn't cost a walk over the whole tree.
+ *
+ * Every block the tree holds (live or freed) is inside [lowest, highest],
+ * and every page it touches is set in a Bloom filter, two bits per page.
+ * Blocks are only ever added, so a pointer the filter turns down is
+ * certainly not in the tree; one it lets through is looked up like before.
+ * When half the filter's bits are set, it's rebuilt from the tree.
+ *
+ * Caller holds the tree lock.
+ */
+#ifndef PAGEFILTER_H
+#define PAGEFILTER_H
+
+#include <stddef.h>
+
+/*
+ * Filter size in bits (a power of two). 2^20 bits is 128KB, good for a
+ * few hundred thousand pages of heap before most pointers get through.
+ */
+#ifndef PAGE_FILTER_BITS
+#define PAGE_FILTER_BITS (1u << 20)
+#endif
+
+/*
+ * A block just went into the tree.
+ */
+void page_filter_add(void * base, size_t bounds);
+
+/*
+ * 1 if ptr can't be inside (or one past the end of) anything in the tree.
+ * Always 0 while the tree's empty.
+ */
+int page_filter_rejects(void * ptr);
+
+#endif
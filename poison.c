@@ -0,0 +1,155 @@
+/*
+ * poison.c
+ * Vectorized fill/compare kernels, see poison.h.
+ */
+#include <string.h>
+#include "poison.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define POISON_X86
+#endif
+
+/*
+ * Plain versions. Also used for the tail end of the vector ones.
+ */
+static void fill_scalar(unsigned char * start, size_t length, unsigned char byte)
+{
+	memset(start, byte, length);
+}
+
+static size_t find_scalar(const unsigned char * start, size_t length, unsigned char byte)
+{
+	size_t i;
+	for(i = 0; i < length; i++)
+	{
+		if(start[i] != byte)
+		{
+			return i;
+		}
+	}
+	return length;
+}
+
+#ifdef POISON_X86
+static void fill_sse2(unsigned char * start, size_t length, unsigned char byte)
+{
+	__m128i pattern = _mm_set1_epi8((char)byte);
+	size_t i = 0;
+
+	for(; i + 16 <= length; i += 16)
+	{
+		_mm_storeu_si128((__m128i *)(start + i), pattern);
+	}
+	fill_scalar(start + i, length - i, byte);
+}
+
+/*
+ * Compare 16 bytes at a time, and only look closer at a chunk
+ * once its compare mask says something in it doesn't match.
+ */
+static size_t find_sse2(const unsigned char * start, size_t length, unsigned char byte)
+{
+	__m128i pattern = _mm_set1_epi8((char)byte);
+	size_t i = 0;
+	unsigned int mask;
+
+	for(; i + 16 <= length; i += 16)
+	{
+		mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(start + i)), pattern));
+		if(mask != 0xffff)
+		{
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + find_scalar(start + i, length - i, byte);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(unsigned char * start, size_t length, unsigned char byte)
+{
+	__m256i pattern = _mm256_set1_epi8((char)byte);
+	size_t i = 0;
+
+	for(; i + 32 <= length; i += 32)
+	{
+		_mm256_storeu_si256((__m256i *)(start + i), pattern);
+	}
+	fill_scalar(start + i, length - i, byte);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const unsigned char * start, size_t length, unsigned char byte)
+{
+	__m256i pattern = _mm256_set1_epi8((char)byte);
+	size_t i = 0;
+	unsigned int mask;
+
+	for(; i + 32 <= length; i += 32)
+	{
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(start + i)), pattern));
+		if(mask != 0xffffffffu)
+		{
+			return i + __builtin_ctz(~mask);
+		}
+	}
+	return i + find_scalar(start + i, length - i, byte);
+}
+#endif
+
+static void (*fill_kernel)(unsigned char *, size_t, unsigned char);
+static size_t (*find_kernel)(const unsigned char *, size_t, unsigned char);
+
+/*
+ * Picks the best kernels this CPU can run.
+ * Every thread picks the same ones, so racing on this is harmless.
+ */
+static void pick_kernels()
+{
+#ifdef POISON_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		find_kernel = find_avx2;
+		fill_kernel = fill_avx2;
+	}
+	else
+	{
+		find_kernel = find_sse2;
+		fill_kernel = fill_sse2;
+	}
+#else
+	find_kernel = find_scalar;
+	fill_kernel = fill_scalar;
+#endif
+}
+
+void pattern_fill(void * start, size_t length, unsigned char byte)
+{
+	if(fill_kernel == NULL)
+	{
+		pick_kernels();
+	}
+	fill_kernel(start, length, byte);
+}
+
+size_t pattern_find(const void * start, size_t length, unsigned char byte)
+{
+	if(find_kernel == NULL)
+	{
+		pick_kernels();
+	}
+	return find_kernel(start, length, byte);
+}
+
+size_t pattern_count(const void * start, size_t length, unsigned char byte)
+{
+	const unsigned char * bytes = start;
+	size_t count = 0;
+	size_t i;
+	for(i = 0; i < length; i++)
+	{
+		count += (bytes[i] != byte);
+	}
+	return count;
+}
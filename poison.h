@@ -0,0 +1,31 @@
+/*
+ * poison.h
+ * Fill a range with one byte, and find the first byte in a range that
+ * isn't that byte. Used for poisoning freed blocks and for canaries,
+ * so they need to run at about memset speed on big blocks: on x86 these
+ * use AVX2 when the CPU has it, SSE2 otherwise (picked the first time
+ * through), and plain loops everywhere else.
+ */
+#ifndef POISON_H
+#define POISON_H
+
+#include <stddef.h>
+
+/*
+ * What freed blocks get filled with.
+ */
+#define POISON_BYTE 0xdf
+
+void pattern_fill(void * start, size_t length, unsigned char byte);
+
+/*
+ * Offset of the first byte that isn't byte, or length if they all are.
+ */
+size_t pattern_find(const void * start, size_t length, unsigned char byte);
+
+/*
+ * How many bytes in the range aren't byte. Slow - for error messages.
+ */
+size_t pattern_count(const void * start, size_t length, unsigned char byte);
+
+#endif
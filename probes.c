@@ -0,0 +1,23 @@
+/*
+ * probes.c
+ * The semaphores tracers bump while they're attached to
+ * one of our probes, see probes.h.
+ */
+#include "probes.h"
+
+#ifdef PROBES_ON
+
+#define SEMAPHORE(name) \
+	unsigned short malloc537_##name##_semaphore __attribute__((section(".probes")))
+
+SEMAPHORE(malloc);
+SEMAPHORE(free);
+SEMAPHORE(realloc);
+SEMAPHORE(memcheck_pass);
+SEMAPHORE(memcheck_fail);
+SEMAPHORE(insert_rotate);
+SEMAPHORE(delete_rotate);
+SEMAPHORE(node_create);
+SEMAPHORE(node_delete);
+
+#endif
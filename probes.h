@@ -0,0 +1,86 @@
+/*
+ * probes.h
+ * USDT probes for perf, bpftrace and SystemTap (build with
+ * -DMALLOC537_PROBES, needs <sys/sdt.h> from systemtap-sdt-dev;
+ * without it the probes compile to nothing). Each probe is a single
+ * NOP until a tracer attaches. Arguments that cost something to work
+ * out (tree depths) are only worked out while someone's attached,
+ * which each probe's semaphore (probes.c) tells us. Depth is -1
+ * otherwise.
+ *
+ * Provider malloc537:
+ *  malloc(ptr, size)                       malloc537 returned ptr
+ *  free(ptr)                               free537 passed
+ *  realloc(old, new, size)                 realloc537 moved old to new
+ *  memcheck_pass(ptr, size, base, depth)   memcheck537 found the range in
+ *                                          the block at base, depth down
+ *  memcheck_fail(ptr, size)                memcheck537 is about to quit
+ *  insert_rotate(base, depth)              clean_tree rotated at base
+ *  delete_rotate(base, depth)              delete_rearrangement rotated
+ *  node_create(base, bounds, depth)        a node went into the tree
+ *  node_delete(base, bounds, depth)        a node's coming out
+ * e.g. bpftrace -e 'usdt:./prog:malloc537:insert_rotate { @[arg1] = count(); }'
+ *
+ * Checks the inline memcheck537 in malloc537.h answers never
+ * reach the library, so they don't fire anything.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stddef.h>
+#include "rbtree.h"
+
+#if defined(MALLOC537_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_ON
+#endif
+#endif
+
+#ifdef PROBES_ON
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern unsigned short malloc537_malloc_semaphore;
+extern unsigned short malloc537_free_semaphore;
+extern unsigned short malloc537_realloc_semaphore;
+extern unsigned short malloc537_memcheck_pass_semaphore;
+extern unsigned short malloc537_memcheck_fail_semaphore;
+extern unsigned short malloc537_insert_rotate_semaphore;
+extern unsigned short malloc537_delete_rotate_semaphore;
+extern unsigned short malloc537_node_create_semaphore;
+extern unsigned short malloc537_node_delete_semaphore;
+
+#define PROBE_ENABLED(name) __builtin_expect(malloc537_##name##_semaphore != 0, 0)
+#define PROBE1(name, a) DTRACE_PROBE1(malloc537, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(malloc537, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(malloc537, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(malloc537, name, a, b, c, d)
+#else
+#define PROBE_ENABLED(name) 0
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+/*
+ * How far n is below the top of the tree.
+ */
+static inline int probe_depth(node * n)
+{
+	int depth = 0;
+
+	while(node_parent(n) != NULL)
+	{
+		n = node_parent(n);
+		depth++;
+	}
+	return depth;
+}
+
+/*
+ * n's depth for probe name, if anyone's listening.
+ */
+#define PROBE_DEPTH(name, n) (PROBE_ENABLED(name) ? probe_depth(n) : -1)
+
+#endif
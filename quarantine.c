@@ -0,0 +1,149 @@
+/*
+ * quarantine.c
+ * Poison-on-free quarantine, see quarantine.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "quarantine.h"
+#include "poison.h"
+
+typedef struct held_block
+{
+	void * base;
+	size_t bounds;
+}held_block;
+
+/*
+ * FIFO of held blocks, as a ring that doubles when it fills.
+ */
+static held_block * held;
+static size_t held_capacity;
+static size_t held_head;
+static size_t held_count;
+static size_t held_bytes;
+static size_t budget;
+
+/*
+ * Where quarantine_verify_some picks up, counting from the oldest block.
+ */
+static size_t verify_next;
+
+/*
+ * Reads the budget from the environment the first time through.
+ */
+static void setup()
+{
+	char * env = getenv("MALLOC537_QUARANTINE_BYTES");
+	budget = env != NULL ? (size_t)strtoull(env, NULL, 0) : QUARANTINE_BYTES;
+}
+
+static void grow_ring()
+{
+	size_t new_capacity = held_capacity ? held_capacity * 2 : 1024;
+	held_block * new_held = malloc(new_capacity * sizeof(held_block));
+	size_t i;
+
+	if(new_held == NULL)
+	{
+		printf("Couldn't grow the quarantine to %lu blocks!\n", (unsigned long)new_capacity);
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < held_count; i++)
+	{
+		new_held[i] = held[(held_head + i) % held_capacity];
+	}
+	free(held);
+	held = new_held;
+	held_capacity = new_capacity;
+	held_head = 0;
+}
+
+int quarantine_verify(void * base, size_t bounds)
+{
+	size_t first = pattern_find(base, bounds, POISON_BYTE);
+	if(first == bounds)
+	{
+		return 0;
+	}
+
+	printf("Pointer at %p of size %d was written to after it was freed! %d bytes changed, the first at offset %d.\n", base, (int)bounds, (int)pattern_count(base, bounds, POISON_BYTE), (int)first);
+	return 1;
+}
+
+/*
+ * Checks the oldest block and really frees it.
+ * Returns what quarantine_verify said.
+ */
+static int evict()
+{
+	held_block oldest = held[held_head];
+	int damaged;
+
+	held_head = (held_head + 1) % held_capacity;
+	held_count--;
+	held_bytes -= oldest.bounds;
+
+	damaged = quarantine_verify(oldest.base, oldest.bounds);
+	free(oldest.base);
+	return damaged;
+}
+
+void quarantine_add(void * base, size_t bounds)
+{
+	if(held == NULL)
+	{
+		setup();
+	}
+
+	pattern_fill(base, bounds, POISON_BYTE);
+
+	if(held_count == held_capacity)
+	{
+		grow_ring();
+	}
+	held[(held_head + held_count) % held_capacity].base = base;
+	held[(held_head + held_count) % held_capacity].bounds = bounds;
+	held_count++;
+	held_bytes += bounds;
+
+	/*
+	 * Writing to freed memory is an error like any other, so we quit.
+	 */
+	while(held_bytes > budget && held_count > 0)
+	{
+		if(evict())
+		{
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * This also runs at exit, so it just reports - no quitting from here.
+ */
+void quarantine_drain()
+{
+	while(held_count > 0)
+	{
+		evict();
+	}
+}
+
+int quarantine_verify_some(size_t count)
+{
+	int damaged = 0;
+	held_block * block;
+
+	while(count > 0 && held_count > 0)
+	{
+		if(verify_next >= held_count)
+		{
+			verify_next = 0;
+		}
+		block = &held[(held_head + verify_next) % held_capacity];
+		damaged += quarantine_verify(block->base, block->bounds);
+		verify_next++;
+		count--;
+	}
+	return damaged;
+}
@@ -0,0 +1,50 @@
+/*
+ * quarantine.h
+ * Poison-on-free (build with -DMALLOC537_QUARANTINE).
+ * Instead of going straight back to free(), a freed block is filled with
+ * POISON_BYTE and held here. Once the held blocks add up to more than the
+ * budget (MALLOC537_QUARANTINE_BYTES in the environment, or
+ * QUARANTINE_BYTES), the oldest ones are checked - any byte that isn't
+ * poison anymore means someone wrote to it after free - and then really
+ * freed.
+ */
+#ifndef QUARANTINE_H
+#define QUARANTINE_H
+
+#include <stddef.h>
+
+#ifndef QUARANTINE_BYTES
+#define QUARANTINE_BYTES (16 * 1024 * 1024)
+#endif
+
+/*
+ * Poisons the block and holds on to it, checking and freeing
+ * older blocks if we're over budget.
+ * Caller holds the tree lock.
+ */
+void quarantine_add(void * base, size_t bounds);
+
+/*
+ * Checks and frees everything still held. malloc537.c calls it at
+ * exit, after the background verifier has stopped.
+ * Caller holds the tree lock.
+ */
+void quarantine_drain();
+
+/*
+ * Checks one held block's poison without freeing it.
+ * Returns 0 if it's intact; otherwise prints what changed and
+ * returns 1. Used for the eviction check, and by anything else
+ * that wants to look over the quarantine.
+ */
+int quarantine_verify(void * base, size_t bounds);
+
+/*
+ * Checks the poison on up to count held blocks, carrying on from where
+ * the last call left off. Returns how many were damaged (each one
+ * already printed). For the background verifier.
+ * Caller holds the tree lock.
+ */
+int quarantine_verify_some(size_t count);
+
+#endif
@@ -6,47 +6,113 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "rbtree.h"
+#include "backend.h"
 
-#define LEFT_CHILD 0
-#define RIGHT_CHILD 1
+#ifdef MALLOC537_COMPACT_NODES
+#include <sys/mman.h>
+#endif
+
+#ifdef MALLOC537_HASH_INDEX
+#include "hashindex.h"
+#endif
+
+#ifdef MALLOC537_LIFETIME
+#include "lifetime.h"
+#endif
+
+#include "probes.h"
+#include "report537.h"
+
+/*
+ * The root of our tree is current_tree->root (backend.h),
+ * so every heap can have its own.
+ */
+node * rbtree_root()
+{
+	return current_tree->root;
+}
+
+const index_backend rbtree_backend =
+{
+	"rbtree",
+	lookup,
+	bounds_lookup,
+	contained_lookup,
+	insert,
+	delete_node,
+	remove_range,
+	rbtree_build,
+	rbtree_root,
+	1
+};
+
+#ifdef MALLOC537_COMPACT_NODES
+/*
+ * How many nodes the compact arena can ever hold.
+ * The reservation is MAP_NORESERVE, so only the pages we
+ * actually hand out cost any memory.
+ */
+#ifndef NODE_ARENA_NODES
+#define NODE_ARENA_NODES (1u << 28)
+#endif
+
+node * node_arena;
+
+/*
+ * Next never-used slot, and a list of deleted slots
+ * threaded through their left child index.
+ */
+static uint32_t arena_next = 1;
+static uint32_t arena_free_list = 0;
+
+#ifdef MALLOC537_HEAPS
+#include <pthread.h>
 
 /*
- * This is the root of our tree!
- * Or maybe this should be in the malloc file???
+ * Every heap's nodes come from the one arena, and heaps don't
+ * share a lock, so the arena has its own.
  */
-node * root;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOCK_ARENA() pthread_mutex_lock(&arena_lock)
+#define UNLOCK_ARENA() pthread_mutex_unlock(&arena_lock)
+#else
+#define LOCK_ARENA()
+#define UNLOCK_ARENA()
+#endif
+#endif
 
 /*These two functions help rotate our tree when we delete a node. It makes the correct
  *connections to parent's, children, etc.*/
 void rotate_l(node * lnode)
 {
-        node * templ = NULL;
-
-	templ = lnode->children[1];
-        change_node(lnode, templ);
-        lnode->children[1] = templ->children[LEFT_CHILD];
-        if (templ->children[0] != NULL)
-        {
-                templ->children[0]->parent = lnode;
-        }
-        templ->children[LEFT_CHILD] = lnode;
-        lnode->parent = templ;
+	node * templ = NULL;
+
+	templ = node_child(lnode, RIGHT_CHILD);
+	change_node(lnode, templ);
+	set_child(lnode, RIGHT_CHILD, node_child(templ, LEFT_CHILD));
+	if (node_child(templ, LEFT_CHILD) != NULL)
+	{
+		set_parent(node_child(templ, LEFT_CHILD), lnode);
+	}
+	set_child(templ, LEFT_CHILD, lnode);
+	set_parent(lnode, templ);
 
 }
 
 void rotate_r(node * rnode)
 {
-        node * temp = NULL;
-
-	temp = rnode->children[0];
-        change_node(rnode, temp);
-        rnode->children[0] = temp->children[RIGHT_CHILD];
-        if (temp->children[RIGHT_CHILD]!= NULL)
-        {
-                temp->children[1]->parent = rnode;
-        }
-        temp->children[1] = rnode;
-        rnode->parent = temp;
+	node * temp = NULL;
+
+	temp = node_child(rnode, LEFT_CHILD);
+	change_node(rnode, temp);
+	set_child(rnode, LEFT_CHILD, node_child(temp, RIGHT_CHILD));
+	if (node_child(temp, RIGHT_CHILD) != NULL)
+	{
+		set_parent(node_child(temp, RIGHT_CHILD), rnode);
+	}
+	set_child(temp, RIGHT_CHILD, rnode);
+	set_parent(rnode, temp);
 
 }
 
@@ -57,13 +123,17 @@ node * lookup(void * base)
 	 * Just calls the recursive function
 	 * on the root of the tree.
 	 */
-	if(root == NULL)
+	if(current_tree->root == NULL)
 	{
 		printf("root is null\n");
 		exit(EXIT_FAILURE);
 	}
 
-	return lookup_r(base, root);
+#ifdef MALLOC537_HASH_INDEX
+	return hash_lookup(&current_tree->index, base);
+#else
+	return lookup_r(base, current_tree->root);
+#endif
 }
 
 node * lookup_r(void * base, node * parent)
@@ -78,35 +148,35 @@ node * lookup_r(void * base, node * parent)
 	{
 		return NULL;
 	}
-	
-	else if(parent->base == NULL)
+
+	else if(node_base(parent) == NULL)
 	{
 		printf("bad node encountered.");
 		return NULL;
 	}
 
-	else if((parent->base == base))
+	else if((node_base(parent) == base))
 	{
 		return parent;
 	}
 	/*
 	 * Call on the left (smaller) child if this node's base is too big!
 	 */
-	else if(parent->base > base)
+	else if(node_base(parent) > base)
 	{
-		if(parent->children[LEFT_CHILD] != NULL)
+		if(node_child(parent, LEFT_CHILD) != NULL)
 		{
-			return lookup_r(base, parent->children[LEFT_CHILD]);
+			return lookup_r(base, node_child(parent, LEFT_CHILD));
 		}
 	}
-	/* 
+	/*
 	 * Call on right (larger) child if this node's base is too small!
 	 */
 	else
 	{
-		if(parent->children[RIGHT_CHILD] != NULL)
+		if(node_child(parent, RIGHT_CHILD) != NULL)
 		{
-			return lookup_r(base,  parent->children[RIGHT_CHILD]);
+			return lookup_r(base,  node_child(parent, RIGHT_CHILD));
 		}
 	}
 
@@ -118,15 +188,52 @@ node * lookup_r(void * base, node * parent)
 
 node * bounds_lookup(void * base)
 {
-	return bounds_lookup_r(base, root);
+	node * found = bounds_lookup_r(base, current_tree->root);
+	node * current = current_tree->root;
+	node * floor = NULL;
+
+	if(found != NULL)
+	{
+		return found;
+	}
+
+	/*
+	 * No live block has it. If the node at or below the address
+	 * is a freed block that does, that's the one to report.
+	 */
+	while(current != NULL)
+	{
+		if(node_base(current) <= base)
+		{
+			floor = current;
+			current = node_child(current, RIGHT_CHILD);
+		}
+		else
+		{
+			current = node_child(current, LEFT_CHILD);
+		}
+	}
+	if(floor != NULL && node_free(floor) && (size_t)base <= (size_t)node_base(floor) + node_bounds(floor))
+	{
+		return floor;
+	}
+	return NULL;
 }
 
 node * bounds_lookup_r(void * base, node * parent)
 {
+	/*
+	 * Fell off the bottom of the tree (or the tree is empty).
+	 */
+	if(parent == NULL)
+	{
+		return NULL;
+	}
+
 	/*
 	 * If our base equals the parent's base, return the parent.
 	 */
-	if(base == parent->base && !(parent->free))
+	else if(base == node_base(parent) && !node_free(parent))
 	{
 		return parent;
 	}
@@ -136,9 +243,9 @@ node * bounds_lookup_r(void * base, node * parent)
 	 * Return the parent if we are.
 	 * Otherwise, continue our search.
 	 */
-	else if(base >= parent->base)
+	else if(base >= node_base(parent))
 	{
-		if((size_t)base <= ((size_t)parent->base + parent->bounds) && !(parent->free))
+		if((size_t)base <= ((size_t)node_base(parent) + node_bounds(parent)) && !node_free(parent))
 		{
 			return parent;
 		}
@@ -150,11 +257,11 @@ node * bounds_lookup_r(void * base, node * parent)
 
 			node * left_search = NULL;
 			node * right_search = NULL;
-			if(parent->children[LEFT_CHILD] != NULL)
-			left_search = bounds_lookup_r(base, parent->children[LEFT_CHILD]);
-			
-			if(parent->children[RIGHT_CHILD] != NULL)
-			right_search = bounds_lookup_r(base, parent->children[RIGHT_CHILD]);
+			if(node_child(parent, LEFT_CHILD) != NULL)
+			left_search = bounds_lookup_r(base, node_child(parent, LEFT_CHILD));
+
+			if(node_child(parent, RIGHT_CHILD) != NULL)
+			right_search = bounds_lookup_r(base, node_child(parent, RIGHT_CHILD));
 
 			if(right_search != NULL)
 			{
@@ -172,13 +279,13 @@ node * bounds_lookup_r(void * base, node * parent)
 	 */
 	else
 	{
-		return bounds_lookup_r(base, parent->children[LEFT_CHILD]);
+		return bounds_lookup_r(base, node_child(parent, LEFT_CHILD));
 	}
 }
 
 node * contained_lookup(void * base, size_t bounds)
 {
-	return contained_lookup_r(base, bounds, root);
+	return contained_lookup_r(base, bounds, current_tree->root);
 }
 
 node * contained_lookup_r(void * base, size_t bounds, node * parent)
@@ -189,36 +296,11 @@ node * contained_lookup_r(void * base, size_t bounds, node * parent)
 	if(parent == NULL)
 	return NULL;
 
-	/*
-	 * If the current node's base is too small, look at the right child.
-	 */
-	/*
-	else if(((long)(parent->base) + parent->bounds) < (long)base)
-	{
-		
-		if(parent->children[RIGHT_CHILD] != NULL)
-		return contained_lookup_r(base, bounds, parent->children[RIGHT_CHILD]);
-		else
-		return NULL;
-	}
-	*/
-	/*
-	 * If the current node's base is too big, look at the left child.
-	 */
-	/*
-	else if(((long)(base) + bounds) < (long)parent->base)
-	{
-		if(parent->children[LEFT_CHILD] != NULL)
-		return contained_lookup_r(base, bounds, parent->children[LEFT_CHILD]);
-		else
-		return NULL;
-	}
-	*/
 	/*
 	 * If our node's base is in range, check the size and return if it's small enough and free.
 	 * Otherwise, check both children if the exist.
 	 */
-	else if(parent->base > base && ((long)parent->base + parent->bounds) < ((long)base + bounds) && (parent->free == 1))
+	else if(node_base(parent) > base && ((long)node_base(parent) + node_bounds(parent)) < ((long)base + bounds) && node_free(parent))
 	{
 		return parent;
 	}
@@ -232,11 +314,11 @@ node * contained_lookup_r(void * base, size_t bounds, node * parent)
 		node * left_return = NULL;
 		node * right_return = NULL;
 
-		if(parent->children[LEFT_CHILD] != NULL)
-		left_return = contained_lookup_r(base, bounds, parent->children[LEFT_CHILD]);
-		
-		if(parent->children[RIGHT_CHILD] != NULL)
-		right_return = contained_lookup_r(base, bounds, parent->children[RIGHT_CHILD]);
+		if(node_child(parent, LEFT_CHILD) != NULL)
+		left_return = contained_lookup_r(base, bounds, node_child(parent, LEFT_CHILD));
+
+		if(node_child(parent, RIGHT_CHILD) != NULL)
+		right_return = contained_lookup_r(base, bounds, node_child(parent, RIGHT_CHILD));
 
 		if(left_return != NULL)
 		return left_return;
@@ -264,10 +346,15 @@ int insert(void * base, size_t bounds)
 	 * For an empty tree, we create a black node,
 	 * and insert it as the tree's root!
 	 */
-	if(root == NULL)
+	if(current_tree->root == NULL)
 	{
-		root = temp;
-		root->red = 0;
+		current_tree->root = temp;
+		set_red(current_tree->root, 0);
+#ifdef MALLOC537_HASH_INDEX
+		hash_insert(&current_tree->index, base, temp);
+#endif
+		live_add(bounds);
+		PROBE3(node_create, base, bounds, 0);
 		return 1;
 	}
 
@@ -275,16 +362,29 @@ int insert(void * base, size_t bounds)
 	 * Otherwise, pass along our created node
 	 * to our recursive insert function.
 	 */
-	insert_return = insert_r(base, bounds, root, temp);
+	insert_return = insert_r(base, bounds, current_tree->root, temp);
 	if(insert_return < 0)
 	{
 		printf("Error on insert_r return!\n");
+		destroy(temp);
 		return insert_return;
 	}
+	live_add(bounds);
 
-	/*DEBUG - print the tree here. we're lazy.
-	print(root, 0); */
+	/*
+	 * insert_r reused an old freed node at this base,
+	 * so temp never made it into the tree.
+	 */
+	if(node_parent(temp) == NULL)
+	{
+		destroy(temp);
+		return 1;
+	}
 
+#ifdef MALLOC537_HASH_INDEX
+	hash_insert(&current_tree->index, base, temp);
+#endif
+	PROBE3(node_create, base, bounds, PROBE_DEPTH(node_create, temp));
 
 	/*
 	 * And now, we clean up our messy tree!
@@ -297,11 +397,6 @@ int insert(void * base, size_t bounds)
 		return clean_tree_return;
 	}
 
-	/*print the node we've added.
-	printf("red = %d node at %p with base %p size %i, parent %p, and children %p %p\n",temp->red, (void *)temp ,temp->base, (int)temp->bounds, (void *)temp->parent, (void *)temp->children[LEFT_CHILD], (void *)temp->children[RIGHT_CHILD]);
-	*/
-
-
 	/*
 	 * Return 1 on a success.
 	 */
@@ -313,7 +408,7 @@ int insert_r(void * base, size_t bounds, node * parent, node * temp)
 {
 	/*
 	 * We always want to insert at the
- bottom of the tree,
+	 * bottom of the tree,
 	 * so we insert the node at the bottom first,
 	 * then fix problems!
 	 */
@@ -323,17 +418,20 @@ int insert_r(void * base, size_t bounds, node * parent, node * temp)
 	 * as long as it's been freed, otherwise
 	 * return -1 (error).
 	 */
-	if(parent->base == base)
+	if(node_base(parent) == base)
 	{
-		if(parent->free)
+		if(node_free(parent))
 		{
-			parent->bounds = bounds;
-			parent->free = 0;
+			set_bounds(parent, bounds);
+			set_free(parent, 0);
+#ifdef MALLOC537_LIFETIME
+			set_stamp(parent, lifetime_now());
+#endif
 			return 1;
 		}
 		else
 		{
-			printf("Error on malloc537\nOccupied node with address %p already exists! How did this happen?\n", base);
+			printf(REPORT537_OCCUPIED, base);
 			return -1;
 		}
 	}
@@ -345,52 +443,50 @@ int insert_r(void * base, size_t bounds, node * parent, node * temp)
 	 * Otherwise, call insert_r on that right node!
 	 * Recursion!
 	 */
-	else if(parent->base < base)
+	else if(node_base(parent) < base)
 	{
-		if(parent->children[RIGHT_CHILD] != NULL)
+		if(node_child(parent, RIGHT_CHILD) != NULL)
 		{
-			return insert_r(base, bounds, parent->children[RIGHT_CHILD], temp);
+			return insert_r(base, bounds, node_child(parent, RIGHT_CHILD), temp);
 		}
 		else
 		{
-			parent->children[RIGHT_CHILD] = temp;
-			temp->parent = parent;
+			set_child(parent, RIGHT_CHILD, temp);
+			set_parent(temp, parent);
 			return 1;
 		}
 	}
-	
+
 	/*
 	 * The only thing left is to check the left node!
 	 * Insert a new node if it's empty, or call insert_r
 	 * with the left node as parent.
 	 */
 
-	else if(parent->base > base)
+	else if(node_base(parent) > base)
 	{
-		if(parent->children[LEFT_CHILD] != NULL)
+		if(node_child(parent, LEFT_CHILD) != NULL)
 		{
-			return insert_r(base, bounds, parent->children[LEFT_CHILD], temp);
+			return insert_r(base, bounds, node_child(parent, LEFT_CHILD), temp);
 		}
 		else
 		{
-			parent->children[LEFT_CHILD] = temp;
-			temp->parent = parent;
+			set_child(parent, LEFT_CHILD, temp);
+			set_parent(temp, parent);
 			return 1;
 		}
 	}
 
-
-
-
 	return 0;
 }
 
 int clean_tree(node * child)
 {
+	node * parent;
+	node * gparent;
+	node * uncle;
+	int side;
 
-	node * tempNode;
-	node * tempGparent;
-	int whichChild = 0;
 	/*
 	 * And here's the fun part!
 	 * Now we check for a violation of red-black tree properties!
@@ -400,484 +496,506 @@ int clean_tree(node * child)
 	 * Modeled on CS 367 lecture notes
 	 */
 
+	parent = node_parent(child);
+
 	/*
-	 * If the child's parent is black, we're fine!
+	 * We made it all the way up - the root is always black.
 	 */
+	if(parent == NULL)
+	{
+		set_red(child, 0);
+		return 1;
+	}
 
-	
-	if((child->parent == NULL) || !(child->parent->red))
+	/*
+	 * If the child's parent is black, we're fine!
+	 */
+	if(!node_red(parent))
 	{
 		return 1;
 	}
-	else
+
+	/*
+	 * A red parent is never the root, so the grandparent exists.
+	 * side is which child of the grandparent our parent is.
+	 */
+	gparent = node_parent(parent);
+	side = (node_child(gparent, LEFT_CHILD) == parent) ? LEFT_CHILD : RIGHT_CHILD;
+	uncle = node_child(gparent, !side);
+
+	/*
+	 * If the child's parent and the parent's sibling is red, just change their color to black and
+	 * change the grandparent to red, then fix up from the grandparent.
+	 */
+	if(node_red(uncle))
 	{
-		/*	printf("red = %d node at %p with base %p size %i, parent %p, and children %p %p\n",root->red, (void *)root,root->base, (int)root->bounds, (void *)root->parent, (void *)root->children[LEFT_CHILD], (void *)root->children[RIGHT_CHILD]);
+		set_red(parent, 0);
+		set_red(uncle, 0);
+		set_red(gparent, 1);
+		return clean_tree(gparent);
+	}
 
-		 * If the child's parent and the parent's sibling is red, just change their color to black and
-		 * change the grandparent to red. If the grandparent is the root node, then just keep it
-		 * as black to keep the red/black properties
-	 	*/	
-		
-		/*
-		 * We need to handle insertion when the depth is low - i.e. we don't have enough nodes
-		 * to actually have grandparents/great grandparents.
-		 */
+	/*
+	 * If the child is an inside grandchild (left of a right, or right of a left),
+	 * rotate it up over the parent so it becomes the outside case.
+	 */
+	if(node_child(parent, !side) == child)
+	{
+		PROBE2(insert_rotate, node_base(parent), PROBE_DEPTH(insert_rotate, parent));
+		if(side == LEFT_CHILD)
+		rotate_l(parent);
+		else
+		rotate_r(parent);
 
-		/*NEED TO CHECK IF A CHILD/PARENT EXISTS BEFORE USING IT!*/
+		child = parent;
+		parent = node_parent(child);
+	}
 
-		if(child->parent->parent == NULL)
-		{
-			return 1;
-		}
-		
+	/*
+	 * Outside grandchild: recolor and rotate the grandparent down.
+	 * rotate_l/rotate_r take care of the great grandparent's link
+	 * (and the root) through change_node.
+	 */
+	set_red(parent, 0);
+	set_red(gparent, 1);
+	PROBE2(insert_rotate, node_base(gparent), PROBE_DEPTH(insert_rotate, gparent));
+	if(side == LEFT_CHILD)
+	rotate_r(gparent);
+	else
+	rotate_l(gparent);
 
-		/* if the grandparent has two children, and they're both red*/
-		if((child->parent->parent->children[0] != NULL) && (child->parent->parent->children[1] != NULL) && (child->parent->parent->children[0]->red == 1) && (child->parent->parent->children[1]->red == 1)){
-			
-			child->parent->parent->children[0]->red = 0;
-			child->parent->parent->children[1]->red = 0;
+	return 1;
+}
 
-			/* if the grandparent is the root node, we're done!*/
-			if(child->parent->parent->parent == NULL){
+int delete_node (void * base)
+{
+	node * temp = NULL;
 
-				return 1;
+	temp = lookup(base);
+	/*printf("Deleting node at %p\n", (void *)temp);*/
+	if (temp == NULL)
+	{
+		printf("You cannot delete a node for a base that is not in the tree.");
+		return -1;
+	}
+	delete_found(temp);
+	return 1;
+}
 
-			}
-			
-			/*otherwise we change the grandparent's color to red and do a recursive call on that node*/
-			else{
+void delete_found(node * temp)
+{
+	node * child = NULL;
+	node * parent = NULL;
+	node * successor = NULL;
+	int removed_red;
 
-				child->parent->parent->red = 1;
-				return clean_tree(child->parent->parent);
-		
-			}
+#ifdef MALLOC537_HASH_INDEX
+	hash_remove(&current_tree->index, node_base(temp));
+#endif
+	PROBE3(node_delete, node_base(temp), node_bounds(temp), PROBE_DEPTH(node_delete, temp));
+	removed_red = node_red(temp);
 
+	/*
+	 * Zero or one children: the child (maybe NULL) just takes our place.
+	 */
+	if (node_child(temp, LEFT_CHILD) == NULL)
+	{
+		child = node_child(temp, RIGHT_CHILD);
+		parent = node_parent(temp);
+		change_node(temp, child);
+	}
+	else if (node_child(temp, RIGHT_CHILD) == NULL)
+	{
+		child = node_child(temp, LEFT_CHILD);
+		parent = node_parent(temp);
+		change_node(temp, child);
+	}
+	/*
+	 * Two children: splice out the in order successor (smallest node on the right),
+	 * and move it into our spot. Nodes keep their identity, only links change.
+	 */
+	else
+	{
+		successor = node_child(temp, RIGHT_CHILD);
+		while (node_child(successor, LEFT_CHILD) != NULL)
+		{
+			successor = node_child(successor, LEFT_CHILD);
 		}
+		removed_red = node_red(successor);
+		child = node_child(successor, RIGHT_CHILD);
 
-		/*If this node is the left child of a left child, then we need to restructure*/
-		if((child->parent->parent->children[0] != NULL) && (child->parent->children[0] != NULL) && (child->parent->parent->children[0] == child->parent) && (child == child->parent->children[0]) )		
+		if (node_parent(successor) == temp)
 		{
-			child->parent->red = 0;
-			child->parent->parent->red = 1;
-
-			tempGparent = child->parent->parent;
-			
-			/*If the grandparent's parent is null, it is the root*/
-			if (child->parent->parent->parent == NULL)
-			{
-
-				root = child->parent;
-
-			}
-			/*Otherwise we set the great grandparents left child to the parent*/
-			else
-			{			
-	
-				child->parent->parent->parent->children[0] = child->parent;
-
-			}
-			
-			/*TODO Do not know if this next line is valid. maybe???*/
-			child->parent->parent = child->parent->parent->parent;
-			tempGparent->children[0] = child->parent->children[1];
-			if (child->parent->children[1] != NULL)
-			{
-
-				child->parent->children[1]->parent = tempGparent;
-
-			}
-			
-			child->parent->children[1] = tempGparent;
-			tempGparent->parent = child->parent;
-			
-			return 1;
-
+			parent = successor;
 		}
-
-		/*If this node is the right child of a right child, then we need to restructure*/
-		if((child->parent->parent->children[1] != NULL) && (child->parent->children[1] != NULL) && (child->parent->parent->children[1] == child->parent) && (child == child->parent->children[1]) )		
+		else
 		{
-	
-			/*Set parent to black and grandparent to red*/
-			child->parent->red = 0;
-			child->parent->parent->red = 1;
-			
-			tempGparent = child->parent->parent;
-			
-			/*If the grandparent's parent is null, our parent becomes the root*/
-			if (child->parent->parent->parent == NULL)
-			{
-
-				root = child->parent;
-				/*something heree???*/
+			parent = node_parent(successor);
+			change_node(successor, child);
+			set_child(successor, RIGHT_CHILD, node_child(temp, RIGHT_CHILD));
+			set_parent(node_child(successor, RIGHT_CHILD), successor);
+		}
 
-			}
-			/*Otherwise we set the great grandparents right child to the parent*/
-			else
-			{			
-	
-				child->parent->parent->parent->children[1] = child->parent;
+		change_node(temp, successor);
+		set_child(successor, LEFT_CHILD, node_child(temp, LEFT_CHILD));
+		set_parent(node_child(successor, LEFT_CHILD), successor);
+		set_red(successor, node_red(temp));
+	}
 
-			}
-			
-			/*TODO Do not know if this next line is valid. What I want to do is to
-			 	set the parent's parent field equal to the granparent's parent. this will
-				break the connection but will we get the information before it is lost?*/
-			child->parent->parent = child->parent->parent->parent;
-			
-			/*Set the granparents right child to the parents left. RBT rules make this okay*/
-			tempGparent->children[1] = child->parent->children[0];
-			
-			/*If the parent's left child is not null, we set it's parent to the gparent*/
-			if (child->parent->children[0] != NULL)
-			{
+	/*If the node we actually spliced out is red, we are finished. If it is black, we have to
+	 *rearrange the tree*/
+	if (!removed_red)
+	{
+		delete_rearrangement(child, parent);
+	}
 
-				child->parent->children[0]->parent = tempGparent;
+	destroy(temp);
+}
 
-			}
-			/*set parents left child to the grandparent*/
-			child->parent->children[0] = tempGparent;
-			
-			/*Set the temporary grandparent's parent to the parent of our child*/
-			tempGparent->parent = child->parent;
-			
-			return 1;
+/*
+ * Next node in order, using the parent links.
+ */
+static node * next_node(node * current)
+{
+	node * parent;
 
-		}
-		/*If the parent is a left child, and the child is a right child*/
-		if((child->parent->children[1] != NULL) && (child->parent->parent->children[0] != NULL) && (child == child->parent->children[1]) && (child->parent->parent->children[0] == child->parent))
+	if(node_child(current, RIGHT_CHILD) != NULL)
+	{
+		current = node_child(current, RIGHT_CHILD);
+		while(node_child(current, LEFT_CHILD) != NULL)
 		{
-			/*Change this node's color to black and set the granparent to red*/
-			child->red = 0;
-			child->parent->parent->red = 1;
-			
-			
-			/*Create temporary node to store grandparent's parent*/
-			tempNode = child->parent->parent->parent;
-
-			/*
-			 * Also need to find which child the grandparent was! 0 is left, 1 is right
-			 * This defaults to 0, so just set to 1 if it's a right child.
-			 */
-			if(child->parent->parent->parent->children[RIGHT_CHILD] == child->parent->parent)
-			whichChild = 1;
-
-
-			/*set the grandparent to the child's right child. Then we set the gparent's (now the child's child) left child to NULL and parent to child */
-			child->parent->parent->children[0] = child->children[1]; 			
-			child->children[1] = child->parent->parent;
-			child->children[1]->parent = child;
-			if(child->children[1]->children[0] != NULL)
-			child->children[1]->children[0]->parent = child->children[1];
-
-			/*set the parent to the child's left child. Then we set the parents right child to NULL and it's parent to the child*/
-			child->parent->children[1] = child->children[0];
-			child->children[0] = child->parent;
-			child->children[0]->parent = child;
-			if(child->children[0]->children[1] != NULL)
-			child->children[0]->children[1]->parent = child->children[0];
-			
-			/*If the grandparent's parent was null, then we set the child to the root*/
-			if (tempNode == NULL)
-			{
-
-				child->parent = NULL;
-				root = child;	
-	
-			}
-			/*Otherwise we set the child's parent to the grandparents parent*/
-			if (tempNode != NULL)
-			{
+			current = node_child(current, LEFT_CHILD);
+		}
+		return current;
+	}
 
-				child->parent = tempNode;
-				tempNode->children[whichChild] = child;
+	parent = node_parent(current);
+	while(parent != NULL && current == node_child(parent, RIGHT_CHILD))
+	{
+		current = parent;
+		parent = node_parent(current);
+	}
+	return parent;
+}
 
-			}
+int remove_range(void * base, size_t bounds)
+{
+	node * current = current_tree->root;
+	node * next = NULL;
+	node * temp;
+	int removed = 0;
 
-			
-			return 1;
+	/*
+	 * Only nodes with a base inside the range can be covered,
+	 * so go down once to the smallest base above the start...
+	 */
+	while(current != NULL)
+	{
+		if(node_base(current) > base)
+		{
+			next = current;
+			current = node_child(current, LEFT_CHILD);
 		}
-		/*If the parent is a right child and the child is a left child*/
-		if((child->parent->children[0] != NULL) && (child->parent->parent->children[1] != NULL) && (child == child->parent->children[0]) && (child->parent->parent->children[1] == child->parent))
+		else
 		{
-			/*Change this node's color to black and set the granparent to red*/
-			child->red = 0;
-			child->parent->parent->red = 1;
-			
-			/*Create temporary node to store grandparent's parent*/
-			tempNode = child->parent->parent->parent;
-
-			/*
-			 * Also need to find which child the grandparent was! 0 is left, 1 is right
-			 * This defaults to 0, so just set to 1 if it's a right child.
-			 */
-			if(child->parent->parent->parent->children[RIGHT_CHILD] == child->parent->parent)
-			whichChild = 1;
-
-			
-			/*set the grandparent to the child's left child. Then we set the gparent's (now the child's child) right child to NULL and parent to child */
-			child->parent->parent->children[1] = child->children[0]; 
-			child->children[0] = child->parent->parent;
-			child->children[0]->parent = child;
-			if(child->children[0]->children[1] != NULL)
-			child->children[0]->children[1]->parent = child->children[0];
-
-
-			/*set the parent to the child's right child. Then we set the parents left child to NULL and it's parent to the child*/
-
-			child->parent->children[0] = child->children[1];
-			child->children[1] = child->parent;
-			child->children[1]->parent = child;
-			if(child->children[1]->children[0] != NULL)
-			child->children[1]->children[0]->parent = child->children[1];
-
-			
-			/*If the grandparent's parent was null, then we set the child to the root*/
-			if (tempNode == NULL)
-			{
-
-				child->parent = NULL;
-				root = child;	
-	
-			}
-			/*Otherwise we set the child's parent to the grandparents parent*/
-			if (tempNode != NULL)
-			{
-
-				child->parent = tempNode;
-				tempNode->children[whichChild] = child;
-
-
-			}
-			return 1;
+			current = node_child(current, RIGHT_CHILD);
 		}
 	}
 
-	return 0;
-}
-
-int delete_node (void * base)
-{
-        node * child = NULL;
-        node * temp = NULL;
-        temp = lookup(base);
-	printf("Deleting node at %p\n", (void *)temp);
-        if (temp == NULL)
-        {
-                printf("You cannot delete a node for a base that is not in the tree.");
-        }
-        /*If node to be deleted has 2 children, give that node the value of its in order
- *          *predecessor. We will then delete that node.
- *                   */
-        if (temp->children[LEFT_CHILD] != NULL && temp->children[RIGHT_CHILD] != NULL)
-        {
-                node * predecessor = NULL;
-                predecessor = temp;
-                while (predecessor->children[RIGHT_CHILD] != NULL)
-                {
-                        predecessor = predecessor->children[RIGHT_CHILD];
-                }
-                temp->base = predecessor->base;
-                temp->bounds = predecessor->bounds;                
-                temp = predecessor;
-        }
-        /*creating child node. We will repalce our temporary node with it later*/
-        if (temp->children[LEFT_CHILD] == NULL)
-        {
-                child = temp->children[RIGHT_CHILD];
-        }
-
-        if (temp->children[RIGHT_CHILD] == NULL)
-        {
-                child = temp->children[LEFT_CHILD];
-        }
-
-        /*If the node we are now deleting (temp) is red, we are finished. If it is black, we have to 
- *          *rearrange the tree*/
-        if (temp->red == 0)
-        {
-                temp->red = child->red;
-                delete_rearrangement(temp);
-        }
-
-	change_node(temp, child);
-	free(temp);
-	return 1;
+	/*
+	 * ...and walk forwards from there. Deleting only relinks nodes,
+	 * the rest keep their place in order, so we can grab the next
+	 * one before the current one goes.
+	 */
+	while(next != NULL && (size_t)node_base(next) < (size_t)base + bounds)
+	{
+		temp = next;
+		next = next_node(next);
+		if(node_free(temp) && (size_t)node_base(temp) + node_bounds(temp) < (size_t)base + bounds)
+		{
+			delete_found(temp);
+			removed++;
+		}
+	}
+	return removed;
 }
 
 
 
-void delete_rearrangement(node * node)
+void delete_rearrangement(node * child, node * parent)
 {
-        /*if the node has become the root, we are fine.*/
-
-        if (node->parent == NULL)
-        {
-                return;
-        }
-	/*In these next two cases (mirror images of each other), node has a red sibling. We will change the
-	 *color of n's sibling and rotate around the parent of node. This will not fix the problem, but instead
-	 * it makes it so we can fix it later*/
-        if(node->parent->children[0] == node)
-        {
-		if (node->parent->children[1]->red == 1)
-		{
-			node->parent->children[1]->red = 0;
-			node->parent->red = 1;
-			rotate_l(node->parent);
-		}
-        
-        }
+	node * sibling;
+	int side;
 
-	/*As mentioned above, this is a mirror image of the previous case*/
-	if(node->parent->children[1] == node)
-        {
-		if (node->parent->children[0]->red == 1)
+	/*if the node has become the root, or it's red, just color it black and we are fine.*/
+	if (parent == NULL || node_red(child))
+	{
+		if (child != NULL)
 		{
-			node->parent->children[0]->red = 0;
-			node->parent->red = 1;
-			rotate_r(node->parent);
+			set_red(child, 0);
 		}
-        
-        }
-	
-	/*The next two cases are mirror imgages of each other. If node's parent, sibling and siblings kids
-	 *are all black, we color it's sibling red and run a recursive call on N's parent*/
-	if(node->parent->children[0] == node)
-        {
-			if ((node->parent->red == 0) && (node->parent->children[RIGHT_CHILD]->red == 0) && (node->parent->children[RIGHT_CHILD]->children[LEFT_CHILD]->red == 0) && (node->parent->children[RIGHT_CHILD]->children[RIGHT_CHILD]->red == 0))
-			{
-				node->parent->children[RIGHT_CHILD]->red = 1;
-				delete_rearrangement(node->parent);
-			}
-	}
-	/*Mirror image of the previous case*/
-	if(node->parent->children[1] == node)
-        {
-			if ((node->parent->red == 0) && (node->parent->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[RIGHT_CHILD]->red == 0))
-			{
-				node->parent->children[LEFT_CHILD]->red = 1;
-				delete_rearrangement(node->parent);
-			}
+		return;
 	}
-	/*The node's parent is red, and it's sibling, and sibling's children are black. We simply exchange the
-	 * color of the node's*/
-	if(node->parent->children[0] == node)
-        {
-			if ((node->parent->red == 1) && (node->parent->children[RIGHT_CHILD]->red == 0) && (node->parent->children[RIGHT_CHILD]->children[LEFT_CHILD]->red == 0) && (node->parent->children[RIGHT_CHILD]->children[RIGHT_CHILD]->red == 0))
-			{
-				node->parent->red = 0;				
-				node->parent->children[RIGHT_CHILD]->red = 1;
-				
-			}
-	}
-	/*Mirror image*/
-	if(node->parent->children[1] == node)
-        {
-			if ((node->parent->red == 1) && (node->parent->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[RIGHT_CHILD]->red == 0))
-			{
-				node->parent->red = 0;				
-				node->parent->children[LEFT_CHILD]->red = 1;
-			}
-	}
-	/*The node's sibling is black, and it's(the child's sibling's) left child is red and right is black
-	 *We switch the color of the sibling and and its left sibling and rotate_r*/
-	if(node->parent->children[0] == node)
-        {
-			if ((node->parent->children[RIGHT_CHILD]->red == 0) && (node->parent->children[RIGHT_CHILD]->children[LEFT_CHILD]->red == 1) && (node->parent->children[RIGHT_CHILD]->children[RIGHT_CHILD]->red == 0))
-			{
-				node->parent->children[1]->red = 1;
-				node->parent->children[1]->children[LEFT_CHILD]->red = 0;
-				rotate_r(node->parent->children[1]);
-				delete_rearrangement(node);
-			}
+
+	side = (node_child(parent, LEFT_CHILD) == child) ? LEFT_CHILD : RIGHT_CHILD;
+	sibling = node_child(parent, !side);
+
+	/*Our node has a red sibling. We will change the color of the sibling
+	 *and rotate around the parent. This will not fix the problem, but instead
+	 *it makes it so we can fix it later*/
+	if (node_red(sibling))
+	{
+		set_red(sibling, 0);
+		set_red(parent, 1);
+		PROBE2(delete_rotate, node_base(parent), PROBE_DEPTH(delete_rotate, parent));
+		if (side == LEFT_CHILD)
+		rotate_l(parent);
+		else
+		rotate_r(parent);
+		sibling = node_child(parent, !side);
 	}
-	/*Mirror Image*/
-	if(node->parent->children[1] == node)
-        {
-			if ((node->parent->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[LEFT_CHILD]->red == 0) && (node->parent->children[LEFT_CHILD]->children[RIGHT_CHILD]->red == 1))
-			{
-				node->parent->children[0]->red = 1;
-				node->parent->children[0]->children[RIGHT_CHILD]->red = 0;
-				rotate_l(node->parent->children[0]);
-				delete_rearrangement(node);
-			}
+
+	/*If the sibling and siblings kids are all black, we color the sibling red
+	 *and run a recursive call on the parent*/
+	if (!node_red(node_child(sibling, LEFT_CHILD)) && !node_red(node_child(sibling, RIGHT_CHILD)))
+	{
+		set_red(sibling, 1);
+		delete_rearrangement(parent, node_parent(parent));
+		return;
 	}
-	/*The node's sibling is balck and that's sibling's right child is red. In this case the node
-	 *to be deleted is the left child of it's parent. We switch the color of our nodes parent
-	 * and our nodes sibling and rotate_l at our node's parent.*/
-	if((node->parent->children[0] == node) && (node->parent->children[1]->red == node->red))
-        {
-		node->parent->red = 0;
-		node->parent->children[1]->red = 0;
-		rotate_l(node->parent);	
-	}
-	/*mirror image of above*/
-	if((node->parent->children[1] == node) && (node->parent->children[0]->red == node->red))
-        {
-		node->parent->red = 0;
-		node->parent->children[0]->red = 0;
-		rotate_r(node->parent);	
+
+	/*The sibling's far child is black, so the near one is red.
+	 *We switch the color of the sibling and its near child and rotate it outwards*/
+	if (!node_red(node_child(sibling, !side)))
+	{
+		set_red(node_child(sibling, side), 0);
+		set_red(sibling, 1);
+		PROBE2(delete_rotate, node_base(sibling), PROBE_DEPTH(delete_rotate, sibling));
+		if (side == LEFT_CHILD)
+		rotate_r(sibling);
+		else
+		rotate_l(sibling);
+		sibling = node_child(parent, !side);
 	}
+
+	/*The sibling's far child is red. The sibling takes the parent's color,
+	 *and we rotate at the parent. That fixes the missing black.*/
+	set_red(sibling, node_red(parent));
+	set_red(parent, 0);
+	set_red(node_child(sibling, !side), 0);
+	PROBE2(delete_rotate, node_base(parent), PROBE_DEPTH(delete_rotate, parent));
+	if (side == LEFT_CHILD)
+	rotate_l(parent);
+	else
+	rotate_r(parent);
 }
 /*Change node takes a node and removes the connections from it's parent, replacing it with
  *the new node*/
 void change_node(node * old, node * new)
 {
-        if (old->parent == NULL)
-        {
-                root = new;
-        }
-        else
-        {
-                if(old == old->parent->children[LEFT_CHILD])
-                {
-                        old->parent->children[LEFT_CHILD] = new;
-                        
-                }
-
-                else
-                {
-                        old->parent->children[RIGHT_CHILD] = new;
-                }
-        }
-        if (new != NULL)
-        {
-                new->parent = old->parent;
-        }
+	if (node_parent(old) == NULL)
+	{
+		current_tree->root = new;
+	}
+	else
+	{
+		if(old == node_child(node_parent(old), LEFT_CHILD))
+		{
+			set_child(node_parent(old), LEFT_CHILD, new);
+		}
+
+		else
+		{
+			set_child(node_parent(old), RIGHT_CHILD, new);
+		}
+	}
+	if (new != NULL)
+	{
+		set_parent(new, node_parent(old));
+	}
 }
 
 node * create(void * base, size_t bounds)
 {
 	node * temp;
+#ifndef MALLOC537_COMPACT_NODES
 	temp = malloc(sizeof(node));
-	temp->base = base;
-	temp->bounds = bounds;
-	temp->red = 1;
-	temp->free = 0;
 	temp->parent = NULL;
 	temp->children[LEFT_CHILD] = NULL;
 	temp->children[RIGHT_CHILD] = NULL;
+	temp->red = 1;
+	temp->free = 0;
+#else
+	LOCK_ARENA();
+
+	/*
+	 * Reserve the arena the first time through.
+	 */
+	if(node_arena == NULL)
+	{
+		node_arena = mmap(NULL, (size_t)NODE_ARENA_NODES * sizeof(node), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(node_arena == MAP_FAILED)
+		{
+			printf("Couldn't reserve the node arena!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(arena_free_list != 0)
+	{
+		temp = node_at(arena_free_list);
+		arena_free_list = temp->children[LEFT_CHILD];
+	}
+	else if(arena_next < NODE_ARENA_NODES)
+	{
+		temp = node_at(arena_next++);
+	}
+	else
+	{
+		printf("Out of nodes in the node arena!\n");
+		exit(EXIT_FAILURE);
+	}
+	UNLOCK_ARENA();
+	temp->base_word = 0;
+	temp->parent_word = NODE_RED_BIT;
+	temp->children[LEFT_CHILD] = 0;
+	temp->children[RIGHT_CHILD] = 0;
+#endif
+	set_base(temp, base);
+	set_bounds(temp, bounds);
+#ifdef MALLOC537_LIFETIME
+	set_stamp(temp, lifetime_now());
+#endif
+#ifdef MALLOC537_HEATMAP
+	set_site(temp, NULL);
+#endif
+#ifdef MALLOC537_TAGS
+	set_tag(temp, 0);
+	set_tag_link(temp, TAG_PREV, NULL);
+	set_tag_link(temp, TAG_NEXT, NULL);
+#endif
 	return temp;
 }
 
+node * build_subtree(index_entry * entries, size_t count, node * parent, int depth, int red_depth)
+{
+	size_t middle = count / 2;
+	node * temp;
+
+	if(count == 0)
+	{
+		return NULL;
+	}
+
+	temp = create(entries[middle].base, entries[middle].bounds);
+#ifdef MALLOC537_LIFETIME
+	set_stamp(temp, entries[middle].stamp);
+#endif
+	set_red(temp, depth == red_depth);
+	set_parent(temp, parent);
+#ifdef MALLOC537_HASH_INDEX
+	hash_insert(&current_tree->index, node_base(temp), temp);
+#endif
+
+	/*
+	 * Halves that differ by at most one, so every leaf is on
+	 * one of the last two levels.
+	 */
+	set_child(temp, LEFT_CHILD, build_subtree(entries, middle, temp, depth + 1, red_depth));
+	set_child(temp, RIGHT_CHILD, build_subtree(entries + middle + 1, count - middle - 1, temp, depth + 1, red_depth));
+	return temp;
+}
+
+void rbtree_build(index_entry * entries, size_t count)
+{
+	int bottom = 0;
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		live_add(entries[i].bounds);
+	}
+	while(((size_t)2 << bottom) <= count)
+	{
+		bottom++;
+	}
+	/*
+	 * Red on the bottom level balances the black heights of the
+	 * paths that end a level short. The root has to stay black.
+	 */
+	current_tree->root = build_subtree(entries, count, NULL, 0, bottom > 0 ? bottom : -1);
+}
+
+void destroy(node * old)
+{
+#ifndef MALLOC537_COMPACT_NODES
+	free(old);
+#else
+	LOCK_ARENA();
+	old->children[LEFT_CHILD] = arena_free_list;
+	arena_free_list = node_index(old);
+	UNLOCK_ARENA();
+#endif
+}
+
 void print(node * root, int depth)
 {
+	node * current = root;
+	node * parent;
 	int i;
-	if(root->children[LEFT_CHILD] != NULL)
-	print(root->children[LEFT_CHILD], depth + 1);
-	for(i = 0; i < depth; i++)
+
+	if(current == NULL)
+	{
+		return;
+	}
+	while(node_child(current, LEFT_CHILD) != NULL)
 	{
-		printf(".");
+		current = node_child(current, LEFT_CHILD);
+		depth++;
 	}
 
-	printf("red = %d, free = %d node at %p with base %p size %i, parent %p, and children %p %p\n",root->red, root->free, (void *)root,root->base, (int)root->bounds, (void *)root->parent, (void *)root->children[LEFT_CHILD], (void *)root->children[RIGHT_CHILD]);
+	while(current != NULL)
+	{
+		for(i = 0; i < depth; i++)
+		{
+			printf(".");
+		}
+
+		printf("red = %d, free = %d node at %p with base %p size %i, parent %p, and children %p %p\n",node_red(current), node_free(current), (void *)current,node_base(current), (int)node_bounds(current), (void *)node_parent(current), (void *)node_child(current, LEFT_CHILD), (void *)node_child(current, RIGHT_CHILD));
 
-	if(root->children[RIGHT_CHILD] != NULL)
-	print(root->children[RIGHT_CHILD], depth + 1);
+		if(node_child(current, RIGHT_CHILD) != NULL)
+		{
+			current = node_child(current, RIGHT_CHILD);
+			depth++;
+			while(node_child(current, LEFT_CHILD) != NULL)
+			{
+				current = node_child(current, LEFT_CHILD);
+				depth++;
+			}
+			continue;
+		}
+
+		/*
+		 * Back up past every right child, and once more to the next
+		 * node in order - unless that takes us out of root's subtree.
+		 */
+		parent = node_parent(current);
+		while(current != root && current == node_child(parent, RIGHT_CHILD))
+		{
+			current = parent;
+			parent = node_parent(current);
+			depth--;
+		}
+		if(current == root)
+		{
+			return;
+		}
+		current = parent;
+		depth--;
+	}
 }
 
 void print_func()
 {
-	print(root, 0);
+	print(current_tree->root, 0);
 }
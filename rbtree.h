@@ -9,7 +9,11 @@
  * and
  * http://videolectures.net/mit6046jf05_demaine_lec10/
  */
+#ifndef RBTREE_H
+#define RBTREE_H
+
 #include <sys/types.h>
+#include <stdint.h>
 
 /*
  * Use these constants to get which child you want!
@@ -17,6 +21,8 @@
 #define LEFT_CHILD 0
 #define RIGHT_CHILD 1
 
+#ifndef MALLOC537_COMPACT_NODES
+
 typedef struct node
 {
 	struct node * parent;
@@ -25,8 +31,189 @@ typedef struct node
 	size_t bounds;
 	int free;
 	int red;
+#ifdef MALLOC537_LIFETIME
+	uint64_t stamp;
+#endif
+#ifdef MALLOC537_TAGS
+	struct node * tag_links[2];
+	unsigned long tag;
+#endif
+#ifdef MALLOC537_HEATMAP
+	void * site;
+#endif
 }node;
 
+/*
+ * Field accessors. Everything outside of create() goes through
+ * these, so the compact layout below can be swapped in at build time.
+ * A NULL node is a black leaf!
+ */
+#define node_parent(n) ((n)->parent)
+#define node_child(n, which) ((n)->children[(which)])
+#define node_base(n) ((n)->base)
+#define node_bounds(n) ((n)->bounds)
+#define node_free(n) ((n)->free)
+#define node_red(n) ((n) != NULL && (n)->red)
+#define set_parent(n, p) ((n)->parent = (p))
+#define set_child(n, which, c) ((n)->children[(which)] = (c))
+#define set_base(n, b) ((n)->base = (b))
+#define set_bounds(n, b) ((n)->bounds = (b))
+#define set_free(n, f) ((n)->free = (f))
+#define set_red(n, r) ((n)->red = (r))
+#define node_tag_link(n, which) ((n)->tag_links[(which)])
+#define set_tag_link(n, which, l) ((n)->tag_links[(which)] = (l))
+
+#else
+
+/*
+ * Compact node layout, built with -DMALLOC537_COMPACT_NODES.
+ * 24 bytes instead of 48 (plus malloc's own header on every node):
+ *  - nodes live in one reserved arena, so parent and children
+ *    are 32-bit indices into it. Index 0 is NULL.
+ *  - red and free are the top two bits of the parent index.
+ *  - user-space addresses fit in 48 bits, so the top 16 bits of
+ *    the base word hold bits 32-47 of the bounds.
+ * The indices could go up to 2^30, but the arena only reserves room
+ * for NODE_ARENA_NODES (2^28 by default, see rbtree.c), so that's the
+ * most nodes there can be at once; blocks can be up to 2^48 bytes.
+ * Creating a node past that prints "Out of nodes in the node arena!"
+ * and exits.
+ */
+typedef struct node
+{
+	uint64_t base_word;
+	uint32_t bounds_lo;
+	uint32_t parent_word;
+	uint32_t children[2];
+#ifdef MALLOC537_LIFETIME
+	uint64_t stamp;
+#endif
+#ifdef MALLOC537_TAGS
+	uint32_t tag_links[2];
+	uint64_t tag;
+#endif
+#ifdef MALLOC537_HEATMAP
+	void * site;
+#endif
+}node;
+
+#define NODE_RED_BIT 0x80000000u
+#define NODE_FREE_BIT 0x40000000u
+#define NODE_INDEX_MASK 0x3fffffffu
+#define NODE_BASE_MASK 0x0000ffffffffffffull
+
+/*
+ * The arena is reserved up front (but only touched as it grows)
+ * so node pointers never move.
+ */
+extern node * node_arena;
+
+static inline node * node_at(uint32_t index)
+{
+	return index ? node_arena + index : NULL;
+}
+
+static inline uint32_t node_index(node * n)
+{
+	return n ? (uint32_t)(n - node_arena) : 0;
+}
+
+static inline node * node_parent(node * n)
+{
+	return node_at(n->parent_word & NODE_INDEX_MASK);
+}
+
+static inline node * node_child(node * n, int which)
+{
+	return node_at(n->children[which]);
+}
+
+static inline void * node_base(node * n)
+{
+	return (void *)(uintptr_t)(n->base_word & NODE_BASE_MASK);
+}
+
+static inline size_t node_bounds(node * n)
+{
+	return (size_t)n->bounds_lo | (size_t)((n->base_word >> 48) << 32);
+}
+
+static inline int node_free(node * n)
+{
+	return (n->parent_word & NODE_FREE_BIT) != 0;
+}
+
+static inline int node_red(node * n)
+{
+	return n != NULL && (n->parent_word & NODE_RED_BIT) != 0;
+}
+
+static inline void set_parent(node * n, node * p)
+{
+	n->parent_word = (n->parent_word & ~NODE_INDEX_MASK) | node_index(p);
+}
+
+static inline void set_child(node * n, int which, node * c)
+{
+	n->children[which] = node_index(c);
+}
+
+static inline void set_base(node * n, void * base)
+{
+	n->base_word = (n->base_word & ~NODE_BASE_MASK) | ((uint64_t)(uintptr_t)base & NODE_BASE_MASK);
+}
+
+static inline void set_bounds(node * n, size_t bounds)
+{
+	n->bounds_lo = (uint32_t)bounds;
+	n->base_word = (n->base_word & NODE_BASE_MASK) | ((uint64_t)((bounds >> 32) & 0xffff) << 48);
+}
+
+static inline void set_free(node * n, int f)
+{
+	n->parent_word = f ? (n->parent_word | NODE_FREE_BIT) : (n->parent_word & ~NODE_FREE_BIT);
+}
+
+static inline void set_red(node * n, int r)
+{
+	n->parent_word = r ? (n->parent_word | NODE_RED_BIT) : (n->parent_word & ~NODE_RED_BIT);
+}
+
+#ifdef MALLOC537_TAGS
+static inline node * node_tag_link(node * n, int which)
+{
+	return node_at(n->tag_links[which]);
+}
+
+static inline void set_tag_link(node * n, int which, node * l)
+{
+	n->tag_links[which] = node_index(l);
+}
+#endif
+
+#endif
+
+/*
+ * When the node went into the tree, with -DMALLOC537_LIFETIME.
+ */
+#define node_stamp(n) ((n)->stamp)
+#define set_stamp(n, s) ((n)->stamp = (s))
+
+/*
+ * With -DMALLOC537_TAGS: the block's tag (0 for none), and the previous
+ * and next blocks with the same tag (see tags.h).
+ */
+#define TAG_PREV 0
+#define TAG_NEXT 1
+#define node_tag(n) ((n)->tag)
+#define set_tag(n, t) ((n)->tag = (t))
+
+/*
+ * Where the block was allocated, with -DMALLOC537_HEATMAP.
+ */
+#define node_site(n) ((n)->site)
+#define set_site(n, s) ((n)->site = (s))
+
 /*
  * Finds a node with a given base.
  * Returns null for a non-existant node!
@@ -43,7 +230,9 @@ node * lookup_r(void * base, node * parent);
  * Check if a given base address is contained in a node,
  * returns the node if the node is active (not freed) and
  * and the address is contained in its base/bounds.
- * Ignores free nodes.
+ * Failing that, returns the freed node at or below the address
+ * if it holds it, so callers can tell a use after free from a
+ * stray pointer - check node_free on the result.
  */
 node * bounds_lookup(void * base);
 
@@ -94,10 +283,25 @@ int clean_tree(node * child);
 int delete_node (void * base);
 
 /*
- * Starts the delete function!
+ * delete_node for a node we already have.
+ * Internal function.
+ */
+void delete_found(node * temp);
+
+/*
+ * Deletes every freed node the block at base with the given bounds
+ * covers (the ones contained_lookup would find), in one walk,
+ * and returns how many went.
+ */
+int remove_range(void * base, size_t bounds);
+
+/*
+ * Fixes the tree after a black node is spliced out.
+ * child took the deleted node's place (and may be NULL),
+ * so we need its parent too.
  * Internal function.
  */
-void delete_rearrangement(node * node);
+void delete_rearrangement(node * child, node * parent);
 
 
 /*
@@ -121,7 +325,44 @@ void change_node(node * old, node * new);
 node * create(void * base, size_t bounds);
 
 /*
- * Print the current tree - Recursive!
+ * Gives a node's memory back. Counterpart to create().
+ */
+void destroy(node * old);
+
+/*
+ * A block for a bulk build: see the index backend's build() in backend.h.
+ */
+typedef struct index_entry
+{
+	void * base;
+	size_t bounds;
+#ifdef MALLOC537_LIFETIME
+	uint64_t stamp;
+#endif
+}index_entry;
+
+/*
+ * Makes a balanced tree out of count entries sorted by base, one node
+ * each, under parent, and returns its top. Nodes at depth red_depth
+ * come out red and the rest black - a good red-black tree when that's
+ * the bottom level. Internal function, for the backends' build().
+ */
+node * build_subtree(index_entry * entries, size_t count, node * parent, int depth, int red_depth);
+
+/*
+ * Fills the empty tree with count entries sorted by base, in O(n).
+ */
+void rbtree_build(index_entry * entries, size_t count);
+
+/*
+ * The root, for the index backend table (backend.h).
+ */
+node * rbtree_root();
+
+/*
+ * Print the tree under root, in order, with depth as dots.
+ * Follows the parent links rather than recursing, so a
+ * long chain of a tree is fine.
  */
 void print(node * root, int depth);
 
@@ -131,3 +372,5 @@ void print(node * root, int depth);
  * In-order with depth as .!
  */
 void print_func();
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * redzone.c
+ * Redzone canaries, see redzone.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#define MALLOC537_INTERNAL
+#include "malloc537.h"
+#include "redzone.h"
+#include "poison.h"
+
+/*
+ * Bytes on each side, per size class. Small blocks get the minimum,
+ * and bigger ones get a bit more room for longer overruns.
+ */
+static size_t redzone_sizes[MALLOC537_SIZE_CLASSES] =
+{
+	16, 16, 16, 32, 32, 32, 64, 64, 64, 128, 128, 128, 256, 256, 256, 256
+};
+
+/*
+ * Once a block is out there, its zone size is worked out from its
+ * size class, so the sizes can't change anymore.
+ */
+static int allocated;
+
+void malloc537_set_redzone(int size_class, size_t bytes)
+{
+	if(size_class < 0 || size_class >= MALLOC537_SIZE_CLASSES)
+	{
+		printf("There's no size class %d!\n", size_class);
+		exit(EXIT_FAILURE);
+	}
+	if(allocated)
+	{
+		printf("Redzone sizes have to be set before the first malloc537!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * A multiple of 16 so the user's block stays aligned.
+	 */
+	bytes = (bytes + 15) & ~(size_t)15;
+	if(bytes < 16)
+	{
+		bytes = 16;
+	}
+	if(bytes > REDZONE_MAX)
+	{
+		bytes = REDZONE_MAX;
+	}
+	redzone_sizes[size_class] = bytes;
+}
+
+static size_t zone_for(size_t bounds)
+{
+	return redzone_sizes[malloc537_size_class(bounds)];
+}
+
+void * redzone_alloc(size_t size)
+{
+	size_t zone = zone_for(size);
+	char * real = malloc(zone + size + zone);
+
+	allocated = 1;
+	if(real == NULL)
+	{
+		return NULL;
+	}
+
+	pattern_fill(real, zone, REDZONE_BYTE);
+	pattern_fill(real + zone + size, zone, REDZONE_BYTE);
+	return real + zone;
+}
+
+int redzone_verify(void * base, size_t bounds)
+{
+	size_t zone = zone_for(bounds);
+	char * real = (char *)base - zone;
+	size_t left;
+	size_t right;
+
+	/*
+	 * Both zones are scanned left to right, so for an underrun it's
+	 * the changed byte furthest from the block that gets reported.
+	 */
+	left = pattern_find(real, zone, REDZONE_BYTE);
+	right = pattern_find((char *)base + bounds, zone, REDZONE_BYTE);
+
+	if(left != zone)
+	{
+		printf("Pointer at %p of size %d was underrun! %d redzone bytes in front of it changed, the furthest at offset -%d.\n", base, (int)bounds, (int)pattern_count(real, zone, REDZONE_BYTE), (int)(zone - left));
+	}
+	if(right != zone)
+	{
+		printf("Pointer at %p of size %d was overrun! %d redzone bytes after it changed, the first at offset %d.\n", base, (int)bounds, (int)pattern_count((char *)base + bounds, zone, REDZONE_BYTE), (int)(bounds + right));
+	}
+	return left != zone || right != zone;
+}
+
+void * redzone_real(void * base, size_t bounds)
+{
+	return (char *)base - zone_for(bounds);
+}
+
+size_t redzone_total(size_t bounds)
+{
+	return zone_for(bounds) * 2 + bounds;
+}
@@ -0,0 +1,44 @@
+/*
+ * redzone.h
+ * Redzones around blocks (build with -DMALLOC537_REDZONE).
+ * Every block gets canary bytes on both sides, so an overflow or
+ * underflow shows up when the block is freed, realloced, or when
+ * memcheck537_verify_all runs - no memcheck537 calls needed.
+ *
+ * The real block looks like
+ *   [left canaries][user's block][right canaries]
+ * where each zone is the redzone size for the block's size class
+ * (malloc537_set_redzone, before the first allocation). Only the
+ * user's part goes in the tree.
+ */
+#ifndef REDZONE_H
+#define REDZONE_H
+
+#include <stddef.h>
+
+#define REDZONE_BYTE 0xca
+
+/*
+ * Biggest redzone malloc537_set_redzone will give a size class.
+ */
+#define REDZONE_MAX 4096
+
+/*
+ * Allocates size bytes with redzones around them.
+ * Returns the user's part, or NULL if malloc failed.
+ */
+void * redzone_alloc(size_t size);
+
+/*
+ * Checks the canaries around a block. Returns 0 if they're fine,
+ * otherwise prints what's wrong and returns 1.
+ */
+int redzone_verify(void * base, size_t bounds);
+
+/*
+ * Where the real block starts, and how big it is.
+ */
+void * redzone_real(void * base, size_t bounds);
+size_t redzone_total(size_t bounds);
+
+#endif
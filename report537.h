@@ -0,0 +1,120 @@
+/*
+ * report537.h
+ * Whether a free or a memcheck is good, and the error if it isn't,
+ * worked out from what an index found at and around the pointer.
+ * malloc537.c (for the tree and for huge blocks) and mem537::tracker
+ * in malloc537.hpp both decide here: they only differ in how they find
+ * the blocks, and in what they do with the message.
+ */
+#ifndef REPORT537_H
+#define REPORT537_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A block the way an index sees it.
+ */
+typedef struct report537_block
+{
+	char * base;
+	size_t bounds;
+	int free;
+}report537_block;
+
+/*
+ * Room for any of the messages.
+ */
+#define REPORT537_LENGTH 256
+
+/*
+ * The size for a free that doesn't say how big the block is.
+ */
+#define REPORT537_UNSIZED ((size_t)-1)
+
+#define REPORT537_ZERO_SIZE "Allocating a pointer of size 0\n"
+#define REPORT537_OCCUPIED "Error on malloc537\nOccupied node with address %p already exists! How did this happen?\n"
+
+/*
+ * In both checks, exact is the block based at ptr, live or freed, and
+ * around is the block ptr falls inside: the live one if there is one,
+ * otherwise the freed one below it (what bounds_lookup hands back).
+ * Either can be NULL, and around is only looked at when exact isn't live.
+ */
+
+/*
+ * The checks free537 does. size is what the caller says the block is,
+ * or REPORT537_UNSIZED. Returns exact if it can be freed, otherwise
+ * NULL with the error in message.
+ */
+static inline const report537_block * report537_free(void * ptr, size_t size, const report537_block * exact, const report537_block * around, char * message)
+{
+	if(ptr == NULL)
+	{
+		snprintf(message, REPORT537_LENGTH, "Trying to free a null pointer!\n");
+	}
+	else if(exact != NULL && exact->free)
+	{
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p of previous size %i was already freed!\n", ptr, (int)exact->bounds);
+	}
+	else if(exact != NULL && size != REPORT537_UNSIZED && size != exact->bounds)
+	{
+		snprintf(message, REPORT537_LENGTH, "Freeing pointer at %p as %d bytes, but it was allocated with %d bytes.\n", ptr, (int)size, (int)exact->bounds);
+	}
+	else if(exact != NULL)
+	{
+		return exact;
+	}
+	else if(around != NULL && !around->free)
+	{
+		snprintf(message, REPORT537_LENGTH, "Attempting to free pointer at %p, but that pointer is in memory allocated starting at %p with bounds %d.\n", ptr, (void *)around->base, (int)around->bounds);
+	}
+	else
+	{
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p was never allocated!\n", ptr);
+	}
+	return NULL;
+}
+
+/*
+ * The checks memcheck537 does on [ptr, ptr + size). Returns whichever
+ * of exact and around the range is in, otherwise NULL with the error
+ * in message. The base of a freed block is only good again once a live
+ * block has been allocated over it.
+ */
+static inline const report537_block * report537_range(void * ptr, size_t size, const report537_block * exact, const report537_block * around, char * message)
+{
+	char * start = (char *)ptr;
+
+	if(exact != NULL && !exact->free)
+	{
+		if(size <= exact->bounds)
+		{
+			return exact;
+		}
+		snprintf(message, REPORT537_LENGTH, "Trying to use %d bytes, but the pointer %p only has a size of %d bytes.\n", (int)size, ptr, (int)exact->bounds);
+	}
+	else if(around != NULL && !around->free)
+	{
+		if(start + size <= around->base + around->bounds)
+		{
+			return around;
+		}
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p is inside pointer %p of size %d, but there's not enough room in the allocated space!\n", ptr, (void *)around->base, (int)around->bounds);
+	}
+	else if(exact != NULL)
+	{
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p of previous size %i was already freed!\n", ptr, (int)exact->bounds);
+	}
+	else if(around != NULL)
+	{
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p is in a block at %p of size %d that was already freed!\n", ptr, (void *)around->base, (int)around->bounds);
+	}
+	else
+	{
+		snprintf(message, REPORT537_LENGTH, "Pointer at %p was never allocated!\n", ptr);
+	}
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * splaytree.c
+ * Splay tree index backend, see splaytree.h.
+ * Bottom up splaying, using the parent links the nodes already have.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "splaytree.h"
+#include "backend.h"
+
+#ifdef MALLOC537_HASH_INDEX
+#include "hashindex.h"
+#endif
+
+#ifdef MALLOC537_LIFETIME
+#include "lifetime.h"
+#endif
+
+#include "probes.h"
+#include "report537.h"
+
+/*
+ * The root is current_tree->root (backend.h), like the red-black tree's.
+ */
+#define splay_root (current_tree->root)
+
+const index_backend splay_backend =
+{
+	"splay",
+	splay_lookup,
+	splay_bounds_lookup,
+	splay_contained_lookup,
+	splay_insert,
+	splay_delete_node,
+	splay_remove_range,
+	splay_build,
+	splay_top,
+	0
+};
+
+node * splay_top()
+{
+	return splay_root;
+}
+
+/*
+ * Rotates child up over its parent, whichever side it's on.
+ */
+static void rotate_up(node * child)
+{
+	node * parent = node_parent(child);
+	node * gparent = node_parent(parent);
+	int side = (node_child(parent, LEFT_CHILD) == child) ? LEFT_CHILD : RIGHT_CHILD;
+	node * inner = node_child(child, !side);
+
+	set_child(parent, side, inner);
+	if(inner != NULL)
+	{
+		set_parent(inner, parent);
+	}
+	set_child(child, !side, parent);
+	set_parent(parent, child);
+
+	set_parent(child, gparent);
+	if(gparent == NULL)
+	{
+		splay_root = child;
+	}
+	else if(node_child(gparent, LEFT_CHILD) == parent)
+	{
+		set_child(gparent, LEFT_CHILD, child);
+	}
+	else
+	{
+		set_child(gparent, RIGHT_CHILD, child);
+	}
+}
+
+void splay(node * target)
+{
+	node * parent;
+	node * gparent;
+
+	while((parent = node_parent(target)) != NULL)
+	{
+		gparent = node_parent(parent);
+
+		/*
+		 * Zig: parent is the root, one rotation finishes it.
+		 */
+		if(gparent == NULL)
+		{
+			rotate_up(target);
+		}
+
+		/*
+		 * Zig-zig: both on the same side, rotate the parent first.
+		 */
+		else if((node_child(parent, LEFT_CHILD) == target) == (node_child(gparent, LEFT_CHILD) == parent))
+		{
+			rotate_up(parent);
+			rotate_up(target);
+		}
+
+		/*
+		 * Zig-zag: rotate the target up twice.
+		 */
+		else
+		{
+			rotate_up(target);
+			rotate_up(target);
+		}
+	}
+}
+
+/*
+ * Walks down towards base. Returns the node with exactly that base,
+ * or NULL; *last is the last node we looked at either way.
+ */
+static node * descend(void * base, node ** last)
+{
+	node * current = splay_root;
+
+	*last = NULL;
+	while(current != NULL)
+	{
+		*last = current;
+		if(node_base(current) == base)
+		{
+			return current;
+		}
+		current = node_child(current, node_base(current) > base ? LEFT_CHILD : RIGHT_CHILD);
+	}
+	return NULL;
+}
+
+/*
+ * In order neighbour (RIGHT_CHILD for the next one, LEFT_CHILD
+ * for the one before), using the parent links.
+ */
+static node * neighbour(node * current, int side)
+{
+	node * parent;
+
+	if(node_child(current, side) != NULL)
+	{
+		current = node_child(current, side);
+		while(node_child(current, !side) != NULL)
+		{
+			current = node_child(current, !side);
+		}
+		return current;
+	}
+
+	parent = node_parent(current);
+	while(parent != NULL && current == node_child(parent, side))
+	{
+		current = parent;
+		parent = node_parent(current);
+	}
+	return parent;
+}
+
+node * splay_lookup(void * base)
+{
+	node * found;
+	node * last;
+
+	/*
+	 * Same as the red-black tree - an empty tree here is a bug.
+	 */
+	if(splay_root == NULL)
+	{
+		printf("root is null\n");
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef MALLOC537_HASH_INDEX
+	found = hash_lookup(&current_tree->index, base);
+	last = found;
+#else
+	found = descend(base, &last);
+#endif
+	if(last != NULL)
+	{
+		splay(last);
+	}
+	return found;
+}
+
+node * splay_bounds_lookup(void * base)
+{
+	node * current = splay_root;
+	node * floor = NULL;
+	node * freed = NULL;
+	node * last = NULL;
+	size_t reach;
+
+	/*
+	 * Biggest base at or below the address.
+	 */
+	while(current != NULL)
+	{
+		last = current;
+		if(node_base(current) <= base)
+		{
+			floor = current;
+			current = node_child(current, RIGHT_CHILD);
+		}
+		else
+		{
+			current = node_child(current, LEFT_CHILD);
+		}
+	}
+
+	/*
+	 * Live blocks never overlap, so the only one that can hold the address
+	 * is the first live one at or below it. Freed nodes in between are
+	 * skipped, but no further back than the biggest live block can reach.
+	 * If no live block has it, a freed one at the floor that does is
+	 * the answer instead, like bounds_lookup in rbtree.c.
+	 */
+	if(floor != NULL && node_free(floor) && (size_t)base <= (size_t)node_base(floor) + node_bounds(floor))
+	{
+		freed = floor;
+	}
+	reach = live_reach();
+	while(floor != NULL && node_free(floor) && (size_t)base - (size_t)node_base(floor) <= reach)
+	{
+		floor = neighbour(floor, LEFT_CHILD);
+	}
+
+	if(floor != NULL && !node_free(floor) && (size_t)base <= (size_t)node_base(floor) + node_bounds(floor))
+	{
+		splay(floor);
+		return floor;
+	}
+	if(freed != NULL)
+	{
+		splay(freed);
+		return freed;
+	}
+
+	if(last != NULL)
+	{
+		splay(last);
+	}
+	return NULL;
+}
+
+node * splay_contained_lookup(void * base, size_t bounds)
+{
+	node * current = splay_root;
+	node * next = NULL;
+
+	/*
+	 * Smallest base above the start of the range, then forwards
+	 * until we're past its end.
+	 */
+	while(current != NULL)
+	{
+		if(node_base(current) > base)
+		{
+			next = current;
+			current = node_child(current, LEFT_CHILD);
+		}
+		else
+		{
+			current = node_child(current, RIGHT_CHILD);
+		}
+	}
+
+	while(next != NULL && (size_t)node_base(next) < (size_t)base + bounds)
+	{
+		if(node_free(next) && (size_t)node_base(next) + node_bounds(next) < (size_t)base + bounds)
+		{
+			return next;
+		}
+		next = neighbour(next, RIGHT_CHILD);
+	}
+	return NULL;
+}
+
+int splay_insert(void * base, size_t bounds)
+{
+	node * found;
+	node * last;
+	node * temp;
+
+	found = descend(base, &last);
+
+	/*
+	 * Same base as a freed node: reuse it, like the red-black tree does.
+	 */
+	if(found != NULL)
+	{
+		splay(found);
+		if(!node_free(found))
+		{
+			printf(REPORT537_OCCUPIED, base);
+			return -1;
+		}
+		set_bounds(found, bounds);
+		set_free(found, 0);
+		live_add(bounds);
+#ifdef MALLOC537_LIFETIME
+		set_stamp(found, lifetime_now());
+#endif
+		return 1;
+	}
+
+	live_add(bounds);
+	temp = create(base, bounds);
+	set_red(temp, 0);
+	if(last == NULL)
+	{
+		splay_root = temp;
+		PROBE3(node_create, base, bounds, 0);
+	}
+	else
+	{
+		set_child(last, node_base(last) > base ? LEFT_CHILD : RIGHT_CHILD, temp);
+		set_parent(temp, last);
+		PROBE3(node_create, base, bounds, PROBE_DEPTH(node_create, temp));
+		splay(temp);
+	}
+
+#ifdef MALLOC537_HASH_INDEX
+	hash_insert(&current_tree->index, base, temp);
+#endif
+	return 1;
+}
+
+/*
+ * Deletes a node we already have.
+ */
+static void cut_out(node * temp)
+{
+	node * left;
+	node * right;
+	node * biggest;
+
+#ifdef MALLOC537_HASH_INDEX
+	hash_remove(&current_tree->index, node_base(temp));
+#endif
+	PROBE3(node_delete, node_base(temp), node_bounds(temp), PROBE_DEPTH(node_delete, temp));
+
+	/*
+	 * Bring it to the root and cut it out. The biggest node on the left
+	 * gets splayed up to be the new root, which leaves it no right child
+	 * to worry about, and the right side hangs off of it.
+	 */
+	splay(temp);
+	left = node_child(temp, LEFT_CHILD);
+	right = node_child(temp, RIGHT_CHILD);
+
+	if(left == NULL)
+	{
+		splay_root = right;
+		if(right != NULL)
+		{
+			set_parent(right, NULL);
+		}
+	}
+	else
+	{
+		set_parent(left, NULL);
+		splay_root = left;
+		biggest = left;
+		while(node_child(biggest, RIGHT_CHILD) != NULL)
+		{
+			biggest = node_child(biggest, RIGHT_CHILD);
+		}
+		splay(biggest);
+		set_child(biggest, RIGHT_CHILD, right);
+		if(right != NULL)
+		{
+			set_parent(right, biggest);
+		}
+	}
+
+	destroy(temp);
+}
+
+int splay_delete_node(void * base)
+{
+	node * temp;
+	node * last;
+
+	temp = descend(base, &last);
+	if(temp == NULL)
+	{
+		printf("You cannot delete a node for a base that is not in the tree.");
+		if(last != NULL)
+		{
+			splay(last);
+		}
+		return -1;
+	}
+	cut_out(temp);
+	return 1;
+}
+
+int splay_remove_range(void * base, size_t bounds)
+{
+	node * current = splay_root;
+	node * next = NULL;
+	node * temp;
+	int removed = 0;
+
+	/*
+	 * Same walk as splay_contained_lookup, but it keeps going. Splaying
+	 * moves nodes around without changing their order, so the next
+	 * one is still next after the current one is cut out.
+	 */
+	while(current != NULL)
+	{
+		if(node_base(current) > base)
+		{
+			next = current;
+			current = node_child(current, LEFT_CHILD);
+		}
+		else
+		{
+			current = node_child(current, RIGHT_CHILD);
+		}
+	}
+
+	while(next != NULL && (size_t)node_base(next) < (size_t)base + bounds)
+	{
+		temp = next;
+		next = neighbour(next, RIGHT_CHILD);
+		if(node_free(temp) && (size_t)node_base(temp) + node_bounds(temp) < (size_t)base + bounds)
+		{
+			cut_out(temp);
+			removed++;
+		}
+	}
+	return removed;
+}
+
+/*
+ * Any balanced tree is a fine splay tree, and colors don't matter.
+ */
+void splay_build(index_entry * entries, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		live_add(entries[i].bounds);
+	}
+	splay_root = build_subtree(entries, count, NULL, 0, -1);
+}
@@ -0,0 +1,37 @@
+/*
+ * splaytree.h
+ * Splay tree index backend (MALLOC537_INDEX=splay, see backend.h).
+ * Same nodes as the red-black tree, colors just aren't used.
+ * Every lookup, insert and delete splays the node it ended up at
+ * to the root, so the blocks a program keeps going back to are
+ * always near the top.
+ */
+#ifndef SPLAYTREE_H
+#define SPLAYTREE_H
+
+#include "rbtree.h"
+
+/*
+ * These follow the rules of the rbtree.h functions with the same
+ * names, minus the splay_ on the front.
+ */
+node * splay_lookup(void * base);
+node * splay_bounds_lookup(void * base);
+node * splay_contained_lookup(void * base, size_t bounds);
+int splay_insert(void * base, size_t bounds);
+int splay_delete_node(void * base);
+int splay_remove_range(void * base, size_t bounds);
+void splay_build(index_entry * entries, size_t count);
+
+/*
+ * Root of the splay tree, NULL when it's empty.
+ */
+node * splay_top();
+
+/*
+ * Moves a node up to the root with zig, zig-zig and zig-zag steps.
+ * Internal function.
+ */
+void splay(node * target);
+
+#endif
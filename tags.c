@@ -0,0 +1,201 @@
+/*
+ * tags.c
+ * Tag lists and per-tag counts, see tags.h.
+ * Only the tagged node layout has the fields for these, so without
+ * MALLOC537_TAGS there's nothing here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "tags.h"
+
+#ifdef MALLOC537_TAGS
+
+/*
+ * Starting number of slots (a power of two). The table doubles
+ * when it's half full, so probe runs stay short.
+ */
+#define TAG_START_SLOTS 64
+
+typedef struct tag_slot
+{
+	/* 0 is an empty slot - tag 0 is never in the table. */
+	unsigned long tag;
+	node * first;
+	size_t blocks;
+	size_t bytes;
+}tag_slot;
+
+static tag_slot * slots;
+static size_t capacity;
+static size_t used;
+
+/*
+ * Fibonacci hashing, like the hash index.
+ */
+static size_t home(unsigned long tag)
+{
+	return (size_t)(((uint64_t)tag * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+/*
+ * Slot holding tag, or the empty slot it would go in.
+ * The table must exist.
+ */
+static tag_slot * find(unsigned long tag)
+{
+	size_t pos = home(tag);
+
+	while(slots[pos].tag != 0 && slots[pos].tag != tag)
+	{
+		pos = (pos + 1) & (capacity - 1);
+	}
+	return &slots[pos];
+}
+
+static void grow()
+{
+	tag_slot * old = slots;
+	size_t old_capacity = capacity;
+	size_t i;
+
+	capacity = capacity ? capacity * 2 : TAG_START_SLOTS;
+	slots = calloc(capacity, sizeof(tag_slot));
+	if(slots == NULL)
+	{
+		printf("Couldn't allocate a tag table of %lu slots!\n", (unsigned long)capacity);
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < old_capacity; i++)
+	{
+		if(old[i].tag != 0)
+		{
+			*find(old[i].tag) = old[i];
+		}
+	}
+	free(old);
+}
+
+/*
+ * Empties the slot and moves later entries of its probe run back,
+ * so no tombstones are needed.
+ */
+static void drop(tag_slot * slot)
+{
+	size_t pos = (size_t)(slot - slots);
+	size_t next = (pos + 1) & (capacity - 1);
+	size_t want;
+
+	while(slots[next].tag != 0)
+	{
+		/*
+		 * An entry can move back to pos only if pos is still
+		 * between its home and where it is now.
+		 */
+		want = home(slots[next].tag);
+		if(((next - want) & (capacity - 1)) >= ((next - pos) & (capacity - 1)))
+		{
+			slots[pos] = slots[next];
+			pos = next;
+		}
+		next = (next + 1) & (capacity - 1);
+	}
+	slots[pos].tag = 0;
+	used--;
+}
+
+void tag_add(node * n, unsigned long tag)
+{
+	tag_slot * slot;
+
+	if(tag == 0)
+	{
+		return;
+	}
+	if((used + 1) * 2 > capacity)
+	{
+		grow();
+	}
+
+	slot = find(tag);
+	if(slot->tag == 0)
+	{
+		slot->tag = tag;
+		slot->first = NULL;
+		slot->blocks = 0;
+		slot->bytes = 0;
+		used++;
+	}
+
+	set_tag(n, tag);
+	set_tag_link(n, TAG_PREV, NULL);
+	set_tag_link(n, TAG_NEXT, slot->first);
+	if(slot->first != NULL)
+	{
+		set_tag_link(slot->first, TAG_PREV, n);
+	}
+	slot->first = n;
+	slot->blocks++;
+	slot->bytes += node_bounds(n);
+}
+
+void tag_remove(node * n)
+{
+	tag_slot * slot;
+	node * prev = node_tag_link(n, TAG_PREV);
+	node * next = node_tag_link(n, TAG_NEXT);
+
+	if(node_tag(n) == 0)
+	{
+		return;
+	}
+
+	slot = find(node_tag(n));
+	if(prev != NULL)
+	{
+		set_tag_link(prev, TAG_NEXT, next);
+	}
+	else
+	{
+		slot->first = next;
+	}
+	if(next != NULL)
+	{
+		set_tag_link(next, TAG_PREV, prev);
+	}
+	slot->bytes -= node_bounds(n);
+	if(--slot->blocks == 0)
+	{
+		drop(slot);
+	}
+
+	set_tag(n, 0);
+	set_tag_link(n, TAG_PREV, NULL);
+	set_tag_link(n, TAG_NEXT, NULL);
+}
+
+node * tag_first(unsigned long tag)
+{
+	tag_slot * slot;
+
+	if(tag == 0 || slots == NULL)
+	{
+		return NULL;
+	}
+	slot = find(tag);
+	return slot->tag == tag ? slot->first : NULL;
+}
+
+size_t tag_bytes(unsigned long tag)
+{
+	tag_slot * slot;
+
+	if(tag == 0 || slots == NULL)
+	{
+		return 0;
+	}
+	slot = find(tag);
+	return slot->tag == tag ? slot->bytes : 0;
+}
+
+#endif
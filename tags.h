@@ -0,0 +1,41 @@
+/*
+ * tags.h
+ * Tagged blocks (build with -DMALLOC537_TAGS).
+ * Every block allocated with a tag is on its tag's list, a doubly linked
+ * list threaded through the tree nodes themselves, so everything with one
+ * tag can be found (and freed) without searching the tree. Each tag also
+ * counts its live blocks and bytes.
+ *
+ * Tags are kept in a small hash table; a tag with nothing left in it
+ * is dropped. Tag 0 means no tag.
+ *
+ * Caller holds the tree lock for all of these.
+ */
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stddef.h>
+#include "rbtree.h"
+
+/*
+ * Puts the live block n on tag's list.
+ */
+void tag_add(node * n, unsigned long tag);
+
+/*
+ * Takes n off its tag's list, if it has a tag.
+ */
+void tag_remove(node * n);
+
+/*
+ * First block on tag's list (follow TAG_NEXT from there),
+ * or NULL if it has none.
+ */
+node * tag_first(unsigned long tag);
+
+/*
+ * Live bytes with tag.
+ */
+size_t tag_bytes(unsigned long tag);
+
+#endif
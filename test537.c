@@ -0,0 +1,215 @@
+/*
+ * test537.c
+ * What malloc537 does, checked against whichever index backend
+ * MALLOC537_INDEX picks: blocks that are used right pass, and each
+ * kind of mistake gets its report. A mistake makes the library exit,
+ * so each of those runs in a child of its own, with its output read
+ * back through a pipe.
+ *
+ * Use: test537 (make test runs it under every backend)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "malloc537.h"
+
+/*
+ * Blocks the bigger tests keep live at once.
+ */
+#define TEST_BLOCKS 2000
+
+static int failures = 0;
+
+static void expect(int good, const char * what)
+{
+	if(!good)
+	{
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+/*
+ * Runs one mistake in a child, and checks that it exits with a failure
+ * and that the report has report in it.
+ */
+static void expect_report(void (*mistake)(), const char * report, const char * what)
+{
+	int fds[2];
+	char output[1024];
+	size_t length = 0;
+	ssize_t got;
+	pid_t child;
+	int status;
+
+	fflush(stdout);
+	if(pipe(fds) != 0)
+	{
+		printf("Couldn't make a pipe for %s!\n", what);
+		exit(EXIT_FAILURE);
+	}
+	child = fork();
+	if(child < 0)
+	{
+		printf("Couldn't fork for %s!\n", what);
+		exit(EXIT_FAILURE);
+	}
+	if(child == 0)
+	{
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		mistake();
+		exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	while(length < sizeof(output) - 1 && (got = read(fds[0], output + length, sizeof(output) - 1 - length)) > 0)
+	{
+		length += (size_t)got;
+	}
+	output[length] = '\0';
+	close(fds[0]);
+	waitpid(child, &status, 0);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_FAILURE || strstr(output, report) == NULL)
+	{
+		printf("FAIL: %s\n  wanted \"%s\", got: %s\n", what, report, length ? output : "(nothing)\n");
+		failures++;
+	}
+}
+
+/*
+ * Good use: none of these should report anything.
+ */
+static void test_malloc_free()
+{
+	char * blocks[TEST_BLOCKS];
+	int i;
+
+	for(i = 0; i < TEST_BLOCKS; i++)
+	{
+		blocks[i] = malloc537(16 + i % 200);
+		expect(blocks[i] != NULL, "malloc537 returns a block");
+		memset(blocks[i], i & 0xff, 16 + i % 200);
+	}
+	for(i = 0; i < TEST_BLOCKS; i += 2)
+	{
+		free537(blocks[i]);
+	}
+	for(i = 1; i < TEST_BLOCKS; i += 2)
+	{
+		memcheck537(blocks[i], 16 + i % 200);
+		memcheck537(blocks[i] + 8, 8 + i % 200);
+		expect(blocks[i][15] == (char)(i & 0xff), "a block keeps its contents");
+	}
+	for(i = 0; i < TEST_BLOCKS; i += 2)
+	{
+		blocks[i] = malloc537(32);
+		memcheck537(blocks[i], 32);
+	}
+	for(i = 0; i < TEST_BLOCKS; i++)
+	{
+		free537(blocks[i]);
+	}
+}
+
+static void test_realloc()
+{
+	char * block = realloc537(NULL, 64);
+	char * keep = malloc537(16);
+	int i;
+
+	expect(block != NULL, "realloc537 of NULL is malloc537");
+	for(i = 0; i < 64; i++)
+	{
+		block[i] = (char)i;
+	}
+	block = realloc537(block, 4096);
+	memcheck537(block, 4096);
+	for(i = 0; i < 64; i++)
+	{
+		expect(block[i] == (char)i, "realloc537 keeps the contents when it grows");
+	}
+	block = realloc537(block, 8);
+	memcheck537(block, 8);
+	expect(block[7] == 7, "realloc537 keeps the contents when it shrinks");
+	free537(block);
+	memcheck537(keep, 16);
+	free537(keep);
+}
+
+/*
+ * Mistakes: each one ends the child.
+ */
+static void double_free()
+{
+	char * block = malloc537(32);
+	free537(block);
+	free537(block);
+}
+
+static void interior_free()
+{
+	char * block = malloc537(32);
+	free537(block + 8);
+}
+
+static void never_allocated()
+{
+	int local;
+	free537(&local);
+}
+
+static void out_of_bounds()
+{
+	char * block = malloc537(32);
+	memcheck537(block, 33);
+}
+
+static void interior_out_of_bounds()
+{
+	char * block = malloc537(32);
+	memcheck537(block + 16, 17);
+}
+
+static void use_after_free()
+{
+	char * block = malloc537(32);
+	free537(block);
+	memcheck537(block, 1);
+}
+
+static void realloc_freed()
+{
+	char * block = malloc537(32);
+	free537(block);
+	realloc537(block, 64);
+}
+
+static void memcheck_never_allocated()
+{
+	int local;
+	memcheck537(&local, sizeof(local));
+}
+
+int main()
+{
+	const char * index = getenv("MALLOC537_INDEX");
+
+	test_malloc_free();
+	test_realloc();
+
+	expect_report(double_free, "was already freed", "double free");
+	expect_report(interior_free, "is in memory allocated starting at", "freeing a pointer inside a block");
+	expect_report(never_allocated, "was never allocated", "freeing a pointer that was never allocated");
+	expect_report(out_of_bounds, "only has a size of 32 bytes", "memcheck537 past the end of a block");
+	expect_report(interior_out_of_bounds, "not enough room", "memcheck537 from inside a block past its end");
+	expect_report(use_after_free, "was already freed", "memcheck537 on a freed block");
+	expect_report(realloc_freed, "was already freed", "realloc537 of a freed block");
+	expect_report(memcheck_never_allocated, "was never allocated", "memcheck537 on a pointer that was never allocated");
+
+	printf("%s: %s\n", index != NULL ? index : "rbtree", failures ? "FAILED" : "passed");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+/*
+ * verifier.c
+ * Incremental heap checking, see verifier.h.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "rbtree.h"
+#include "backend.h"
+#include "verifier.h"
+
+#ifdef MALLOC537_REDZONE
+#include "redzone.h"
+#endif
+
+#ifdef MALLOC537_QUARANTINE
+#include "quarantine.h"
+#endif
+
+/*
+ * How many blocks we check between looks at the clock,
+ * and how many quarantined blocks each slice looks at.
+ */
+#define VERIFY_CLOCK_EVERY 16
+#define VERIFY_QUARANTINE_BLOCKS 8
+
+static long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * First node with a base above cursor (or the smallest one, for NULL).
+ */
+static node * first_after(void * cursor)
+{
+	node * current = tree_backend->top();
+	node * best = NULL;
+
+	while(current != NULL)
+	{
+		if(cursor == NULL || node_base(current) > cursor)
+		{
+			best = current;
+			current = node_child(current, LEFT_CHILD);
+		}
+		else
+		{
+			current = node_child(current, RIGHT_CHILD);
+		}
+	}
+	return best;
+}
+
+/*
+ * In order successor, using the parent links.
+ */
+static node * next_node(node * current)
+{
+	node * parent;
+
+	if(node_child(current, RIGHT_CHILD) != NULL)
+	{
+		current = node_child(current, RIGHT_CHILD);
+		while(node_child(current, LEFT_CHILD) != NULL)
+		{
+			current = node_child(current, LEFT_CHILD);
+		}
+		return current;
+	}
+
+	parent = node_parent(current);
+	while(parent != NULL && current == node_child(parent, RIGHT_CHILD))
+	{
+		current = parent;
+		parent = node_parent(current);
+	}
+	return parent;
+}
+
+/*
+ * Black nodes from here up to the root, counting this one.
+ */
+static int black_depth(node * current)
+{
+	int depth = 0;
+	while(current != NULL)
+	{
+		depth += !node_red(current);
+		current = node_parent(current);
+	}
+	return depth;
+}
+
+/*
+ * Checks one node against its neighbours. *black_height is the black
+ * depth of the first node with a missing child we've seen this slice;
+ * every other one has to match it. Colors are only checked when the
+ * backend is a red-black tree.
+ */
+static int verify_node(node * current, node * previous, int * black_height)
+{
+	node * root = tree_backend->top();
+	int colors = tree_backend->red_black;
+	int problems = 0;
+	int side;
+	node * child;
+
+	if(node_parent(current) == NULL && current != root)
+	{
+		printf("Heap check: node for %p has no parent but isn't the root!\n", node_base(current));
+		problems++;
+	}
+	if(colors && current == root && node_red(current))
+	{
+		printf("Heap check: the root (%p) is red!\n", node_base(current));
+		problems++;
+	}
+	if(previous != NULL && node_base(previous) >= node_base(current))
+	{
+		printf("Heap check: nodes for %p and %p are out of order!\n", node_base(previous), node_base(current));
+		problems++;
+	}
+
+	for(side = LEFT_CHILD; side <= RIGHT_CHILD; side++)
+	{
+		child = node_child(current, side);
+		if(child == NULL)
+		{
+			continue;
+		}
+		if(node_parent(child) != current)
+		{
+			printf("Heap check: child %p of node for %p doesn't point back at it!\n", node_base(child), node_base(current));
+			problems++;
+		}
+		if(colors && node_red(current) && node_red(child))
+		{
+			printf("Heap check: red node for %p has a red child (%p)!\n", node_base(current), node_base(child));
+			problems++;
+		}
+	}
+
+	if(colors && (node_child(current, LEFT_CHILD) == NULL || node_child(current, RIGHT_CHILD) == NULL))
+	{
+		int depth = black_depth(current);
+		if(*black_height == 0)
+		{
+			*black_height = depth;
+		}
+		else if(depth != *black_height)
+		{
+			printf("Heap check: node for %p has black height %d, expected %d!\n", node_base(current), depth, *black_height);
+			problems++;
+		}
+	}
+
+#ifdef MALLOC537_REDZONE
+	if(!node_free(current))
+	{
+		problems += redzone_verify(node_base(current), node_bounds(current));
+	}
+#endif
+
+	return problems;
+}
+
+int verify_slice(void ** cursor, long budget_ns)
+{
+	long deadline = now_ns() + budget_ns;
+	int problems = 0;
+	int black_height = 0;
+	int checked = 0;
+	node * previous = NULL;
+	node * current = first_after(*cursor);
+
+	/*
+	 * Off the end last time - start over from the smallest block.
+	 */
+	if(current == NULL)
+	{
+		*cursor = NULL;
+		current = first_after(NULL);
+	}
+
+	while(current != NULL)
+	{
+		problems += verify_node(current, previous, &black_height);
+		*cursor = node_base(current);
+		previous = current;
+		current = next_node(current);
+
+		checked++;
+		if(checked % VERIFY_CLOCK_EVERY == 0 && now_ns() >= deadline)
+		{
+			break;
+		}
+	}
+
+#ifdef MALLOC537_QUARANTINE
+	problems += quarantine_verify_some(VERIFY_QUARANTINE_BLOCKS);
+#endif
+
+	return problems;
+}
@@ -0,0 +1,21 @@
+/*
+ * verifier.h
+ * Incremental heap checking for the background verifier
+ * (build with -DMALLOC537_VERIFIER).
+ */
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+/*
+ * Checks blocks in address order, starting after *cursor, until
+ * budget_ns is used up. Hitting the end of the tree wraps back to the
+ * start next time. For each block: its links, ordering and (for the
+ * red-black tree) colors, and its redzones and the quarantine's poison
+ * if those are built in.
+ * Moves *cursor to the last block checked, and returns how many problems
+ * it found (each one already printed).
+ * Caller holds the tree lock.
+ */
+int verify_slice(void ** cursor, long budget_ns);
+
+#endif